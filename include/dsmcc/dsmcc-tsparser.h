@@ -12,6 +12,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /** \defgroup tsparser TS Parser
  *  \{
@@ -23,26 +24,99 @@ struct dsmcc_state;
 /** Opaque structure used by the TS Parser */
 struct dsmcc_tsparser_buffer;
 
+/** Counters kept by the TS Parser for each tracked PID */
+struct dsmcc_tsparser_pid_stats
+{
+	uint64_t packets;         /*< number of packets received on the PID */
+	uint32_t cc_errors;       /*< number of continuity counter errors */
+	uint32_t duplicates;      /*< number of duplicate packets skipped */
+	uint32_t discontinuities; /*< number of packets with the discontinuity indicator set */
+	uint32_t sections;        /*< number of sections passed to the library */
+	uint32_t filtered;        /*< number of sections dropped by the section filters (see dsmcc_tsparser_set_section_filtering) */
+
+	uint32_t arrival_time; /*< arrival_time_stamp (27 MHz clock) of the last packet, only set for 192 bytes M2TS packets */
+};
+
 /** \brief Allocate a buffer for a PID in the list of section buffers used by the TS Parser
   * \param buffers a pointer to the list of buffers
   * \param pid the PID
   */
 void dsmcc_tsparser_add_pid(struct dsmcc_tsparser_buffer **buffers, uint16_t pid);
 
+/** \brief Remove the buffer of a PID from the list of section buffers used by the TS Parser
+  * The section being assembled on this PID, if any, is dropped.
+  * \param buffers a pointer to the list of buffers
+  * \param pid the PID
+  */
+void dsmcc_tsparser_remove_pid(struct dsmcc_tsparser_buffer **buffers, uint16_t pid);
+
+/** \brief Enable or disable automatic PID tracking in the TS Parser
+  * When enabled, the TS Parser adds and removes PIDs by itself to follow the streams where the library is waiting
+  * for DSI, DII or DDB messages, including the streams found from association tags. This is checked each time
+  * data is parsed. The PIDs added with dsmcc_tsparser_add_pid are never removed automatically. Disabling it removes
+  * the PIDs that were only added by the tracking.
+  * \param buffers a pointer to the list of buffers
+  * \param enable true to enable PID tracking, false to only parse the PIDs added with dsmcc_tsparser_add_pid (the default)
+  */
+void dsmcc_tsparser_set_pid_tracking(struct dsmcc_tsparser_buffer **buffers, bool enable);
+
+/** \brief Get the counters of a tracked PID
+  * \param buffers the list of buffers
+  * \param pid the PID
+  * \param stats pointer to the structure where the counters will be copied
+  * \return 0 if successful, <0 if the PID is not tracked
+  */
+int dsmcc_tsparser_get_pid_stats(struct dsmcc_tsparser_buffer *buffers, uint16_t pid, struct dsmcc_tsparser_pid_stats *stats);
+
 /** \brief Free all the buffers used by the TS Parser
   * \param buffers a pointer to the list of buffers
   */
 void dsmcc_tsparser_free_buffers(struct dsmcc_tsparser_buffer **buffers);
 
+/** \brief Set the size of the packets given to dsmcc_tsparser_parse_buffer
+  * \param buffers a pointer to the list of buffers
+  * \param packet_size 188, 192 (M2TS, 4 bytes timestamp header) or 204 (Reed-Solomon parity trailer),
+  * or 0 to detect it from the periodicity of the sync bytes (the default)
+  */
+void dsmcc_tsparser_set_packet_size(struct dsmcc_tsparser_buffer **buffers, int packet_size);
+
+/** \brief Get the size of the packets currently parsed by dsmcc_tsparser_parse_buffer
+  * \param buffers the list of buffers
+  * \return the packet size or 0 if it has not been detected yet
+  */
+int dsmcc_tsparser_get_packet_size(struct dsmcc_tsparser_buffer *buffers);
+
+/** \brief Enable or disable section filtering in the TS Parser
+  * When enabled, the sections are matched against the section filters set by the carousels of the state (the same
+  * filters passed to the add_section_filter callback) as soon as their first bytes are received, and the sections
+  * that do not match any filter are dropped before being copied and passed to the library.
+  * Sections received before the library set the corresponding filter (for example the DDBs following a new DII in
+  * the stream) are dropped too and will only be acquired on the next carousel cycle.
+  * \param buffers a pointer to the list of buffers
+  * \param enable true to enable section filtering, false to pass all sections to the library (the default)
+  */
+void dsmcc_tsparser_set_section_filtering(struct dsmcc_tsparser_buffer **buffers, bool enable);
+
 /** \brief Parse a single TS packet. It will be added to current sections buffers and in case of complete section, dsmcc_parse_section will be called.
   * \param state the library state
   * \param buffers a pointer to the list of buffers
   * \param packet the packet data
-  * \param packet_length the packet length (should be 188)
+  * \param packet_length the packet length (188, 192 for M2TS packets or 204 for packets with Reed-Solomon parity bytes)
   */
 void dsmcc_tsparser_parse_packet(struct dsmcc_state *state, struct dsmcc_tsparser_buffer **buffers, uint8_t *packet, int packet_length);
 
-/** \brief Call dsmcc_parse_section on all current section buffers.
+/** \brief Parse a buffer of TS data. The buffer does not need to start or end on a packet boundary: the parser locks on the
+  * sync bytes, resynchronizes if the sync is lost and keeps the start of a packet split across calls until the next one.
+  * The packets are parsed in place whatever their size (see dsmcc_tsparser_set_packet_size).
+  * \param state the library state
+  * \param buffers a pointer to the list of buffers
+  * \param data the TS data
+  * \param data_length the length of the TS data
+  */
+void dsmcc_tsparser_parse_buffer(struct dsmcc_state *state, struct dsmcc_tsparser_buffer **buffers, uint8_t *data, int data_length);
+
+/** \brief Reset the section buffers at the end of a stream.
+  * Sections are queued as soon as they are complete, so the sections still being assembled are dropped.
   * \param state the library state
   * \param buffers a pointer to the list of buffers
   */
@@ -13,6 +13,7 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 /** \defgroup logging Logging
  *  \{
@@ -56,6 +57,9 @@ void dsmcc_set_logger(dsmcc_logger_t *logger, int severity);
  *  \{
  */
 
+/** Callbacks to the DVB stack, called from the parsing threads. With several parsing threads or an executor (see
+  * dsmcc_state_parameters), they can be called concurrently and must be thread-safe.
+  */
 struct dsmcc_dvb_callbacks
 {
 	/** \brief Callback called when the library needs to find the PID for a given association tag
@@ -82,6 +86,13 @@ struct dsmcc_dvb_callbacks
 	void *add_section_filter_arg;
 };
 
+enum
+{
+	DSMCC_PRIORITY_FOREGROUND = 0, /**< carousel the user is waiting for */
+	DSMCC_PRIORITY_BACKGROUND      /**< its DDB sections and modules are processed after those of the foreground carousels,
+	                                    its DDB sections are dropped first when the queue is full and never block dsmcc_add_section */
+};
+
 /** \brief structure used to pass parameters to function
   * \param type DSMCC_DATA_CAROUSEL or DSMCC_OBJECT_CAROUSEL
   * \param pid the PID of the stream where the carousel DSI message is broadcasted
@@ -113,6 +124,73 @@ struct dsmcc_state;
   */
 struct dsmcc_state *dsmcc_open(const char *cachedir, bool keep_cache, struct dsmcc_dvb_callbacks *callbacks);
 
+/** Opaque type of a pool of threads shared by several library states */
+struct dsmcc_executor;
+
+/** \brief Create a pool of threads that can be shared by several library states, see dsmcc_state_parameters. The
+  * parsing threads of a state run on a thread of the pool, and an idle thread takes over the pending work of the
+  * others, so that the number of threads does not grow with the number of states.
+  * \param threads number of threads running the parsing of the states (0 for a single thread)
+  * \param workers number of threads uncompressing and parsing the downloaded modules of the states (0 for a single
+  * thread)
+  */
+struct dsmcc_executor *dsmcc_executor_new(int threads, int workers);
+
+/** \brief Stop the threads of the pool, once all the states using it are closed
+  * \param executor the pool
+  */
+void dsmcc_executor_free(struct dsmcc_executor *executor);
+
+/** \brief structure used to pass parameters to dsmcc_open2
+  * \param threads number of parsing threads, each carousel is parsed by the thread chosen from the PID of its DSI
+  * message (0 for a single thread). With more than one thread, or with an executor, the callbacks of
+  * dsmcc_dvb_callbacks and dsmcc_carousel_callbacks can be called concurrently and must be thread-safe.
+  * \param workers number of threads uncompressing and parsing the downloaded modules and extracting their files, so
+  * that the parsing threads do not wait for them (0 for a single thread)
+  * \param threadless if 1, no parsing thread is created, the caller processes the queued sections and requests with
+  * dsmcc_process when the file descriptor returned by dsmcc_get_fd is readable
+  * \param async_callbacks if 1, the dentry_saved, download_progression and carousel_status_changed callbacks are
+  * called from a dedicated thread instead of the parsing threads, in the same order. A download_progression
+  * notification is skipped if a more recent one for the same carousel is pending. These callbacks can be called after
+  * dsmcc_dequeue_carousel returns, until dsmcc_close returns.
+  * \param executor if not NULL, no thread is created for the state, its parsing threads run on the threads of the
+  * executor, and its modules are processed by the workers of the executor (workers is ignored). Ignored in threadless
+  * mode.
+  */
+struct dsmcc_state_parameters
+{
+	int  threads;
+	int  workers;
+	bool threadless;
+	bool async_callbacks;
+	struct dsmcc_executor *executor;
+};
+
+/** \brief Initialize the DSM-CC parser with several parsing threads
+  * \param cachedir the cache directory that will be used, see dsmcc_open
+  * \param keep_cache if 0 the cache files will be removed at close
+  * \param callbacks the callbacks that will be called when the library needs to interract with DVB stack
+  * \param parameters the parameters of the parser
+  */
+struct dsmcc_state *dsmcc_open2(const char *cachedir, bool keep_cache, struct dsmcc_dvb_callbacks *callbacks,
+		struct dsmcc_state_parameters *parameters);
+
+/** \brief Get the file descriptor to poll in threadless mode
+  * \param state the library state
+  * \return a file descriptor that becomes readable when queued sections or requests are pending or a timeout is
+  * due, or -1 if the library was not opened in threadless mode
+  */
+int dsmcc_get_fd(struct dsmcc_state *state);
+
+/** \brief Process the queued sections and requests and the expired timeouts, in threadless mode. Callbacks are
+  * called from this function.
+  * \param state the library state
+  * \param budget the maximum number of queued sections and requests to process, 0 for the queue size of each parsing
+  * thread
+  * \return the number of processed sections and requests
+  */
+int dsmcc_process(struct dsmcc_state *state, int budget);
+
 /** \brief Add a MPEG section that will be processed by the parsing thread
   * \param state the library state
   * \param pid the PID of the stream from which the section originates
@@ -122,6 +200,87 @@ struct dsmcc_state *dsmcc_open(const char *cachedir, bool keep_cache, struct dsm
   */
 void dsmcc_add_section(struct dsmcc_state *state, uint16_t pid, uint8_t *data, int data_length);
 
+/** \brief Add several MPEG sections from the same PID at once, with less locking and a single wake-up of the parsing thread
+  * \param state the library state
+  * \param pid the PID of the stream from which the sections originate
+  * \param sections the data and length of each section
+  * \param count the number of sections
+  */
+void dsmcc_add_sections(struct dsmcc_state *state, uint16_t pid, const struct iovec *sections, int count);
+
+/** \brief Callback called when the library does not need a section added by dsmcc_add_section_ref anymore
+  * \param arg opaque argument (passed as-is from dsmcc_add_section_ref)
+  * \param data the section data
+  * \param data_length the length of the section data
+  */
+typedef void (dsmcc_section_release_t)(void *arg, uint8_t *data, int data_length);
+
+/** \brief Add a MPEG section without copying it. The buffer must stay valid until the release callback is called, by
+  * the parsing thread after the section is parsed, or by any thread calling the library if the section is dropped
+  * \param state the library state
+  * \param pid the PID of the stream from which the section originates
+  * \param data the section data
+  * \param data_length the total length of the data buffer
+  * \param release the callback called when the buffer is not used anymore (may be NULL)
+  * \param arg opaque argument for the release callback
+  */
+void dsmcc_add_section_ref(struct dsmcc_state *state, uint16_t pid, uint8_t *data, int data_length,
+		dsmcc_section_release_t *release, void *arg);
+
+/** What to do with a new DDB section when the queue of the parsing thread is full */
+enum
+{
+	DSMCC_QUEUE_POLICY_BLOCK = 0,  /**< wait in dsmcc_add_section until the thread has made room (default) */
+	DSMCC_QUEUE_POLICY_DROP_OLDEST, /**< drop the oldest queued DDB sections to make room */
+	DSMCC_QUEUE_POLICY_DROP_NEWEST  /**< drop the new section */
+};
+
+/** \brief Limit the DDB sections queued for each parsing thread. DSI/DII sections and control requests are never dropped
+  * \param state the library state
+  * \param max_sections maximum number of queued DDB sections, 0 for the default (and maximum) queue size
+  * \param max_bytes maximum size of the queued DDB sections, 0 for no limit
+  * \param policy DSMCC_QUEUE_POLICY_BLOCK, DSMCC_QUEUE_POLICY_DROP_OLDEST or DSMCC_QUEUE_POLICY_DROP_NEWEST
+  */
+void dsmcc_set_queue_limits(struct dsmcc_state *state, uint32_t max_sections, uint32_t max_bytes, int policy);
+
+/** \brief Limit the rate at which each parsing thread processes the DDB sections of the background carousels. The
+  * sections over the budget stay in the queue, see dsmcc_set_queue_limits.
+  * \param state the library state
+  * \param bytes_per_second the budget, 0 for no limit
+  */
+void dsmcc_set_background_budget(struct dsmcc_state *state, uint32_t bytes_per_second);
+
+/** Where the CRC of the sections is checked */
+enum
+{
+	DSMCC_CRC_CHECK_PARSER = 0, /**< by the parsing thread (default) */
+	DSMCC_CRC_CHECK_PRODUCER,   /**< by the thread adding the section, corrupt sections are not queued */
+	DSMCC_CRC_CHECK_NONE        /**< not checked, the demux already drops the corrupt sections */
+};
+
+/** \brief Choose where the CRC of the sections is checked. Checking it in dsmcc_add_section and the TS parser moves
+  * its cost off the parsing threads, which process the sections of their carousels one at a time.
+  * \param state the library state
+  * \param mode DSMCC_CRC_CHECK_PARSER, DSMCC_CRC_CHECK_PRODUCER or DSMCC_CRC_CHECK_NONE
+  */
+void dsmcc_set_crc_check(struct dsmcc_state *state, int mode);
+
+struct dsmcc_queue_stats
+{
+	uint32_t queued_sections; /**< DDB sections currently queued */
+	uint32_t queued_bytes;    /**< size of the DDB sections currently queued */
+	uint64_t dropped_oldest;  /**< DDB sections dropped by DSMCC_QUEUE_POLICY_DROP_OLDEST */
+	uint64_t dropped_newest;  /**< DDB sections dropped by DSMCC_QUEUE_POLICY_DROP_NEWEST */
+	uint64_t dropped_known;   /**< DDB sections of blocks already stored, dropped before being queued */
+	uint64_t blocked;         /**< number of times dsmcc_add_section waited for room in the queue */
+};
+
+/** \brief Get the state of the queues of DDB sections, summed over all the parsing threads
+  * \param state the library state
+  * \param stats pointer to the structure that will be filled
+  */
+void dsmcc_get_queue_stats(struct dsmcc_state *state, struct dsmcc_queue_stats *stats);
+
 /** \brief Free the memory used by the library (and the cache files if keep_state was 0 on dsmcc_init call)
   * \param state the library state
   */
@@ -141,6 +300,11 @@ enum
 	DSMCC_STATUS_DONE
 };
 
+/** Callbacks of a queued carousel, called from the parsing thread of the carousel, or from the dedicated thread of
+  * async_callbacks for dentry_saved, download_progression and carousel_status_changed (see dsmcc_state_parameters).
+  * With several parsing threads or an executor, the callbacks of the carousels can be called concurrently and must be
+  * thread-safe.
+  */
 struct dsmcc_carousel_callbacks
 {
 	/** \brief Callback called for each directory/file in the carousel to determine if it should be saved or not
@@ -199,6 +363,17 @@ struct dsmcc_carousel_callbacks
 uint32_t dsmcc_queue_carousel2(struct dsmcc_state *state, struct dsmcc_parameters *parameters,
 		struct dsmcc_carousel_callbacks *callbacks);
 
+/** \brief Add a carousel to the list of carousels to be downloaded, with a priority. dsmcc_queue_carousel2 queues it
+  * in the foreground.
+  * \param state the library state
+  * \param parameters structure containing parameters for a given carousel
+  * \param callbacks the callback that will be called during/after carousel download
+  * \param priority DSMCC_PRIORITY_FOREGROUND or DSMCC_PRIORITY_BACKGROUND
+  * \return a carousel queue ID that will be used to remove the carousel
+  */
+uint32_t dsmcc_queue_carousel3(struct dsmcc_state *state, struct dsmcc_parameters *parameters,
+		struct dsmcc_carousel_callbacks *callbacks, int priority);
+
 /** \brief deprecated API for compatibility */
 uint32_t dsmcc_queue_carousel(struct dsmcc_state *state, uint16_t pid, uint32_t transaction_id,
 		const char *downloadpath, struct dsmcc_carousel_callbacks *callbacks);
@@ -235,6 +410,88 @@ uint32_t dsmcc_transaction_id(struct dsmcc_state *state, uint32_t queue_id);
 
 /** \} */ // end of 'cache' group
 
+/** \defgroup query Status Queries
+ *  \{
+ */
+
+enum
+{
+	DSMCC_MODULE_STATUS_DOWNLOADING,
+	DSMCC_MODULE_STATUS_PROCESSING,
+	DSMCC_MODULE_STATUS_COMPLETE,
+	DSMCC_MODULE_STATUS_INVALID
+};
+
+/** \brief state of a module of a carousel
+  * \param module_id the module ID
+  * \param module_version the module version
+  * \param status one of the DSMCC_MODULE_STATUS_* values
+  * \param size the module size in bytes
+  * \param downloaded the amount of bytes downloaded so far
+  */
+struct dsmcc_module_status
+{
+	uint16_t module_id;
+	uint8_t  module_version;
+	int      status;
+	uint32_t size;
+	uint32_t downloaded;
+};
+
+/** \brief directory or file saved to disk
+  * \param dir 0 if the dentry is a file, any other value indicate that the dentry is a directory
+  * \param path the directory/file path relative to the carousel root
+  */
+struct dsmcc_dentry_status
+{
+	bool        dir;
+	const char *path;
+};
+
+/** \brief state of a queued carousel at a given time, it is not modified once returned
+  * \param queue_id the queue ID that was returned by dsmcc_queue_carousel
+  * \param cid the carousel ID
+  * \param status the carousel status, one of the DSMCC_STATUS_* values
+  * \param transaction_id the transaction identifier of the DSI
+  * \param downloaded the amount of bytes downloaded so far
+  * \param total the total carousel size in bytes, 0 if it is not known yet
+  * \param module_count the number of modules
+  * \param modules the state of each module
+  * \param dentry_count the number of saved directories and files
+  * \param dentries the saved directories and files
+  */
+struct dsmcc_carousel_snapshot
+{
+	uint32_t queue_id;
+	uint32_t cid;
+	int      status;
+	uint32_t transaction_id;
+	uint32_t downloaded;
+	uint32_t total;
+
+	int                               module_count;
+	const struct dsmcc_module_status *modules;
+
+	int                               dentry_count;
+	const struct dsmcc_dentry_status *dentries;
+};
+
+/** \brief Get the state of a queued carousel. The parsing threads publish it after each batch of sections that changed
+  * it, the call does not take any lock and does not wait for them.
+  * \param state the library state
+  * \param queue_id the queue ID that was returned by dsmcc_queue_carousel
+  * \return the state of the carousel, to be released with dsmcc_carousel_snapshot_release, or NULL if the carousel
+  * is not queued (or the request was not processed yet)
+  */
+struct dsmcc_carousel_snapshot *dsmcc_carousel_snapshot_get(struct dsmcc_state *state, uint32_t queue_id);
+
+/** \brief Release a carousel state returned by dsmcc_carousel_snapshot_get
+  * \param snapshot the carousel state
+  */
+void dsmcc_carousel_snapshot_release(struct dsmcc_carousel_snapshot *snapshot);
+
+/** \} */ // end of 'query' group
+
 #ifdef __cplusplus
 }
 #endif
@@ -49,6 +49,15 @@ struct dsmcc_cached_file
 	struct dsmcc_cached_file *next, *prev;
 };
 
+/* directory or file saved to disk, for the carousel snapshots */
+struct dsmcc_saved_dentry
+{
+	bool  dir;
+	char *path;
+
+	struct dsmcc_saved_dentry *next;
+};
+
 struct dsmcc_file_cache
 {
 	struct dsmcc_object_carousel   *carousel;
@@ -56,12 +65,17 @@ struct dsmcc_file_cache
 	char                           *downloadpath;
 	struct dsmcc_carousel_callbacks callbacks;
 	int                             last_carousel_status;
+	int                             priority;             /*< DSMCC_PRIORITY_* of the request */
 
 	struct dsmcc_cached_dir  *gateway;
 	struct dsmcc_cached_dir  *orphan_dirs;
 	struct dsmcc_cached_file *orphan_files;
 	struct dsmcc_cached_file *nameless_files;
 
+	struct dsmcc_saved_dentry *saved_dentries, *last_saved_dentry;
+	int                        saved_dentry_count;
+	uint32_t                   saved_version;      /*< incremented each time saved_dentries changes */
+
 	struct dsmcc_file_cache *prev, *next;
 };
 
@@ -76,13 +90,17 @@ static int idcmp(struct dsmcc_object_id *id1, struct dsmcc_object_id *id2)
 	return (id1->key & id1->key_mask) == (id2->key & id2->key_mask);
 }
 
-struct dsmcc_file_cache *dsmcc_filecache_add(struct dsmcc_object_carousel *carousel, uint32_t queue_id, const char *downloadpath, struct dsmcc_carousel_callbacks *callbacks)
+struct dsmcc_file_cache *dsmcc_filecache_add(struct dsmcc_object_carousel *carousel, uint32_t queue_id, const char *downloadpath, struct dsmcc_carousel_callbacks *callbacks, int priority)
 {
 	struct dsmcc_file_cache *filecache;
 
 	filecache = calloc(1, sizeof(struct dsmcc_file_cache));
 	filecache->carousel = carousel;
 	filecache->queue_id = queue_id;
+	filecache->priority = priority;
+	dsmcc_snapshot_invalidate(carousel->shard);
+	/* DDB sections of this carousel go to the DDB queue */
+	dsmcc_table_ids_update(carousel->state, carousel->section_control_table_id, carousel->section_data_table_id, 1);
 	filecache->last_carousel_status = -1;
 
 	filecache->downloadpath = strdup(downloadpath);
@@ -156,8 +174,25 @@ static void free_dirs(struct dsmcc_cached_dir *dir)
 	free(dir);
 }
 
+static void free_saved_dentries(struct dsmcc_file_cache *filecache)
+{
+	struct dsmcc_saved_dentry *dentry, *next;
+
+	for (dentry = filecache->saved_dentries; dentry; dentry = next)
+	{
+		next = dentry->next;
+		free(dentry->path);
+		free(dentry);
+	}
+	filecache->saved_dentries = filecache->last_saved_dentry = NULL;
+	filecache->saved_dentry_count = 0;
+	filecache->saved_version++;
+	dsmcc_snapshot_invalidate(filecache->carousel->shard);
+}
+
 static void dsmcc_filecache_clear(struct dsmcc_file_cache *filecache)
 {
+	free_saved_dentries(filecache);
 	free_dirs(filecache->gateway);
 	filecache->gateway = NULL;
 	free_dirs(filecache->orphan_dirs);
@@ -184,17 +219,21 @@ void dsmcc_filecache_remove_all(struct dsmcc_object_carousel *carousel)
 	{
 		next = filecache->next;
 
+		dsmcc_table_ids_update(carousel->state, carousel->section_control_table_id, carousel->section_data_table_id, -1);
 		dsmcc_filecache_clear(filecache);
 		free(filecache->downloadpath);
 		free(filecache);
 	}
 
 	carousel->filecaches = NULL;
+	dsmcc_snapshot_invalidate(carousel->shard);
 }
 
 void dsmcc_filecache_remove(struct dsmcc_file_cache *filecache)
 {
 	DSMCC_DEBUG("Removing filecache with queue_id %u", filecache->queue_id);
+	dsmcc_table_ids_update(filecache->carousel->state, filecache->carousel->section_control_table_id,
+			filecache->carousel->section_data_table_id, -1);
 	dsmcc_filecache_clear(filecache);
 	free(filecache->downloadpath);
 	if (filecache->next)
@@ -203,6 +242,7 @@ void dsmcc_filecache_remove(struct dsmcc_file_cache *filecache)
 		filecache->prev->next = filecache->next;
 	else
 		filecache->carousel->filecaches = filecache->next;
+	dsmcc_snapshot_invalidate(filecache->carousel->shard);
 	free(filecache);
 }
 
@@ -211,6 +251,23 @@ struct dsmcc_file_cache *dsmcc_filecache_next(struct dsmcc_file_cache *filecache
 	return filecache->next;
 }
 
+static void add_saved_dentry(struct dsmcc_file_cache *filecache, bool dir, const char *path)
+{
+	struct dsmcc_saved_dentry *dentry;
+
+	dentry = calloc(1, sizeof(struct dsmcc_saved_dentry));
+	dentry->dir = dir;
+	dentry->path = strdup(path);
+	if (filecache->last_saved_dentry)
+		filecache->last_saved_dentry->next = dentry;
+	else
+		filecache->saved_dentries = dentry;
+	filecache->last_saved_dentry = dentry;
+	filecache->saved_dentry_count++;
+	filecache->saved_version++;
+	dsmcc_snapshot_invalidate(filecache->carousel->shard);
+}
+
 static void add_file_to_list(struct dsmcc_cached_file **list_head, struct dsmcc_cached_file *file)
 {
 	file->next = *list_head;
@@ -314,12 +371,13 @@ int dsmcc_filecache_write_file(struct dsmcc_file_cache *filecache, const char *f
 	if (dsmcc_file_link(fn, data_file, data_size, file_path))
 	{
 		written = 1;
+		add_saved_dentry(filecache, 0, file_path);
 
 		if (filecache->callbacks.dentry_saved)
 		{
 			DSMCC_DEBUG("Filecache calling callback dentry_saved(%u, 0x%08x, 0, '%s', '%s')",
 					filecache->queue_id, filecache->carousel->cid, file_path, fn);
-			(*filecache->callbacks.dentry_saved)(filecache->callbacks.dentry_saved_arg,
+			dsmcc_dispatch_dentry_saved(filecache->carousel->state->dispatcher, &filecache->callbacks,
 					filecache->queue_id, filecache->carousel->cid, 0, file_path, fn);
 		}
 	}
@@ -388,13 +446,15 @@ static void write_dir(struct dsmcc_file_cache *filecache, struct dsmcc_cached_di
 	DSMCC_DEBUG("Creating directory %s", dn);
 	mkdir(dn, 0770);
 	dir->written = 1;
+	if (!gateway)
+		add_saved_dentry(filecache, 1, dir->path);
 
 	/* register and call callback (except for gateway) */
 	if (!gateway && filecache->callbacks.dentry_saved)
 	{
 		DSMCC_DEBUG("Filecache calling callback dentry_saved(%u, 0x%08x, 1, '%s', '%s')",
 				filecache->queue_id, filecache->carousel->cid, dir->path, dn);
-		(*filecache->callbacks.dentry_saved)(filecache->callbacks.dentry_saved_arg,
+		dsmcc_dispatch_dentry_saved(filecache->carousel->state->dispatcher, &filecache->callbacks,
 				filecache->queue_id, filecache->carousel->cid, 1, dir->path, dn);
 	}
 
@@ -628,7 +688,7 @@ void dsmcc_filecache_notify_progression(struct dsmcc_object_carousel *carousel,
 	{
 		DSMCC_DEBUG("Filecache calling callback download_progression(%u, 0x%08x, %u, %u)",
 				filecache->queue_id, filecache->carousel->cid, downloaded, total);
-		(*filecache->callbacks.download_progression)(filecache->callbacks.download_progression_arg,
+		dsmcc_dispatch_progression(filecache->carousel->state->dispatcher, &filecache->callbacks,
 				filecache->queue_id, filecache->carousel->cid, downloaded, total);
 	}
 	else
@@ -645,9 +705,11 @@ void dsmcc_filecache_notify_status(struct dsmcc_object_carousel *carousel, struc
 		if (filecache->carousel->status != filecache->last_carousel_status)
 		{
 			filecache->last_carousel_status = filecache->carousel->status;
+			/* the application may query the carousel from the callback */
+			dsmcc_snapshot_publish_carousel(filecache->carousel->shard, filecache->carousel);
 			DSMCC_DEBUG("Filecache calling callback carousel_status_changed(%u, 0x%08x, %d)",
 					filecache->queue_id, filecache->carousel->cid, filecache->carousel->status);
-			(*filecache->callbacks.carousel_status_changed)(filecache->callbacks.carousel_status_changed_arg,
+			dsmcc_dispatch_status_changed(filecache->carousel->state->dispatcher, &filecache->callbacks,
 					filecache->queue_id, filecache->carousel->cid, filecache->carousel->status);
 		}
 	}
@@ -658,7 +720,36 @@ void dsmcc_filecache_notify_status(struct dsmcc_object_carousel *carousel, struc
 	}
 }
 
-uint32_t dsmcc_filecache_transaction_id(struct dsmcc_file_cache *filecache)
+uint32_t dsmcc_filecache_queue_id(struct dsmcc_file_cache *filecache)
+{
+	return filecache->queue_id;
+}
+
+int dsmcc_filecache_priority(struct dsmcc_file_cache *filecache)
+{
+	return filecache->priority;
+}
+
+uint32_t dsmcc_filecache_saved_version(struct dsmcc_file_cache *filecache)
 {
-	return filecache ? filecache->carousel ? filecache->carousel->dsi_transaction_id : 0 : 0;
+	return filecache->saved_version;
+}
+
+/**
+  * returns the number of directories and files saved to disk, and their paths in an array allocated with malloc
+  */
+int dsmcc_filecache_get_saved_dentries(struct dsmcc_file_cache *filecache, struct dsmcc_dentry_status **dentries)
+{
+	struct dsmcc_saved_dentry *dentry;
+	int i = 0;
+
+	*dentries = calloc(filecache->saved_dentry_count ? filecache->saved_dentry_count : 1, sizeof(struct dsmcc_dentry_status));
+	for (dentry = filecache->saved_dentries; dentry; dentry = dentry->next)
+	{
+		(*dentries)[i].dir = dentry->dir;
+		(*dentries)[i].path = strdup(dentry->path);
+		i++;
+	}
+
+	return i;
 }
@@ -10,7 +10,7 @@ struct dsmcc_object_carousel;
 
 struct dsmcc_file_cache;
 
-struct dsmcc_file_cache *dsmcc_filecache_add(struct dsmcc_object_carousel *carousel, uint32_t queue_id, const char *downloadpath, struct dsmcc_carousel_callbacks *callbacks);
+struct dsmcc_file_cache *dsmcc_filecache_add(struct dsmcc_object_carousel *carousel, uint32_t queue_id, const char *downloadpath, struct dsmcc_carousel_callbacks *callbacks, int priority);
 void dsmcc_filecache_remove(struct dsmcc_file_cache *filecache);
 void dsmcc_filecache_remove_all(struct dsmcc_object_carousel *carousel);
 
@@ -29,6 +29,9 @@ void dsmcc_filecache_notify_status(struct dsmcc_object_carousel *carousel, struc
 /* /!\ skip cache and write a file directly */
 int dsmcc_filecache_write_file(struct dsmcc_file_cache *filecache, const char *file_path, const char *data_file, int data_size);
 
-uint32_t dsmcc_filecache_transaction_id(struct dsmcc_file_cache *filecache);
+uint32_t dsmcc_filecache_queue_id(struct dsmcc_file_cache *filecache);
+int dsmcc_filecache_priority(struct dsmcc_file_cache *filecache);
+uint32_t dsmcc_filecache_saved_version(struct dsmcc_file_cache *filecache);
+int dsmcc_filecache_get_saved_dentries(struct dsmcc_file_cache *filecache, struct dsmcc_dentry_status **dentries);
 
 #endif /* DSMCC_CACHE_FILE_H */
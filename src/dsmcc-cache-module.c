@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "dsmcc.h"
 #include "dsmcc-cache-module.h"
@@ -57,6 +58,8 @@ struct dsmcc_module_partial
 	uint32_t downloaded_bytes;
 
 	uint32_t block_timeout;
+
+	struct dsmcc_module_job *job; /*< set while the downloaded module is processed by a worker */
 };
 
 /* data for completed module */
@@ -87,10 +90,43 @@ struct dsmcc_module
 		struct dsmcc_module_complete complete;
 	} data;
 
+	struct dsmcc_ddb_index_entry *ddb_index; /*< blocks stored, published for the producers */
+
+	int                      ddb_pid;     /*< PID of the DDBs of the module, -1 if not known */
+	uint32_t                 mod_timeout; /*< module timeout announced in the DII */
+
 	struct dsmcc_module *next, *prev;
 };
 
-static void free_dentries(struct dsmcc_module_dentry_list *list, bool keep_cache)
+/* processing of a downloaded module by a worker thread */
+struct dsmcc_module_job
+{
+	struct dsmcc_job job;
+
+	/* only used by the parsing thread */
+	struct dsmcc_shard           *shard;
+	struct dsmcc_object_carousel *carousel;
+	struct dsmcc_module          *module;   /*< NULL if the module was freed while it was processed */
+
+	/* only used by the worker thread until the job is done */
+	struct dsmcc_state    *state;
+	int                    type;      /*< DSMCC_OBJECT_CAROUSEL or DSMCC_DATA_CAROUSEL */
+	struct dsmcc_module_id id;
+	bool                   compressed;
+	uint32_t               size;      /*< size of the module data, once uncompressed */
+	char                  *data_file; /*< module data, moved out of the way of a new download of the module */
+
+	/* result */
+	bool                         ok;
+	struct dsmcc_module_complete complete;
+};
+
+size_t dsmcc_cache_dentry_size(void)
+{
+	return sizeof(struct dsmcc_module_dentry);
+}
+
+static void free_dentries(struct dsmcc_state *state, struct dsmcc_module_dentry_list *list, bool keep_cache)
 {
 	struct dsmcc_module_dentry *dentry, *next;
 
@@ -100,7 +136,7 @@ static void free_dentries(struct dsmcc_module_dentry_list *list, bool keep_cache
 		if (dentry->name)
 			free(dentry->name);
 		if (dentry->dir)
-			free_dentries(&dentry->dentries, keep_cache);
+			free_dentries(state, &dentry->dentries, keep_cache);
 		else
 		{
 			if (dentry->data_file)
@@ -111,7 +147,7 @@ static void free_dentries(struct dsmcc_module_dentry_list *list, bool keep_cache
 			}
 		}
 		next = dentry->next;
-		free(dentry);
+		dsmcc_pool_free(state->dentry_pool, dentry);
 		dentry = next;
 	}
 
@@ -119,11 +155,26 @@ static void free_dentries(struct dsmcc_module_dentry_list *list, bool keep_cache
 	list->last = NULL;
 }
 
-static void free_module_data(struct dsmcc_module *module, bool keep_cache)
+/**
+  * free the data of the module and remove it from the DDB index, so that its blocks are not dropped as known anymore
+  */
+static void free_module_data(struct dsmcc_object_carousel *carousel, struct dsmcc_module *module, bool keep_cache)
 {
+	if (module->ddb_index)
+	{
+		dsmcc_ddb_index_remove(&carousel->shard->ddb_index, module->ddb_index);
+		module->ddb_index = NULL;
+	}
+
 	switch (module->state)
 	{
 		case DSMCC_MODULE_STATE_PARTIAL:
+			if (module->data.partial.job)
+			{
+				/* the result of the job will be dropped */
+				module->data.partial.job->module = NULL;
+				module->data.partial.job = NULL;
+			}
 			if (module->data.partial.blockmap)
 			{
 				free(module->data.partial.blockmap);
@@ -143,7 +194,7 @@ static void free_module_data(struct dsmcc_module *module, bool keep_cache)
 			module->data.partial.downloaded_bytes = 0;
 			break;
 		case DSMCC_MODULE_STATE_COMPLETE:
-			free_dentries(&module->data.complete.dentries, keep_cache);
+			free_dentries(carousel->state, &module->data.complete.dentries, keep_cache);
 			break;
 	}
 	module->state = DSMCC_MODULE_STATE_INVALID;
@@ -151,7 +202,8 @@ static void free_module_data(struct dsmcc_module *module, bool keep_cache)
 
 static void free_module(struct dsmcc_object_carousel *carousel, struct dsmcc_module *module, bool keep_cache)
 {
-	free_module_data(module, keep_cache);
+	dsmcc_section_filter_remove(carousel, DSMCC_QUEUE_ENTRY_DDB, module->id.module_id);
+	free_module_data(carousel, module, keep_cache);
 
 	if (module->prev)
 	{
@@ -167,6 +219,7 @@ static void free_module(struct dsmcc_object_carousel *carousel, struct dsmcc_mod
 	}
 
 	free(module);
+	dsmcc_snapshot_invalidate(carousel->shard);
 }
 
 void dsmcc_cache_free_all_modules(struct dsmcc_object_carousel *carousel, bool keep_cache)
@@ -175,11 +228,11 @@ void dsmcc_cache_free_all_modules(struct dsmcc_object_carousel *carousel, bool k
 		free_module(carousel, carousel->modules, keep_cache);
 }
 
-static struct dsmcc_module_dentry *add_dentry(struct dsmcc_module_dentry_list *list, bool dir, struct dsmcc_object_id *id, char *name)
+static struct dsmcc_module_dentry *add_dentry(struct dsmcc_state *state, struct dsmcc_module_dentry_list *list, bool dir, struct dsmcc_object_id *id, char *name)
 {
 	struct dsmcc_module_dentry *dentry;
 
-	dentry = calloc(1, sizeof(struct dsmcc_module_dentry));
+	dentry = dsmcc_pool_zalloc(state->dentry_pool);
 	dentry->dir = dir;
 	memcpy(&dentry->id, id, sizeof(struct dsmcc_object_id));
 	if (name)
@@ -199,33 +252,44 @@ static struct dsmcc_module_dentry *add_dentry(struct dsmcc_module_dentry_list *l
 	return dentry;
 }
 
-static void add_dir_dentry(struct dsmcc_object_carousel *carousel, struct dsmcc_module_complete *module_data, struct biop_msg_dir *msg)
+static void add_dir_dentry(struct dsmcc_state *state, struct dsmcc_module_complete *module_data, struct biop_msg_dir *msg)
 {
 	struct dsmcc_module_dentry *dentry;
 	struct biop_msg_dentry *d;
 
-	dentry = add_dentry(&module_data->dentries, 1, &msg->id, NULL);
+	dentry = add_dentry(state, &module_data->dentries, 1, &msg->id, NULL);
 	if (msg->gateway)
 		module_data->gateway = dentry;
 
 	d = msg->first_dentry;
 	while (d)
 	{
-		if (dsmcc_log_enabled(DSMCC_LOG_DEBUG))
+		add_dentry(state, &dentry->dentries, d->dir, &d->id, strdup(d->name));
+		d = d->next;
+	}
+}
+
+static void check_dir_dentries(struct dsmcc_object_carousel *carousel, struct dsmcc_module_complete *module_data)
+{
+	struct dsmcc_module_dentry *dentry, *d;
+	struct dsmcc_module *module;
+
+	for (dentry = module_data->dentries.first; dentry; dentry = dentry->next)
+	{
+		if (!dentry->dir)
+			continue;
+		for (d = dentry->dentries.first; d; d = d->next)
 		{
-			struct dsmcc_module *module;
 			for (module = carousel->modules; module; module = module->next)
 				if (module->id.module_id == d->id.module_id)
 					break;
 			if (!module)
 				DSMCC_DEBUG("Directory entry %s points to a non-existing module 0x%04x", d->name, d->id.module_id);
 		}
-		add_dentry(&dentry->dentries, d->dir, &d->id, strdup(d->name));
-		d = d->next;
 	}
 }
 
-static void add_file_dentry(struct dsmcc_module_complete *module_data, const char *fileprefix, struct biop_msg_file *msg)
+static void add_file_dentry(struct dsmcc_state *state, struct dsmcc_module_complete *module_data, const char *fileprefix, struct biop_msg_file *msg)
 {
 	char *fn;
 	struct dsmcc_module_dentry *dentry;
@@ -250,7 +314,7 @@ static void add_file_dentry(struct dsmcc_module_complete *module_data, const cha
 	if (!dsmcc_file_copy(fn, msg->data_file, msg->data_offset, msg->data_length))
 		return;
 
-	dentry = add_dentry(&module_data->dentries, 0, &msg->id, NULL);
+	dentry = add_dentry(state, &module_data->dentries, 0, &msg->id, NULL);
 	dentry->data_file = fn;
 	dentry->data_size = msg->data_length;
 }
@@ -350,6 +414,48 @@ static void update_carousel_completion(struct dsmcc_object_carousel *carousel, s
 	dsmcc_filecache_notify_status(carousel, filecache);
 }
 
+/**
+  * returns the number of modules of the carousel, and their state in an array allocated with malloc
+  */
+int dsmcc_cache_get_module_status(struct dsmcc_object_carousel *carousel, struct dsmcc_module_status **status, uint32_t *downloaded, uint32_t *total)
+{
+	struct dsmcc_module *module;
+	int count = 0;
+
+	for (module = carousel->modules; module; module = module->next)
+		count++;
+
+	*status = calloc(count ? count : 1, sizeof(struct dsmcc_module_status));
+	*downloaded = *total = 0;
+	count = 0;
+	for (module = carousel->modules; module; module = module->next)
+	{
+		struct dsmcc_module_status *s = &(*status)[count++];
+
+		s->module_id = module->id.module_id;
+		s->module_version = module->id.module_version;
+		s->size = module->module_size;
+		switch (module->state)
+		{
+			case DSMCC_MODULE_STATE_PARTIAL:
+				s->status = module->data.partial.job ? DSMCC_MODULE_STATUS_PROCESSING : DSMCC_MODULE_STATUS_DOWNLOADING;
+				s->downloaded = module->data.partial.downloaded_bytes;
+				break;
+			case DSMCC_MODULE_STATE_COMPLETE:
+				s->status = DSMCC_MODULE_STATUS_COMPLETE;
+				s->downloaded = module->module_size;
+				break;
+			default:
+				s->status = DSMCC_MODULE_STATUS_INVALID;
+				break;
+		}
+		*downloaded += s->downloaded;
+		*total += s->size;
+	}
+
+	return count;
+}
+
 void dsmcc_cache_init_new_filecache(struct dsmcc_object_carousel *carousel, struct dsmcc_file_cache *filecache)
 {
 	struct dsmcc_module *module;
@@ -361,71 +467,52 @@ void dsmcc_cache_init_new_filecache(struct dsmcc_object_carousel *carousel, stru
 	update_carousel_completion(carousel, filecache);
 }
 
-static void process_module(struct dsmcc_object_carousel *carousel, struct dsmcc_module *module)
+/**
+  * inflate and parse the module data, and copy the files of the module in the cache, called by a worker thread
+  */
+static void run_module_job(struct dsmcc_job *job)
 {
-	int ret;
-	char *data_file;
-	uint32_t size;
+	struct dsmcc_module_job *mjob = (struct dsmcc_module_job *) job;
 	struct biop_msg *messages = NULL, *msg = NULL;
 	struct biop_msg_file allmodfile;
+	int ret;
 
-	if (module->state != DSMCC_MODULE_STATE_PARTIAL)
-		return;
-
-	if (module->data.partial.downloaded_bytes < module->module_size)
-		return;
-
-	DSMCC_DEBUG("Processing module 0x%04hx version 0x%02hhx in carousel 0x%08x (data file is %s)",
-			module->id.module_id, module->id.module_version, carousel->cid, module->data.partial.data_file);
+	DSMCC_DEBUG("Processing module 0x%04hx version 0x%02hhx (data file is %s)",
+			mjob->id.module_id, mjob->id.module_version, mjob->data_file);
 
-	if (module->data.partial.compressed)
+	if (mjob->compressed)
 	{
 		DSMCC_DEBUG("Processing compressed module data");
-		if (!dsmcc_inflate_file(module->data.partial.data_file))
+		if (!dsmcc_inflate_file(mjob->data_file))
 		{
 			DSMCC_ERROR("Error while processing compressed module");
 			return;
 		}
-		size = module->data.partial.uncompressed_size;
 	}
 	else
 	{
 		DSMCC_DEBUG("Processing uncompressed module data");
-		size = module->module_size;
 	}
 
-	if(carousel->type == DSMCC_OBJECT_CAROUSEL)
+	if (mjob->type == DSMCC_OBJECT_CAROUSEL)
 	{
-		ret = dsmcc_biop_msg_parse_data(&messages, &module->id, module->data.partial.data_file, size);
+		ret = dsmcc_biop_msg_parse_data(&messages, &mjob->id, mjob->data_file, mjob->size);
 		if (ret < 0)
 		{
-			DSMCC_ERROR("Error while parsing module 0x%04hx", module->id.module_id);
-			free_module_data(module, 0);
+			DSMCC_ERROR("Error while parsing module 0x%04hx", mjob->id.module_id);
 			return;
 		}
-	}
-
-	data_file = strdup(module->data.partial.data_file);
-	free_module_data(module, 1);
-	module->state = DSMCC_MODULE_STATE_COMPLETE;
-	memset(&module->data.complete, 0, sizeof(struct dsmcc_module_complete));
-
-	/* remove module timeouts */
-	dsmcc_timeout_remove(carousel, DSMCC_TIMEOUT_MODULE, module->id.module_id);
-	dsmcc_timeout_remove(carousel, DSMCC_TIMEOUT_NEXTBLOCK, module->id.module_id);
 
-	if(carousel->type == DSMCC_OBJECT_CAROUSEL)
-	{
 		msg = messages;
 		while (msg)
 		{
 			switch (msg->type)
 			{
 				case BIOP_MSG_DIR:
-					add_dir_dentry(carousel, &module->data.complete, &msg->msg.dir);
+					add_dir_dentry(mjob->state, &mjob->complete, &msg->msg.dir);
 					break;
 				case BIOP_MSG_FILE:
-					add_file_dentry(&module->data.complete, data_file, &msg->msg.file);
+					add_file_dentry(mjob->state, &mjob->complete, mjob->data_file, &msg->msg.file);
 					break;
 			}
 			msg = msg->next;
@@ -434,17 +521,222 @@ static void process_module(struct dsmcc_object_carousel *carousel, struct dsmcc_
 	}
 	else
 	{
-		allmodfile.id.module_id = module->id.module_id;
-		allmodfile.id.key = module->id.module_id;
+		allmodfile.id.module_id = mjob->id.module_id;
+		allmodfile.id.key = mjob->id.module_id;
 		allmodfile.id.key_mask = 0xFFFF;
-		allmodfile.data_file = data_file; //useless ?
+		allmodfile.data_file = mjob->data_file; //useless ?
 		allmodfile.data_offset = 0;
-		allmodfile.data_length = size;
-		add_file_dentry(&module->data.complete, data_file, &allmodfile);
+		allmodfile.data_length = mjob->size;
+		add_file_dentry(mjob->state, &mjob->complete, mjob->data_file, &allmodfile);
+	}
+
+	mjob->ok = 1;
+}
+
+static void module_job_done(struct dsmcc_job *job)
+{
+	struct dsmcc_module_job *mjob = (struct dsmcc_module_job *) job;
+
+	dsmcc_shard_queue_module_job(mjob->shard, mjob);
+}
+
+static void free_module_job(struct dsmcc_module_job *job)
+{
+	free_dentries(job->state, &job->complete.dentries, 0);
+	unlink(job->data_file);
+	free(job->data_file);
+	free(job);
+}
+
+/**
+  * Add a module that is not in the DDB index (loaded from the cache file, or just processed) to it
+  */
+static void index_module(struct dsmcc_object_carousel *carousel, struct dsmcc_module *module)
+{
+	if (module->ddb_index)
+		return;
+
+	if (module->state == DSMCC_MODULE_STATE_PARTIAL)
+	{
+		module->ddb_index = dsmcc_ddb_index_add(&carousel->shard->ddb_index, &module->id, carousel->skip_leading_bytes,
+				module->data.partial.block_count, module->data.partial.blockmap);
+	}
+	else
+	{
+		module->ddb_index = dsmcc_ddb_index_add(&carousel->shard->ddb_index, &module->id, carousel->skip_leading_bytes, 0, NULL);
+		dsmcc_ddb_index_set_complete(module->ddb_index);
+	}
+}
+
+/**
+  * Allocate the block map and data file of a partial module whose block size is set, and add it to the DDB index
+  */
+static void init_partial_data(struct dsmcc_object_carousel *carousel, struct dsmcc_module *module)
+{
+	module->data.partial.downloaded_bytes = 0;
+	module->data.partial.block_count = module->module_size / module->data.partial.block_size;
+	if (module->module_size - module->data.partial.block_count * module->data.partial.block_size > 0)
+		module->data.partial.block_count++;
+	module->data.partial.blockmap_size = (module->data.partial.block_count + 7) >> 3;
+	module->data.partial.blockmap = calloc(1, module->data.partial.blockmap_size);
+
+	module->data.partial.data_file = malloc(strlen(carousel->state->cachedir) + 18);
+	sprintf(module->data.partial.data_file, "%s/%08x-%04hx-%02hhx", carousel->state->cachedir, carousel->cid, module->id.module_id, module->id.module_version);
+	unlink(module->data.partial.data_file);
+
+	module->ddb_index = dsmcc_ddb_index_add(&carousel->shard->ddb_index, &module->id, carousel->skip_leading_bytes,
+			module->data.partial.block_count, NULL);
+}
+
+/**
+  * Add the section filter for the DDBs of the module and its module timeout
+  */
+static void start_download(struct dsmcc_object_carousel *carousel, struct dsmcc_module *module)
+{
+	/* add section filter on stream for DDB (table_id == 0x3C, table_id_extension == module_id, version_number == module_version % 32) */
+	if (module->ddb_pid >= 0)
+	{
+		uint8_t pattern[4];
+		uint8_t equal[4]    = { 0xff, 0xff, 0xff, 0x3e }; /* bits 2-6 */
+		uint8_t notequal[4] = { 0x00, 0x00, 0x00, 0x00 };
+		pattern[0] = carousel->section_data_table_id;
+		pattern[1] = (module->id.module_id >> 8) & 0xff;
+		pattern[2] = module->id.module_id & 0xff;
+		pattern[3] = (module->id.module_version & 0x1f) << 1;
+		dsmcc_section_filter_add(carousel, DSMCC_QUEUE_ENTRY_DDB, module->id.module_id, module->ddb_pid, pattern, equal, notequal, 4);
 	}
 
-	unlink(data_file);
-	free(data_file);
+	/* add module timeout */
+	dsmcc_timeout_set(carousel, DSMCC_TIMEOUT_MODULE, module->id.module_id, module->mod_timeout);
+}
+
+/**
+  * Download the module again from the first block, after its data could not be processed. Its DII will not be
+  * handled again if the carousel did not change, so the section filter and timeout are added back here.
+  */
+static void restart_download(struct dsmcc_object_carousel *carousel, struct dsmcc_module *module)
+{
+	struct dsmcc_module_partial info;
+
+	DSMCC_WARN("Downloading module 0x%04hx version 0x%02hhx again", module->id.module_id, module->id.module_version);
+
+	memcpy(&info, &module->data.partial, sizeof(struct dsmcc_module_partial));
+	free_module_data(carousel, module, 0);
+
+	module->state = DSMCC_MODULE_STATE_PARTIAL;
+	memset(&module->data.partial, 0, sizeof(struct dsmcc_module_partial));
+	module->data.partial.block_timeout = info.block_timeout;
+	module->data.partial.compressed = info.compressed;
+	module->data.partial.compress_method = info.compress_method;
+	module->data.partial.uncompressed_size = info.uncompressed_size;
+	module->data.partial.block_size = info.block_size;
+	init_partial_data(carousel, module);
+	dsmcc_snapshot_invalidate(carousel->shard);
+
+	start_download(carousel, module);
+}
+
+/**
+  * Hand the downloaded module to a worker thread, the parsing thread goes on with the sections of the other modules
+  */
+static void process_module(struct dsmcc_object_carousel *carousel, struct dsmcc_module *module)
+{
+	struct dsmcc_module_job *job;
+	int fd;
+
+	if (module->state != DSMCC_MODULE_STATE_PARTIAL || module->data.partial.job)
+		return;
+
+	if (module->data.partial.downloaded_bytes < module->module_size)
+		return;
+
+	job = calloc(1, sizeof(struct dsmcc_module_job));
+	job->job.run = &run_module_job;
+	job->job.done = &module_job_done;
+	job->job.background = carousel->priority == DSMCC_PRIORITY_BACKGROUND;
+	job->job.owner = carousel->state;
+	job->shard = carousel->shard;
+	job->carousel = carousel;
+	job->module = module;
+	job->state = carousel->state;
+	job->type = carousel->type;
+	memcpy(&job->id, &module->id, sizeof(struct dsmcc_module_id));
+	job->compressed = module->data.partial.compressed;
+	job->size = job->compressed ? module->data.partial.uncompressed_size : module->module_size;
+
+	/* the job gets its own data file, so that it is not disturbed if the module is downloaded again meanwhile */
+	job->data_file = malloc(strlen(module->data.partial.data_file) + 8);
+	sprintf(job->data_file, "%s.XXXXXX", module->data.partial.data_file);
+	fd = mkstemp(job->data_file);
+	if (fd < 0 || rename(module->data.partial.data_file, job->data_file) < 0)
+	{
+		DSMCC_ERROR("Error while moving data file of module 0x%04hx: %s", module->id.module_id, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		free_module_job(job);
+		restart_download(carousel, module);
+		return;
+	}
+	close(fd);
+
+	module->data.partial.job = job;
+	dsmcc_snapshot_invalidate(carousel->shard);
+
+	/* the download is over, remove module timeouts and section filter */
+	dsmcc_timeout_remove(carousel, DSMCC_TIMEOUT_MODULE, module->id.module_id);
+	dsmcc_timeout_remove(carousel, DSMCC_TIMEOUT_NEXTBLOCK, module->id.module_id);
+	dsmcc_section_filter_remove(carousel, DSMCC_QUEUE_ENTRY_DDB, module->id.module_id);
+
+	dsmcc_workers_queue(carousel->state->workers, &job->job);
+}
+
+/**
+  * Called by the parsing thread when the module has been processed by a worker thread
+  */
+void dsmcc_cache_module_job_complete(struct dsmcc_module_job *job)
+{
+	struct dsmcc_object_carousel *carousel = job->carousel;
+	struct dsmcc_module *module = job->module;
+
+	if (!module)
+	{
+		DSMCC_DEBUG("Dropping processed module 0x%04hx version 0x%02hhx, module was removed",
+				job->id.module_id, job->id.module_version);
+		free_module_job(job);
+		return;
+	}
+
+	module->data.partial.job = NULL;
+	dsmcc_snapshot_invalidate(carousel->shard);
+	if (job->ok)
+	{
+		free_module_data(carousel, module, 1);
+		module->state = DSMCC_MODULE_STATE_COMPLETE;
+		memcpy(&module->data.complete, &job->complete, sizeof(struct dsmcc_module_complete));
+		memset(&job->complete, 0, sizeof(struct dsmcc_module_complete));
+
+		index_module(carousel, module);
+
+		if (dsmcc_log_enabled(DSMCC_LOG_DEBUG))
+			check_dir_dentries(carousel, &module->data.complete);
+
+		update_filecaches(carousel, module);
+	}
+	else
+		restart_download(carousel, module);
+	free_module_job(job);
+
+	update_carousel_completion(carousel, NULL);
+}
+
+/**
+  * Called when the processed module will not be handed back to the parsing thread (at exit)
+  */
+void dsmcc_cache_module_job_cancel(struct dsmcc_module_job *job)
+{
+	if (job->module)
+		job->module->data.partial.job = NULL;
+	free_module_job(job);
 }
 
 void dsmcc_cache_remove_unneeded_modules(struct dsmcc_object_carousel *carousel, struct dsmcc_module_id *modules_id, int number_modules)
@@ -505,6 +797,8 @@ void dsmcc_cache_remove_unneeded_modules_by_group(struct dsmcc_object_carousel *
 bool dsmcc_cache_add_module_info(struct dsmcc_object_carousel *carousel, struct dsmcc_module_id *module_id, struct dsmcc_module_info *module_info)
 {
 	struct dsmcc_module *module;
+	bool replaced = 0;
+	uint8_t replaced_version = 0;
 
 	for (module = carousel->modules; module; module = module->next)
 	{
@@ -515,16 +809,21 @@ bool dsmcc_cache_add_module_info(struct dsmcc_object_carousel *carousel, struct
 				/* Already know this version */
 				DSMCC_DEBUG("Up-to-Date Module 0x%04hx Version 0x%02hhx",
 						module_id->module_id, module_id->module_version);
+				index_module(carousel, module);
 				update_filecaches(carousel, module);
 				update_carousel_completion(carousel, NULL);
-				return module->state == DSMCC_MODULE_STATE_COMPLETE;
+				/* a module being processed does not need its DDBs anymore */
+				return module->state == DSMCC_MODULE_STATE_COMPLETE ||
+					(module->state == DSMCC_MODULE_STATE_PARTIAL && module->data.partial.job);
 			}
 			else
 			{
 				/* New version, drop old data */
 				DSMCC_DEBUG("Updating Module 0x%04hx Version 0x%02hhx -> 0x%02hhx",
 						module_id->module_id, module->id.module_version, module_id->module_version);
-				free_module_data(module, 0);
+				free_module_data(carousel, module, 0);
+				replaced = module->id.module_version != module_id->module_version;
+				replaced_version = module->id.module_version;
 				break;
 			}
 		}
@@ -535,6 +834,7 @@ bool dsmcc_cache_add_module_info(struct dsmcc_object_carousel *carousel, struct
 	if (!module)
 	{
 		module = calloc(1, sizeof(struct dsmcc_module));
+		module->ddb_pid = -1;
 		module->next = carousel->modules;
 		if (module->next)
 			module->next->prev = module;
@@ -542,6 +842,7 @@ bool dsmcc_cache_add_module_info(struct dsmcc_object_carousel *carousel, struct
 	}
 	module->state = DSMCC_MODULE_STATE_PARTIAL;
 	memcpy(&module->id, module_id, sizeof(struct dsmcc_module_id));
+	dsmcc_snapshot_invalidate(carousel->shard);
 	module->module_size = module_info->module_size;
 	memset(&module->data.partial, 0, sizeof(struct dsmcc_module_partial));
 	module->data.partial.block_timeout = module_info->block_timeout;
@@ -549,20 +850,34 @@ bool dsmcc_cache_add_module_info(struct dsmcc_object_carousel *carousel, struct
 	module->data.partial.compress_method = module_info->compress_method;
 	module->data.partial.uncompressed_size = module_info->uncompressed_size;
 	module->data.partial.block_size = module_info->block_size;
-	module->data.partial.downloaded_bytes = 0;
-	module->data.partial.block_count = module->module_size / module->data.partial.block_size;
-	if (module->module_size - module->data.partial.block_count * module->data.partial.block_size > 0)
-		module->data.partial.block_count++;
-	module->data.partial.blockmap_size = (module->data.partial.block_count + 7) >> 3;
-	module->data.partial.blockmap = calloc(1, module->data.partial.blockmap_size);
-
-	module->data.partial.data_file = malloc(strlen(carousel->state->cachedir) + 18);
-	sprintf(module->data.partial.data_file, "%s/%08x-%04hx-%02hhx", carousel->state->cachedir, carousel->cid, module->id.module_id, module->id.module_version);
-	unlink(module->data.partial.data_file);
+	init_partial_data(carousel, module);
+	if (replaced)
+		dsmcc_ddb_index_set_replaced(module->ddb_index, replaced_version);
 
 	return 0;
 }
 
+/**
+  * Start the download of a module that dsmcc_cache_add_module_info did not find up to date, pid is the PID of its DDBs
+  * or -1 if the stream could not be found
+  */
+void dsmcc_cache_download_module(struct dsmcc_object_carousel *carousel, struct dsmcc_module_id *module_id, int pid, uint32_t mod_timeout)
+{
+	struct dsmcc_module *module;
+
+	for (module = carousel->modules; module; module = module->next)
+	{
+		if (module->id.module_id == module_id->module_id)
+			break;
+	}
+	if (!module)
+		return;
+
+	module->ddb_pid = pid;
+	module->mod_timeout = mod_timeout;
+	start_download(carousel, module);
+}
+
 #ifdef DEBUG
 static const char *get_module_state_str(int state)
 {
@@ -609,7 +924,11 @@ void dsmcc_cache_save_module_data(struct dsmcc_object_carousel *carousel, struct
 		return;
 	}
 
-	if (module->state == DSMCC_MODULE_STATE_PARTIAL)
+	if (module->state == DSMCC_MODULE_STATE_PARTIAL && module->data.partial.job)
+	{
+		DSMCC_DEBUG("Skipping data block for module 0x%04hx (being processed)", module->id.module_id);
+	}
+	else if (module->state == DSMCC_MODULE_STATE_PARTIAL)
 	{
 		/* Check that DDB size is equal to module block size (or smaller for last block) */
 		if (((uint32_t)length) > module->data.partial.block_size)
@@ -633,6 +952,8 @@ void dsmcc_cache_save_module_data(struct dsmcc_object_carousel *carousel, struct
 			}
 			module->data.partial.downloaded_bytes += length;
 			module->data.partial.blockmap[block_number >> 3] |= (1 << (block_number & 7));
+			dsmcc_ddb_index_set_block(module->ddb_index, block_number);
+			dsmcc_snapshot_invalidate(carousel->shard);
 
 			dsmcc_timeout_set(carousel, DSMCC_TIMEOUT_NEXTBLOCK, module->id.module_id, module->data.partial.block_timeout);
 		}
@@ -641,10 +962,7 @@ void dsmcc_cache_save_module_data(struct dsmcc_object_carousel *carousel, struct
 
 		/* If we have all blocks for this module, process it */
 		if (module->data.partial.downloaded_bytes >= module->module_size)
-		{
 			process_module(carousel, module);
-			update_filecaches(carousel, module);
-		}
 
 		update_carousel_completion(carousel, NULL);
 	}
@@ -654,7 +972,7 @@ void dsmcc_cache_save_module_data(struct dsmcc_object_carousel *carousel, struct
 	}
 }
 
-static bool load_dentries(FILE *f, struct dsmcc_module_dentry **gateway, struct dsmcc_module_dentry_list *dentries)
+static bool load_dentries(FILE *f, struct dsmcc_state *state, struct dsmcc_module_dentry **gateway, struct dsmcc_module_dentry_list *dentries)
 {
 	uint32_t tmp, isgateway;
 	struct dsmcc_module_dentry *dentry;
@@ -691,12 +1009,12 @@ static bool load_dentries(FILE *f, struct dsmcc_module_dentry **gateway, struct
 		}
 		else
 			name = NULL;
-		dentry = add_dentry(dentries, dir, &id, name);
+		dentry = add_dentry(state, dentries, dir, &id, name);
 		if (isgateway && gateway)
 			*gateway = dentry;
 		if (dentry->dir)
 		{
-			if (!load_dentries(f, NULL, &dentry->dentries))
+			if (!load_dentries(f, state, NULL, &dentry->dentries))
 				return 0;
 		}
 		else
@@ -730,6 +1048,7 @@ bool dsmcc_cache_load_modules(FILE *f, struct dsmcc_object_carousel *carousel)
 			break;
 		module = calloc(1, sizeof(struct dsmcc_module));
 		module->state = DSMCC_MODULE_STATE_INVALID;
+		module->ddb_pid = -1;
 		if (!fread(&module->id.download_id, sizeof(uint32_t), 1, f))
 			goto error;
 		if (!fread(&module->id.module_id, sizeof(uint16_t), 1, f))
@@ -767,7 +1086,7 @@ bool dsmcc_cache_load_modules(FILE *f, struct dsmcc_object_carousel *carousel)
 					goto error;
 				break;
 			case DSMCC_MODULE_STATE_COMPLETE:
-				if (!load_dentries(f, &module->data.complete.gateway, &module->data.complete.dentries))
+				if (!load_dentries(f, carousel->state, &module->data.complete.gateway, &module->data.complete.dentries))
 					goto error;
 				break;
 		}
@@ -785,7 +1104,7 @@ error:
 	dsmcc_cache_free_all_modules(carousel, 0);
 	if (module)
 	{
-		free_module_data(module, 0);
+		free_module_data(carousel, module, 0);
 		free(module);
 	}
 	return 0;
@@ -849,10 +1168,16 @@ bool dsmcc_cache_save_modules(FILE *f, struct dsmcc_object_carousel *carousel)
 {
 	struct dsmcc_module *module;
 	uint32_t tmp;
+	int state;
 
 	module = carousel->modules;
 	while (module)
 	{
+		/* the data file of a module being processed is owned by the job */
+		state = module->state;
+		if (state == DSMCC_MODULE_STATE_PARTIAL && module->data.partial.job)
+			state = DSMCC_MODULE_STATE_INVALID;
+
 		tmp = 0;
 		if (!fwrite(&tmp, sizeof(uint32_t), 1, f))
 			goto error;
@@ -862,11 +1187,11 @@ bool dsmcc_cache_save_modules(FILE *f, struct dsmcc_object_carousel *carousel)
 			goto error;
 		if (!fwrite(&module->id.module_version, sizeof(uint8_t), 1, f))
 			goto error;
-		if (!fwrite(&module->state, sizeof(int), 1, f))
+		if (!fwrite(&state, sizeof(int), 1, f))
 			goto error;
 		if (!fwrite(&module->module_size, sizeof(uint32_t), 1, f))
 			goto error;
-		switch (module->state)
+		switch (state)
 		{
 			case DSMCC_MODULE_STATE_PARTIAL:
 				if (!fwrite(&module->data.partial.block_size, sizeof(uint32_t), 1, f))
@@ -25,15 +25,21 @@ struct dsmcc_module_info
 };
 
 struct dsmcc_module;
+struct dsmcc_module_job;
 struct dsmcc_group_list;
 
 void dsmcc_cache_remove_unneeded_modules(struct dsmcc_object_carousel *carousel, struct dsmcc_module_id *modules_id, int number_modules);
 void dsmcc_cache_remove_unneeded_modules_by_group(struct dsmcc_object_carousel *carousel, struct dsmcc_group_list *groups);
 bool dsmcc_cache_add_module_info(struct dsmcc_object_carousel *carousel, struct dsmcc_module_id *module_id, struct dsmcc_module_info *module_info);
+void dsmcc_cache_download_module(struct dsmcc_object_carousel *carousel, struct dsmcc_module_id *module_id, int pid, uint32_t mod_timeout);
 void dsmcc_cache_save_module_data(struct dsmcc_object_carousel *carousel, struct dsmcc_module_id *module_id, uint16_t block_number, uint8_t *data, int length);
 void dsmcc_cache_init_new_filecache(struct dsmcc_object_carousel *carousel, struct dsmcc_file_cache *filecache);
 void dsmcc_cache_free_all_modules(struct dsmcc_object_carousel *carousel, bool keep_cache);
 bool dsmcc_cache_load_modules(FILE *file, struct dsmcc_object_carousel *carousel);
 bool dsmcc_cache_save_modules(FILE *file, struct dsmcc_object_carousel *carousel);
+size_t dsmcc_cache_dentry_size(void);
+int dsmcc_cache_get_module_status(struct dsmcc_object_carousel *carousel, struct dsmcc_module_status **status, uint32_t *downloaded, uint32_t *total);
+void dsmcc_cache_module_job_complete(struct dsmcc_module_job *job);
+void dsmcc_cache_module_job_cancel(struct dsmcc_module_job *job);
 
 #endif
@@ -11,11 +11,11 @@
 
 #define CAROUSEL_CACHE_FILE_MAGIC 0xDDCC0002
 
-struct dsmcc_object_carousel *find_carousel_by_requested_pid(struct dsmcc_state *state, uint16_t pid)
+struct dsmcc_object_carousel *find_carousel_by_requested_pid(struct dsmcc_shard *shard, uint16_t pid)
 {
 	struct dsmcc_object_carousel *carousel;
 
-	for (carousel = state->carousels; carousel; carousel = carousel->next)
+	for (carousel = shard->carousels; carousel; carousel = carousel->next)
 		if (carousel->requested_pid == pid)
 			return carousel;
 	return NULL;
@@ -28,11 +28,13 @@ static void stop_carousel(struct dsmcc_object_carousel *carousel)
 	dsmcc_stream_queue_remove(carousel, DSMCC_QUEUE_ENTRY_DSI);
 	dsmcc_stream_queue_remove(carousel, DSMCC_QUEUE_ENTRY_DII);
 	dsmcc_stream_queue_remove(carousel, DSMCC_QUEUE_ENTRY_DDB);
+	dsmcc_section_filter_remove_all(carousel);
 	dsmcc_timeout_remove_all(carousel);
 
 	/* set default unknown value for transaction ids */
 	carousel->dsi_transaction_id = 0xFFFFFFFF;
 	carousel->dii_transaction_id = 0xFFFFFFFF;
+	dsmcc_snapshot_invalidate(carousel->shard);
 	if (carousel->status == DSMCC_STATUS_DOWNLOADING)
 	{
 		dsmcc_object_carousel_set_status(carousel, DSMCC_STATUS_PARTIAL);
@@ -49,13 +51,11 @@ static void start_carousel(struct dsmcc_object_carousel *carousel)
 
 	dsmcc_stream_queue_add(carousel, DSMCC_STREAM_SELECTOR_PID, carousel->requested_pid, DSMCC_QUEUE_ENTRY_DSI, carousel->requested_transaction_id);
 	/* add section filter on stream for DSI (table_id == 0x3B, table_id_extension == 0x0000 or 0x0001) */
-	if (carousel->state->callbacks.add_section_filter)
 	{
 		uint8_t pattern[3]  = { carousel->section_control_table_id, 0x00, 0x00 };
 		uint8_t equal[3]    = { 0xff, 0xff, 0xfe };
 		uint8_t notequal[3] = { 0x00, 0x00, 0x00 };
-		(*carousel->state->callbacks.add_section_filter)(carousel->state->callbacks.add_section_filter_arg,
-				carousel->requested_pid, pattern, equal, notequal, 3);
+		dsmcc_section_filter_add(carousel, DSMCC_QUEUE_ENTRY_DSI, 0, carousel->requested_pid, pattern, equal, notequal, 3);
 	}
 
 	dsmcc_timeout_set(carousel, DSMCC_TIMEOUT_DSI, 0, DEFAULT_DSI_TIMEOUT);
@@ -64,13 +64,37 @@ static void start_carousel(struct dsmcc_object_carousel *carousel)
 	dsmcc_filecache_notify_status(carousel, NULL);
 }
 
-void dsmcc_object_carousel_queue_remove(struct dsmcc_state *state, uint32_t queue_id)
+/**
+  * the carousel stays in the foreground as long as one of its requests is
+  */
+static void update_priority(struct dsmcc_object_carousel *carousel)
+{
+	struct dsmcc_file_cache *filecache;
+	int priority = DSMCC_PRIORITY_BACKGROUND;
+
+	for (filecache = carousel->filecaches; filecache; filecache = dsmcc_filecache_next(filecache))
+	{
+		if (dsmcc_filecache_priority(filecache) == DSMCC_PRIORITY_FOREGROUND)
+		{
+			priority = DSMCC_PRIORITY_FOREGROUND;
+			break;
+		}
+	}
+
+	if (carousel->priority != priority)
+	{
+		carousel->priority = priority;
+		dsmcc_stream_pids_update(carousel->shard);
+	}
+}
+
+void dsmcc_object_carousel_queue_remove(struct dsmcc_shard *shard, uint32_t queue_id)
 {
 	struct dsmcc_object_carousel *carousel;
 	struct dsmcc_file_cache *filecache;
 
 	// remove filecache for queue_id
-	for (carousel = state->carousels; carousel; carousel = carousel->next)
+	for (carousel = shard->carousels; carousel; carousel = carousel->next)
 	{
 		filecache = dsmcc_filecache_find(carousel, queue_id);
 		if (filecache)
@@ -83,20 +107,23 @@ void dsmcc_object_carousel_queue_remove(struct dsmcc_state *state, uint32_t queu
 	// carousel found and has no more filecaches, stop it
 	if (carousel && !carousel->filecaches)
 		stop_carousel(carousel);
+	else if (carousel)
+		update_priority(carousel);
 }
 
-void dsmcc_object_carousel_queue_add(struct dsmcc_state *state, uint32_t queue_id,
-		struct dsmcc_parameters *parameters, struct dsmcc_carousel_callbacks *callbacks)
+void dsmcc_object_carousel_queue_add(struct dsmcc_shard *shard, uint32_t queue_id,
+		struct dsmcc_parameters *parameters, struct dsmcc_carousel_callbacks *callbacks, int priority)
 {
 	struct dsmcc_object_carousel *carousel;
 	/* Check if carousel is already requested */
-	carousel = find_carousel_by_requested_pid(state, parameters->pid);
+	carousel = find_carousel_by_requested_pid(shard, parameters->pid);
 	if (!carousel)
 	{
 		carousel = calloc(1, sizeof(struct dsmcc_object_carousel));
-		carousel->state = state;
+		carousel->state = shard->state;
+		carousel->shard = shard;
 		carousel->status = DSMCC_STATUS_PARTIAL;
-		carousel->next = state->carousels;
+		carousel->next = shard->carousels;
 		carousel->type = parameters->type;
 		carousel->group_list = NULL;
 		carousel->requested_pid = parameters->pid;
@@ -105,15 +132,19 @@ void dsmcc_object_carousel_queue_add(struct dsmcc_state *state, uint32_t queue_i
 		carousel->section_control_table_id = parameters->section_control_table_id;
 		carousel->section_data_table_id = parameters->section_data_table_id;
 		carousel->skip_leading_bytes = parameters->skip_leading_bytes;
-		state->carousels = carousel;
+		shard->carousels = carousel;
 
 		/* set default unknown value for transaction ids */
 		carousel->dsi_transaction_id = 0xFFFFFFFF;
 		carousel->dii_transaction_id = 0xFFFFFFFF;
 	}
 
+	if (priority != DSMCC_PRIORITY_BACKGROUND)
+		priority = DSMCC_PRIORITY_FOREGROUND;
+
 	start_carousel(carousel);
-	dsmcc_filecache_add(carousel, queue_id, parameters->downloadpath, callbacks);
+	dsmcc_filecache_add(carousel, queue_id, parameters->downloadpath, callbacks, priority);
+	update_priority(carousel);
 }
 
 #ifdef DEBUG
@@ -142,6 +173,7 @@ void dsmcc_object_carousel_set_status(struct dsmcc_object_carousel *carousel, in
 
 	DSMCC_DEBUG("Carousel 0x%08x status changed to %s", carousel->cid, status_str(newstatus));
 	carousel->status = newstatus;
+	dsmcc_snapshot_invalidate(carousel->shard);
 }
 
 void dsmcc_object_carousel_free(struct dsmcc_object_carousel *carousel, bool keep_cache)
@@ -173,16 +205,20 @@ static void free_all_carousels(struct dsmcc_object_carousel *carousels, bool kee
 	}
 }
 
-void dsmcc_object_carousel_free_all(struct dsmcc_state *state, bool keep_cache)
+void dsmcc_object_carousel_free_all(struct dsmcc_shard *shard, bool keep_cache)
 {
-	free_all_carousels(state->carousels, keep_cache);
-	state->carousels = NULL;
+	free_all_carousels(shard->carousels, keep_cache);
+	shard->carousels = NULL;
 }
 
+/**
+  * Load the carousels cached in the file and give each of them to the shard of its requested PID
+  */
 bool dsmcc_object_carousel_load_all(FILE *f, struct dsmcc_state *state)
 {
 	uint32_t tmp;
-	struct dsmcc_object_carousel *carousel = NULL, *lastcar = NULL;
+	struct dsmcc_object_carousel *carousels = NULL, *carousel = NULL, *lastcar = NULL, **last;
+	struct dsmcc_shard *shard;
 
 	if (!fread(&tmp, sizeof(uint32_t), 1, f))
 		goto error;
@@ -197,6 +233,7 @@ bool dsmcc_object_carousel_load_all(FILE *f, struct dsmcc_state *state)
 			break;
 		carousel = calloc(1, sizeof(struct dsmcc_object_carousel));
 		carousel->state = state;
+		carousel->shard = &state->shards[0];
 		carousel->group_list = NULL;
 		if (!fread(&carousel->cid, sizeof(uint32_t), 1, f))
 			goto error;
@@ -213,24 +250,37 @@ bool dsmcc_object_carousel_load_all(FILE *f, struct dsmcc_state *state)
 
 		if (carousel->status == DSMCC_STATUS_DOWNLOADING)
 			carousel->status = DSMCC_STATUS_PARTIAL;
-		if (state->carousels)
+		if (carousels)
 			lastcar->next = carousel;
 		else
-			state->carousels = carousel;
+			carousels = carousel;
 		lastcar = carousel;
 		carousel = NULL;
 	}
 
+	while (carousels)
+	{
+		carousel = carousels;
+		carousels = carousel->next;
+
+		shard = dsmcc_shard_for_pid(state, carousel->requested_pid);
+		carousel->shard = shard;
+		carousel->next = NULL;
+		for (last = &shard->carousels; *last; last = &(*last)->next)
+			;
+		*last = carousel;
+	}
+
 	return 1;
 error:
 	DSMCC_ERROR("Error while loading carousels");
-	free_all_carousels(state->carousels, 0);
+	free_all_carousels(carousels, 0);
 	if (carousel)
 		free_all_carousels(carousel, 0);
 	return 0;
 }
 
-bool dsmcc_object_carousel_save_all(FILE *f, struct dsmcc_state *state)
+bool dsmcc_object_carousel_save_all(FILE *f, struct dsmcc_shard *shard)
 {
 	uint32_t tmp;
 	struct dsmcc_object_carousel *carousel;
@@ -239,7 +289,7 @@ bool dsmcc_object_carousel_save_all(FILE *f, struct dsmcc_state *state)
 	if (!fwrite(&tmp, sizeof(uint32_t), 1, f))
 		goto error;
 
-	carousel = state->carousels;
+	carousel = shard->carousels;
 	while (carousel)
 	{
 		tmp = 0;
@@ -270,19 +320,3 @@ error:
 	return 0;
 }
 
-uint32_t dsmcc_object_carousel_get_transaction_id(struct dsmcc_state *state, uint32_t queue_id)
-{
-	struct dsmcc_object_carousel *carousel;
-	struct dsmcc_file_cache *filecache;
-
-	for (carousel = state->carousels; carousel; carousel = carousel->next)
-	{
-		filecache = dsmcc_filecache_find(carousel, queue_id);
-		if (filecache)
-		{
-			return dsmcc_filecache_transaction_id(filecache);
-		}
-	}
-	return 0;
-}
-
@@ -8,9 +8,11 @@
 struct dsmcc_object_carousel
 {
 	struct dsmcc_state *state;
+	struct dsmcc_shard *shard; /*< parsing thread of the carousel */
 	uint32_t            cid;
 	int                 type;
 	int                 status;
+	int                 priority; /*< DSMCC_PRIORITY_*, foreground if any of its requests is */
 
 	uint16_t requested_pid;
 	uint32_t requested_transaction_id;
@@ -30,15 +32,14 @@ struct dsmcc_object_carousel
 	struct dsmcc_object_carousel *next;
 };
 
-struct dsmcc_object_carousel *find_carousel_by_requested_pid(struct dsmcc_state *state, uint16_t pid);
-void dsmcc_object_carousel_queue_add(struct dsmcc_state *state, uint32_t queue_id,
-		struct dsmcc_parameters *parameters, struct dsmcc_carousel_callbacks *callbacks);
-void dsmcc_object_carousel_queue_remove(struct dsmcc_state *state, uint32_t queue_id);
+struct dsmcc_object_carousel *find_carousel_by_requested_pid(struct dsmcc_shard *shard, uint16_t pid);
+void dsmcc_object_carousel_queue_add(struct dsmcc_shard *shard, uint32_t queue_id,
+		struct dsmcc_parameters *parameters, struct dsmcc_carousel_callbacks *callbacks, int priority);
+void dsmcc_object_carousel_queue_remove(struct dsmcc_shard *shard, uint32_t queue_id);
 bool dsmcc_object_carousel_load_all(FILE *file, struct dsmcc_state *state);
-bool dsmcc_object_carousel_save_all(FILE *file, struct dsmcc_state *state);
+bool dsmcc_object_carousel_save_all(FILE *file, struct dsmcc_shard *shard);
 void dsmcc_object_carousel_free(struct dsmcc_object_carousel *carousel, bool keep_cache);
-void dsmcc_object_carousel_free_all(struct dsmcc_state *state, bool keep_cache);
+void dsmcc_object_carousel_free_all(struct dsmcc_shard *shard, bool keep_cache);
 void dsmcc_object_carousel_set_status(struct dsmcc_object_carousel *carousel, int newstatus);
-uint32_t dsmcc_object_carousel_get_transaction_id(struct dsmcc_state *state, uint32_t queue_id);
 
 #endif
@@ -0,0 +1,336 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dsmcc-crc.h"
+#include "dsmcc-debug.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DSMCC_CRC32_PCLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define DSMCC_CRC32_PMULL
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* CRC code taken from libdtv (Rolf Hakenes)    */
+/* CRC32 lookup table for polynomial 0x04c11db7 */
+static const uint32_t crc_table[256] = {
+	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b,
+	0x1a864db2, 0x1e475005, 0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+	0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd, 0x4c11db70, 0x48d0c6c7,
+	0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+	0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3,
+	0x709f7b7a, 0x745e66cd, 0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+	0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5, 0xbe2b5b58, 0xbaea46ef,
+	0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+	0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb,
+	0xceb42022, 0xca753d95, 0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+	0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d, 0x34867077, 0x30476dc0,
+	0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+	0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4,
+	0x0808d07d, 0x0cc9cdca, 0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+	0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02, 0x5e9f46bf, 0x5a5e5b08,
+	0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+	0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc,
+	0xb6238b25, 0xb2e29692, 0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+	0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a, 0xe0b41de7, 0xe4750050,
+	0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+	0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34,
+	0xdc3abded, 0xd8fba05a, 0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+	0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb, 0x4f040d56, 0x4bc510e1,
+	0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+	0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5,
+	0x3f9b762c, 0x3b5a6b9b, 0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+	0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623, 0xf12f560e, 0xf5ee4bb9,
+	0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+	0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd,
+	0xcda1f604, 0xc960ebb3, 0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+	0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b, 0x9b3660c6, 0x9ff77d71,
+	0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+	0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2,
+	0x470cdd2b, 0x43cdc09c, 0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+	0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24, 0x119b4be9, 0x155a565e,
+	0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+	0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a,
+	0x2d15ebe3, 0x29d4f654, 0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+	0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c, 0xe3a1cbc1, 0xe760d676,
+	0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+	0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662,
+	0x933eb0bb, 0x97ffad0c, 0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4};
+
+typedef uint32_t crc32_func(uint32_t crc, const uint8_t *data, uint32_t len);
+
+/* crc_slices[k][i] is the CRC of byte i followed by k null bytes */
+static uint32_t crc_slices[8][256];
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		crc = (crc << 8) ^ crc_table[((crc >> 24) ^ *data++) & 0xff];
+
+	return crc;
+}
+
+/**
+  * eight bytes per iteration, with independent table lookups
+  */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	while (len >= 8)
+	{
+		crc ^= ((uint32_t) data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+		crc = crc_slices[7][crc >> 24] ^ crc_slices[6][(crc >> 16) & 0xff] ^
+			crc_slices[5][(crc >> 8) & 0xff] ^ crc_slices[4][crc & 0xff] ^
+			crc_slices[3][data[4]] ^ crc_slices[2][data[5]] ^
+			crc_slices[1][data[6]] ^ crc_slices[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+
+	return crc32_bytewise(crc, data, len);
+}
+
+/*
+ * The carry-less multiply versions fold the data 16 bytes at a time, in four lanes 64 bytes apart: a 128 bit value X
+ * followed by n bits is replaced by X_hi.(x^(n+64) mod P) + X_lo.(x^n mod P), which has the same CRC. The bytes are
+ * reversed so that the first bit of the data is the most significant bit of the register. The remaining 128 bit value
+ * and the last bytes go through the table version.
+ */
+#define CRC32_X128 0xe8a45605
+#define CRC32_X192 0xc5b9cd4c
+#define CRC32_X512 0xe6228b11
+#define CRC32_X576 0x8833794c
+
+#ifdef DSMCC_CRC32_PCLMUL
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i pclmul_load(const uint8_t *data)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data),
+			_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i pclmul_fold(__m128i x, __m128i k, __m128i next)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	const __m128i k128 = _mm_set_epi64x(CRC32_X192, CRC32_X128);
+	const __m128i k512 = _mm_set_epi64x(CRC32_X576, CRC32_X512);
+	__m128i x0, x1, x2, x3;
+	uint8_t block[16];
+
+	if (len < 64)
+		return crc32_slice8(crc, data, len);
+
+	/* the CRC so far is added to the first 32 bits */
+	x0 = _mm_xor_si128(pclmul_load(data), _mm_set_epi32(crc, 0, 0, 0));
+	x1 = pclmul_load(data + 16);
+	x2 = pclmul_load(data + 32);
+	x3 = pclmul_load(data + 48);
+	data += 64;
+	len -= 64;
+
+	while (len >= 64)
+	{
+		x0 = pclmul_fold(x0, k512, pclmul_load(data));
+		x1 = pclmul_fold(x1, k512, pclmul_load(data + 16));
+		x2 = pclmul_fold(x2, k512, pclmul_load(data + 32));
+		x3 = pclmul_fold(x3, k512, pclmul_load(data + 48));
+		data += 64;
+		len -= 64;
+	}
+
+	x0 = pclmul_fold(x0, k128, x1);
+	x0 = pclmul_fold(x0, k128, x2);
+	x0 = pclmul_fold(x0, k128, x3);
+	while (len >= 16)
+	{
+		x0 = pclmul_fold(x0, k128, pclmul_load(data));
+		data += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *) block, _mm_shuffle_epi8(x0,
+			_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)));
+	return crc32_slice8(crc32_slice8(0, block, 16), data, len);
+}
+
+static bool has_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+#endif
+
+#ifdef DSMCC_CRC32_PMULL
+__attribute__((target("+crypto")))
+static inline uint64x2_t pmull_load(const uint8_t *data)
+{
+	uint8x16_t v = vrev64q_u8(vld1q_u8(data));
+
+	return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
+}
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t pmull_fold(uint64x2_t x, poly64_t k_lo, poly64_t k_hi, uint64x2_t next)
+{
+	uint64x2_t lo, hi;
+
+	lo = vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(x, 0), k_lo));
+	hi = vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(x, 1), k_hi));
+	return veorq_u64(veorq_u64(lo, hi), next);
+}
+
+__attribute__((target("+crypto")))
+static uint32_t crc32_pmull(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	uint64x2_t x0, x1, x2, x3;
+	uint8x16_t v;
+	uint8_t block[16];
+
+	if (len < 64)
+		return crc32_slice8(crc, data, len);
+
+	/* the CRC so far is added to the first 32 bits */
+	x0 = veorq_u64(pmull_load(data), vsetq_lane_u64((uint64_t) crc << 32, vdupq_n_u64(0), 1));
+	x1 = pmull_load(data + 16);
+	x2 = pmull_load(data + 32);
+	x3 = pmull_load(data + 48);
+	data += 64;
+	len -= 64;
+
+	while (len >= 64)
+	{
+		x0 = pmull_fold(x0, CRC32_X512, CRC32_X576, pmull_load(data));
+		x1 = pmull_fold(x1, CRC32_X512, CRC32_X576, pmull_load(data + 16));
+		x2 = pmull_fold(x2, CRC32_X512, CRC32_X576, pmull_load(data + 32));
+		x3 = pmull_fold(x3, CRC32_X512, CRC32_X576, pmull_load(data + 48));
+		data += 64;
+		len -= 64;
+	}
+
+	x0 = pmull_fold(x0, CRC32_X128, CRC32_X192, x1);
+	x0 = pmull_fold(x0, CRC32_X128, CRC32_X192, x2);
+	x0 = pmull_fold(x0, CRC32_X128, CRC32_X192, x3);
+	while (len >= 16)
+	{
+		x0 = pmull_fold(x0, CRC32_X128, CRC32_X192, pmull_load(data));
+		data += 16;
+		len -= 16;
+	}
+
+	v = vrev64q_u8(vreinterpretq_u8_u64(x0));
+	vst1q_u8(block, vextq_u8(v, v, 8));
+	return crc32_slice8(crc32_slice8(0, block, 16), data, len);
+}
+
+static bool has_pmull(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#endif
+
+/**
+  * compare an implementation with the byte at a time one, on lengths and alignments going through all its code paths
+  */
+static bool crc32_check(crc32_func *func)
+{
+	uint8_t buffer[600];
+	uint32_t i, len, offset, seed = 0x2545f491;
+
+	for (i = 0; i < sizeof(buffer); i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = seed >> 16;
+	}
+
+	for (len = 0; len + 16 <= sizeof(buffer); len += len < 200 ? 1 : 29)
+		for (offset = 0; offset < 16; offset += 5)
+			if ((*func)(0xffffffff, buffer + offset, len) != crc32_bytewise(0xffffffff, buffer + offset, len))
+				return 0;
+	return 1;
+}
+
+static uint32_t crc32_select(uint32_t crc, const uint8_t *data, uint32_t len);
+
+static crc32_func *crc32_impl = &crc32_select;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+	crc32_func *func = &crc32_bytewise;
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc_slices[0][i] = crc_table[i];
+		for (k = 1; k < 8; k++)
+			crc_slices[k][i] = (crc_slices[k - 1][i] << 8) ^ crc_table[crc_slices[k - 1][i] >> 24];
+	}
+
+	if (crc32_check(&crc32_slice8))
+	{
+		func = &crc32_slice8;
+		DSMCC_DEBUG("Using slicing-by-8 CRC32");
+	}
+	else
+	{
+		DSMCC_ERROR("CRC32 slicing-by-8 self-check failed");
+		DSMCC_DEBUG("Using byte at a time CRC32");
+	}
+
+#ifdef DSMCC_CRC32_PCLMUL
+	if (func == &crc32_slice8 && has_pclmul())
+	{
+		if (crc32_check(&crc32_pclmul))
+		{
+			func = &crc32_pclmul;
+			DSMCC_DEBUG("Using PCLMULQDQ CRC32");
+		}
+		else
+			DSMCC_ERROR("CRC32 PCLMULQDQ self-check failed");
+	}
+#endif
+#ifdef DSMCC_CRC32_PMULL
+	if (func == &crc32_slice8 && has_pmull())
+	{
+		if (crc32_check(&crc32_pmull))
+		{
+			func = &crc32_pmull;
+			DSMCC_DEBUG("Using PMULL CRC32");
+		}
+		else
+			DSMCC_ERROR("CRC32 PMULL self-check failed");
+	}
+#endif
+
+	__atomic_store_n(&crc32_impl, func, __ATOMIC_RELEASE);
+}
+
+/**
+  * first call, choose the best implementation for the CPU
+  */
+static uint32_t crc32_select(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	pthread_once(&crc32_once, &crc32_init);
+	return (*__atomic_load_n(&crc32_impl, __ATOMIC_ACQUIRE))(crc, data, len);
+}
+
+uint32_t dsmcc_crc32(uint8_t *data, uint32_t len)
+{
+	return (*__atomic_load_n(&crc32_impl, __ATOMIC_ACQUIRE))(0xffffffff, data, len);
+}
@@ -0,0 +1,9 @@
+#ifndef DSMCC_CRC_H
+#define DSMCC_CRC_H
+
+#include <stdint.h>
+
+/* MPEG-2 CRC32 (polynomial 0x04c11db7, not reflected), using the fastest implementation available on the CPU */
+uint32_t dsmcc_crc32(uint8_t *data, uint32_t len);
+
+#endif
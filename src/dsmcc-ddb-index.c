@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsmcc-ddb-index.h"
+#include "dsmcc-cache.h"
+
+/**
+  * The parsing thread sets the bits of the blockmaps in place, with atomic operations, as the blocks are stored. Adding
+  * or removing a module publishes a new table at the end of the processing pass, the previous one and the entries
+  * removed meanwhile are freed once the reader counter was seen at zero after the swap, as for the carousel snapshots.
+  *
+  * A DDB section is only dropped if all the entries of its download and module IDs do not need it: it has a version
+  * replaced by the current one, or its block is stored. A section without entry is always queued, the parsing thread
+  * may not have published the module yet. The CRC is not checked at this point, a corrupt section looking like a
+  * stored block does not need to be parsed either.
+  */
+
+void dsmcc_ddb_index_init(struct dsmcc_ddb_index *index)
+{
+	memset(index, 0, sizeof(struct dsmcc_ddb_index));
+}
+
+static void free_entry(struct dsmcc_ddb_index_entry *entry)
+{
+	free(entry->blockmap);
+	free(entry);
+}
+
+static void free_table(struct dsmcc_ddb_index_table *table)
+{
+	free(table->entries);
+	free(table);
+}
+
+static void free_retired(struct dsmcc_ddb_index *index)
+{
+	struct dsmcc_ddb_index_table *table;
+	struct dsmcc_ddb_index_entry *entry;
+
+	while (index->retired_tables)
+	{
+		table = index->retired_tables;
+		index->retired_tables = table->next_retired;
+		free_table(table);
+	}
+	while (index->retired_entries)
+	{
+		entry = index->retired_entries;
+		index->retired_entries = entry->next_retired;
+		free_entry(entry);
+	}
+}
+
+void dsmcc_ddb_index_free(struct dsmcc_ddb_index *index)
+{
+	int i;
+
+	/* the removed entries were not retired yet */
+	while (index->removed_entries)
+	{
+		struct dsmcc_ddb_index_entry *entry = index->removed_entries;
+		index->removed_entries = entry->next_retired;
+		free_entry(entry);
+	}
+	free_retired(index);
+	if (index->table)
+		free_table(index->table);
+	for (i = 0; i < index->count; i++)
+		free_entry(index->entries[i]);
+	free(index->entries);
+	memset(index, 0, sizeof(struct dsmcc_ddb_index));
+}
+
+/**
+  * add a module whose blocks may already be partially stored (blockmap can be NULL), the entry is published at the end
+  * of the processing pass
+  */
+struct dsmcc_ddb_index_entry *dsmcc_ddb_index_add(struct dsmcc_ddb_index *index, struct dsmcc_module_id *module_id,
+		uint8_t skip_leading_bytes, uint32_t block_count, const uint8_t *blockmap)
+{
+	struct dsmcc_ddb_index_entry *entry;
+
+	entry = calloc(1, sizeof(struct dsmcc_ddb_index_entry));
+	entry->download_id = module_id->download_id;
+	entry->module_id = module_id->module_id;
+	entry->module_version = module_id->module_version;
+	entry->skip_leading_bytes = skip_leading_bytes;
+	entry->block_count = block_count;
+	entry->blockmap = calloc(1, (block_count + 7) >> 3);
+	if (blockmap)
+		memcpy(entry->blockmap, blockmap, (block_count + 7) >> 3);
+
+	if (index->count == index->size)
+	{
+		index->size = index->size ? index->size * 2 : 16;
+		index->entries = realloc(index->entries, index->size * sizeof(struct dsmcc_ddb_index_entry *));
+	}
+	index->entries[index->count++] = entry;
+	index->changed = 1;
+
+	return entry;
+}
+
+void dsmcc_ddb_index_remove(struct dsmcc_ddb_index *index, struct dsmcc_ddb_index_entry *entry)
+{
+	int i;
+
+	if (!entry)
+		return;
+
+	for (i = 0; i < index->count; i++)
+	{
+		if (index->entries[i] == entry)
+		{
+			index->entries[i] = index->entries[--index->count];
+			break;
+		}
+	}
+
+	/* the producers may be reading it until the next table is published */
+	entry->next_retired = index->removed_entries;
+	index->removed_entries = entry;
+	index->changed = 1;
+}
+
+/**
+  * called before the entry is published
+  */
+void dsmcc_ddb_index_set_replaced(struct dsmcc_ddb_index_entry *entry, uint8_t replaced_version)
+{
+	entry->replaced = 1;
+	entry->replaced_version = replaced_version;
+}
+
+void dsmcc_ddb_index_set_block(struct dsmcc_ddb_index_entry *entry, uint16_t block_number)
+{
+	if (entry && block_number < entry->block_count)
+		__atomic_or_fetch(&entry->blockmap[block_number >> 3], 1 << (block_number & 7), __ATOMIC_RELAXED);
+}
+
+void dsmcc_ddb_index_set_complete(struct dsmcc_ddb_index_entry *entry)
+{
+	if (entry)
+		__atomic_store_n(&entry->complete, 1, __ATOMIC_RELAXED);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct dsmcc_ddb_index_entry *ea = *(struct dsmcc_ddb_index_entry * const *) a;
+	const struct dsmcc_ddb_index_entry *eb = *(struct dsmcc_ddb_index_entry * const *) b;
+
+	return (int) ea->module_id - (int) eb->module_id;
+}
+
+/**
+  * publish the entries if they changed, and free the replaced tables no producer can still be using
+  */
+void dsmcc_ddb_index_publish(struct dsmcc_ddb_index *index)
+{
+	struct dsmcc_ddb_index_table *table, *old;
+	struct dsmcc_ddb_index_entry *entry;
+
+	if (index->changed)
+	{
+		table = calloc(1, sizeof(struct dsmcc_ddb_index_table));
+		table->count = index->count;
+		table->entries = malloc((index->count ? index->count : 1) * sizeof(struct dsmcc_ddb_index_entry *));
+		memcpy(table->entries, index->entries, index->count * sizeof(struct dsmcc_ddb_index_entry *));
+		qsort(table->entries, table->count, sizeof(struct dsmcc_ddb_index_entry *), &compare_entries);
+
+		old = __atomic_exchange_n(&index->table, table, __ATOMIC_SEQ_CST);
+		if (old)
+		{
+			old->next_retired = index->retired_tables;
+			index->retired_tables = old;
+		}
+		while (index->removed_entries)
+		{
+			entry = index->removed_entries;
+			index->removed_entries = entry->next_retired;
+			entry->next_retired = index->retired_entries;
+			index->retired_entries = entry;
+		}
+		index->changed = 0;
+	}
+
+	if ((index->retired_tables || index->retired_entries) && !__atomic_load_n(&index->readers, __ATOMIC_SEQ_CST))
+		free_retired(index);
+}
+
+/**
+  * returns 1 if the DDB section is needed by the module of the entry, 0 if it is not, -1 if it is for another download
+  */
+static int entry_needs(struct dsmcc_ddb_index_entry *entry, const uint8_t *data, int length)
+{
+	uint16_t block_number;
+	uint8_t module_version;
+	int off;
+
+	/* section header, then DDB message header, ETSI TR 101 202 Table A.3 */
+	off = 8 + entry->skip_leading_bytes;
+	if (length < off + 12 || data[off + 2] != 0x10 || data[off + 3] != 0x03)
+		return 1;
+	if (((uint32_t) data[off + 4] << 24 | data[off + 5] << 16 | data[off + 6] << 8 | data[off + 7]) != entry->download_id)
+		return -1;
+
+	/* DownloadDataBlock, Table A.5 */
+	off += 12 + data[off + 9];
+	if (length < off + 6 || (data[off] << 8 | data[off + 1]) != entry->module_id)
+		return 1;
+	module_version = data[off + 2];
+	block_number = data[off + 4] << 8 | data[off + 5];
+
+	if (module_version != entry->module_version)
+		return !entry->replaced || module_version != entry->replaced_version;
+	if (__atomic_load_n(&entry->complete, __ATOMIC_RELAXED))
+		return 0;
+	if (block_number >= entry->block_count)
+		return 1;
+	return !((__atomic_load_n(&entry->blockmap[block_number >> 3], __ATOMIC_RELAXED) >> (block_number & 7)) & 1);
+}
+
+/**
+  * returns true if the shard has no use for the DDB section. The module ID is taken from the table_id_extension of the
+  * section to find the entries.
+  */
+bool dsmcc_ddb_index_known(struct dsmcc_ddb_index *index, const uint8_t *data, int length)
+{
+	struct dsmcc_ddb_index_table *table;
+	uint16_t module_id;
+	int low, high, mid, needs;
+	bool known = 0;
+
+	if (length < 8)
+		return 0;
+	module_id = data[3] << 8 | data[4];
+
+	__atomic_add_fetch(&index->readers, 1, __ATOMIC_SEQ_CST);
+	table = __atomic_load_n(&index->table, __ATOMIC_SEQ_CST);
+	if (table)
+	{
+		/* first entry of the module */
+		low = 0;
+		high = table->count;
+		while (low < high)
+		{
+			mid = (low + high) / 2;
+			if (table->entries[mid]->module_id < module_id)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+
+		for (; low < table->count && table->entries[low]->module_id == module_id; low++)
+		{
+			needs = entry_needs(table->entries[low], data, length);
+			if (needs > 0)
+			{
+				known = 0;
+				break;
+			}
+			if (!needs)
+				known = 1;
+		}
+	}
+	__atomic_sub_fetch(&index->readers, 1, __ATOMIC_SEQ_CST);
+
+	return known;
+}
@@ -0,0 +1,66 @@
+#ifndef DSMCC_DDB_INDEX_H
+#define DSMCC_DDB_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* blocks already stored by the modules of a shard, published for the threads adding sections so that they drop the
+ * DDB sections the shard does not need anymore before computing their CRC and queueing them */
+
+/* from dsmcc-cache.h */
+struct dsmcc_module_id;
+
+/* a module of a carousel of the shard */
+struct dsmcc_ddb_index_entry
+{
+	uint32_t download_id;
+	uint16_t module_id;
+	uint8_t  module_version;
+	uint8_t  skip_leading_bytes; /*< of the carousel, to find the DDB message header */
+	bool     replaced;           /*< the DDB sections of replaced_version are not needed anymore */
+	uint8_t  replaced_version;
+	bool     complete;           /*< all the blocks are stored, set by the parsing thread */
+	uint32_t block_count;
+	uint8_t *blockmap;           /*< blocks stored, set by the parsing thread */
+
+	struct dsmcc_ddb_index_entry *next_retired;
+};
+
+/* entries sorted by module ID, replaced as a whole when an entry is added or removed */
+struct dsmcc_ddb_index_table
+{
+	int                            count;
+	struct dsmcc_ddb_index_entry **entries;
+
+	struct dsmcc_ddb_index_table *next_retired;
+};
+
+struct dsmcc_ddb_index
+{
+	struct dsmcc_ddb_index_table *table;   /*< published, read by the producers */
+	int                           readers; /*< number of producers reading table */
+
+	/* only used by the parsing thread */
+	struct dsmcc_ddb_index_entry **entries;         /*< entries of the modules, in no particular order */
+	int                            count;
+	int                            size;
+	bool                           changed;         /*< entries changed since table was published */
+	struct dsmcc_ddb_index_entry  *removed_entries; /*< removed since table was published, still referenced by it */
+	struct dsmcc_ddb_index_table  *retired_tables;  /*< replaced tables, freed with retired_entries once no producer can be using them */
+	struct dsmcc_ddb_index_entry  *retired_entries;
+};
+
+void dsmcc_ddb_index_init(struct dsmcc_ddb_index *index);
+void dsmcc_ddb_index_free(struct dsmcc_ddb_index *index);
+
+struct dsmcc_ddb_index_entry *dsmcc_ddb_index_add(struct dsmcc_ddb_index *index, struct dsmcc_module_id *module_id,
+		uint8_t skip_leading_bytes, uint32_t block_count, const uint8_t *blockmap);
+void dsmcc_ddb_index_remove(struct dsmcc_ddb_index *index, struct dsmcc_ddb_index_entry *entry);
+void dsmcc_ddb_index_set_replaced(struct dsmcc_ddb_index_entry *entry, uint8_t replaced_version);
+void dsmcc_ddb_index_set_block(struct dsmcc_ddb_index_entry *entry, uint16_t block_number);
+void dsmcc_ddb_index_set_complete(struct dsmcc_ddb_index_entry *entry);
+void dsmcc_ddb_index_publish(struct dsmcc_ddb_index *index);
+
+bool dsmcc_ddb_index_known(struct dsmcc_ddb_index *index, const uint8_t *data, int length);
+
+#endif
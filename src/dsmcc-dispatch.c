@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsmcc-dispatch.h"
+
+static void deliver_event(struct dsmcc_event *event)
+{
+	switch (event->type)
+	{
+		case DSMCC_EVENT_DENTRY_SAVED:
+			(*event->dentry_saved.callback)(event->dentry_saved.arg, event->queue_id, event->cid,
+					event->dentry_saved.dir, event->dentry_saved.path, event->dentry_saved.fullpath);
+			break;
+		case DSMCC_EVENT_PROGRESSION:
+			(*event->progression.callback)(event->progression.arg, event->queue_id, event->cid,
+					event->progression.downloaded, event->progression.total);
+			break;
+		case DSMCC_EVENT_STATUS_CHANGED:
+			(*event->status_changed.callback)(event->status_changed.arg, event->queue_id, event->cid,
+					event->status_changed.status);
+			break;
+	}
+}
+
+static void free_event(struct dsmcc_event *event)
+{
+	if (event->type == DSMCC_EVENT_DENTRY_SAVED)
+	{
+		free(event->dentry_saved.path);
+		free(event->dentry_saved.fullpath);
+	}
+	free(event);
+}
+
+static void unlink_progression(struct dsmcc_dispatcher *dispatcher, struct dsmcc_event *event)
+{
+	struct dsmcc_event **prev;
+
+	for (prev = &dispatcher->progressions; *prev; prev = &(*prev)->next_progression)
+	{
+		if (*prev == event)
+		{
+			*prev = event->next_progression;
+			break;
+		}
+	}
+}
+
+static void *dispatcher_func(void *arg)
+{
+	struct dsmcc_dispatcher *dispatcher = (struct dsmcc_dispatcher *) arg;
+	struct dsmcc_event *event;
+
+	pthread_mutex_lock(&dispatcher->mutex);
+	while (1)
+	{
+		while (!dispatcher->first && !dispatcher->stop)
+			pthread_cond_wait(&dispatcher->cond, &dispatcher->mutex);
+		/* events queued before stop are still delivered */
+		if (!dispatcher->first)
+			break;
+
+		event = dispatcher->first;
+		dispatcher->first = event->next;
+		if (!dispatcher->first)
+			dispatcher->last = NULL;
+		if (event->type == DSMCC_EVENT_PROGRESSION && !event->superseded)
+			unlink_progression(dispatcher, event);
+		pthread_mutex_unlock(&dispatcher->mutex);
+
+		if (!event->superseded)
+			deliver_event(event);
+		free_event(event);
+
+		pthread_mutex_lock(&dispatcher->mutex);
+	}
+	pthread_mutex_unlock(&dispatcher->mutex);
+
+	return NULL;
+}
+
+struct dsmcc_dispatcher *dsmcc_dispatcher_new(void)
+{
+	struct dsmcc_dispatcher *dispatcher;
+
+	dispatcher = calloc(1, sizeof(struct dsmcc_dispatcher));
+	pthread_mutex_init(&dispatcher->mutex, NULL);
+	pthread_cond_init(&dispatcher->cond, NULL);
+	pthread_create(&dispatcher->thread, NULL, &dispatcher_func, dispatcher);
+
+	return dispatcher;
+}
+
+/**
+  * Deliver the queued events and stop the thread
+  */
+void dsmcc_dispatcher_free(struct dsmcc_dispatcher *dispatcher)
+{
+	if (!dispatcher)
+		return;
+
+	pthread_mutex_lock(&dispatcher->mutex);
+	dispatcher->stop = 1;
+	pthread_cond_signal(&dispatcher->cond);
+	pthread_mutex_unlock(&dispatcher->mutex);
+
+	pthread_join(dispatcher->thread, NULL);
+
+	pthread_cond_destroy(&dispatcher->cond);
+	pthread_mutex_destroy(&dispatcher->mutex);
+	free(dispatcher);
+}
+
+static void queue_event(struct dsmcc_dispatcher *dispatcher, struct dsmcc_event *event)
+{
+	struct dsmcc_event *prev;
+
+	event->next = NULL;
+
+	pthread_mutex_lock(&dispatcher->mutex);
+	if (event->type == DSMCC_EVENT_PROGRESSION)
+	{
+		/* the application only needs the last progression of a carousel, but it is delivered at its place in the
+		 * sequence of events */
+		for (prev = dispatcher->progressions; prev; prev = prev->next_progression)
+		{
+			if (prev->queue_id == event->queue_id && prev->cid == event->cid &&
+					prev->progression.callback == event->progression.callback && prev->progression.arg == event->progression.arg)
+			{
+				prev->superseded = 1;
+				unlink_progression(dispatcher, prev);
+				break;
+			}
+		}
+		event->next_progression = dispatcher->progressions;
+		dispatcher->progressions = event;
+	}
+
+	if (dispatcher->last)
+		dispatcher->last->next = event;
+	else
+		dispatcher->first = event;
+	dispatcher->last = event;
+	pthread_cond_signal(&dispatcher->cond);
+	pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+void dsmcc_dispatch_dentry_saved(struct dsmcc_dispatcher *dispatcher, struct dsmcc_carousel_callbacks *callbacks,
+		uint32_t queue_id, uint32_t cid, bool dir, const char *path, const char *fullpath)
+{
+	struct dsmcc_event *event;
+
+	if (!dispatcher)
+	{
+		(*callbacks->dentry_saved)(callbacks->dentry_saved_arg, queue_id, cid, dir, path, fullpath);
+		return;
+	}
+
+	event = calloc(1, sizeof(struct dsmcc_event));
+	event->type = DSMCC_EVENT_DENTRY_SAVED;
+	event->queue_id = queue_id;
+	event->cid = cid;
+	event->dentry_saved.callback = callbacks->dentry_saved;
+	event->dentry_saved.arg = callbacks->dentry_saved_arg;
+	event->dentry_saved.dir = dir;
+	event->dentry_saved.path = strdup(path);
+	event->dentry_saved.fullpath = strdup(fullpath);
+	queue_event(dispatcher, event);
+}
+
+void dsmcc_dispatch_progression(struct dsmcc_dispatcher *dispatcher, struct dsmcc_carousel_callbacks *callbacks,
+		uint32_t queue_id, uint32_t cid, uint32_t downloaded, uint32_t total)
+{
+	struct dsmcc_event *event;
+
+	if (!dispatcher)
+	{
+		(*callbacks->download_progression)(callbacks->download_progression_arg, queue_id, cid, downloaded, total);
+		return;
+	}
+
+	event = calloc(1, sizeof(struct dsmcc_event));
+	event->type = DSMCC_EVENT_PROGRESSION;
+	event->queue_id = queue_id;
+	event->cid = cid;
+	event->progression.callback = callbacks->download_progression;
+	event->progression.arg = callbacks->download_progression_arg;
+	event->progression.downloaded = downloaded;
+	event->progression.total = total;
+	queue_event(dispatcher, event);
+}
+
+void dsmcc_dispatch_status_changed(struct dsmcc_dispatcher *dispatcher, struct dsmcc_carousel_callbacks *callbacks,
+		uint32_t queue_id, uint32_t cid, int newstatus)
+{
+	struct dsmcc_event *event;
+
+	if (!dispatcher)
+	{
+		(*callbacks->carousel_status_changed)(callbacks->carousel_status_changed_arg, queue_id, cid, newstatus);
+		return;
+	}
+
+	event = calloc(1, sizeof(struct dsmcc_event));
+	event->type = DSMCC_EVENT_STATUS_CHANGED;
+	event->queue_id = queue_id;
+	event->cid = cid;
+	event->status_changed.callback = callbacks->carousel_status_changed;
+	event->status_changed.arg = callbacks->carousel_status_changed_arg;
+	event->status_changed.status = newstatus;
+	queue_event(dispatcher, event);
+}
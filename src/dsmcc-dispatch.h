@@ -0,0 +1,73 @@
+#ifndef DSMCC_DISPATCH_H
+#define DSMCC_DISPATCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <dsmcc/dsmcc.h>
+
+/* thread calling the notification callbacks of the carousels, so that slow callbacks do not delay the parsing */
+
+enum
+{
+	DSMCC_EVENT_DENTRY_SAVED,
+	DSMCC_EVENT_PROGRESSION,
+	DSMCC_EVENT_STATUS_CHANGED
+};
+
+struct dsmcc_event
+{
+	int      type;
+	bool     superseded; /*< a more recent progression event was queued for the same carousel, skip this one */
+	uint32_t queue_id;
+	uint32_t cid;
+
+	union {
+		struct {
+			void (*callback)(void *arg, uint32_t queue_id, uint32_t cid, bool dir, const char *path, const char *fullpath);
+			void *arg;
+			bool  dir;
+			char *path;
+			char *fullpath;
+		} dentry_saved;
+
+		struct {
+			void   (*callback)(void *arg, uint32_t queue_id, uint32_t cid, uint32_t downloaded, uint32_t total);
+			void    *arg;
+			uint32_t downloaded;
+			uint32_t total;
+		} progression;
+
+		struct {
+			void (*callback)(void *arg, uint32_t queue_id, uint32_t cid, int newstatus);
+			void *arg;
+			int   status;
+		} status_changed;
+	};
+
+	struct dsmcc_event *next;
+	struct dsmcc_event *next_progression; /*< next queued progression event */
+};
+
+struct dsmcc_dispatcher
+{
+	pthread_mutex_t     mutex;
+	pthread_cond_t      cond;
+	struct dsmcc_event *first, *last;  /*< events waiting to be delivered, in order */
+	struct dsmcc_event *progressions;  /*< progression events waiting to be delivered and not superseded */
+	bool                stop;
+	pthread_t           thread;
+};
+
+struct dsmcc_dispatcher *dsmcc_dispatcher_new(void);
+void dsmcc_dispatcher_free(struct dsmcc_dispatcher *dispatcher);
+
+/* the callbacks are called immediately if dispatcher is NULL */
+void dsmcc_dispatch_dentry_saved(struct dsmcc_dispatcher *dispatcher, struct dsmcc_carousel_callbacks *callbacks,
+		uint32_t queue_id, uint32_t cid, bool dir, const char *path, const char *fullpath);
+void dsmcc_dispatch_progression(struct dsmcc_dispatcher *dispatcher, struct dsmcc_carousel_callbacks *callbacks,
+		uint32_t queue_id, uint32_t cid, uint32_t downloaded, uint32_t total);
+void dsmcc_dispatch_status_changed(struct dsmcc_dispatcher *dispatcher, struct dsmcc_carousel_callbacks *callbacks,
+		uint32_t queue_id, uint32_t cid, int newstatus);
+
+#endif
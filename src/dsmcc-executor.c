@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include <dsmcc/dsmcc.h>
+#include "dsmcc-executor.h"
+#include "dsmcc-worker.h"
+#include "dsmcc-debug.h"
+
+/**
+  * Each attached task has a home thread, chosen in turn when it is attached, where it is queued when it is ready so
+  * that a task tends to stay on the same thread. An idle thread takes the oldest ready task of the other threads
+  * before going to sleep, so that a burst on the tasks of one state can use the threads of the others. The idle
+  * threads also run the tasks whose wakeup time has passed.
+  */
+
+static void append_ready(struct dsmcc_executor_thread *thread, struct dsmcc_task *task)
+{
+	task->next_ready = NULL;
+	if (thread->last)
+		thread->last->next_ready = task;
+	else
+		thread->first = task;
+	thread->last = task;
+}
+
+static struct dsmcc_task *pop_ready(struct dsmcc_executor_thread *thread)
+{
+	struct dsmcc_task *task = thread->first;
+
+	if (task)
+	{
+		thread->first = task->next_ready;
+		if (!thread->first)
+			thread->last = NULL;
+		task->next_ready = NULL;
+	}
+	return task;
+}
+
+static void remove_ready(struct dsmcc_executor_thread *thread, struct dsmcc_task *task)
+{
+	struct dsmcc_task *prev = NULL, *cur;
+
+	for (cur = thread->first; cur && cur != task; cur = cur->next_ready)
+		prev = cur;
+	if (!cur)
+		return;
+
+	if (prev)
+		prev->next_ready = task->next_ready;
+	else
+		thread->first = task->next_ready;
+	if (thread->last == task)
+		thread->last = prev;
+	task->next_ready = NULL;
+}
+
+/**
+  * returns a task to run: one queued on this thread, else one stolen from another thread, else one whose wakeup time
+  * has passed. Sets next to the earliest wakeup time in the future otherwise. Called with the mutex held.
+  */
+static struct dsmcc_task *next_task(struct dsmcc_executor_thread *thread, struct timeval *next)
+{
+	struct dsmcc_executor *executor = thread->executor;
+	struct dsmcc_task *task;
+	struct timespec ts;
+	struct timeval now;
+	int i;
+
+	task = pop_ready(thread);
+	for (i = 1; !task && i < executor->thread_count; i++)
+		task = pop_ready(&executor->threads[(thread->index + i) % executor->thread_count]);
+	if (task)
+		return task;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now.tv_sec = ts.tv_sec;
+	now.tv_usec = ts.tv_nsec / 1000;
+	timerclear(next);
+	for (i = 0; i < executor->task_count; i++)
+	{
+		task = executor->tasks[i];
+		if (task->scheduled || task->running || !timerisset(&task->wakeup))
+			continue;
+		if (!timercmp(&task->wakeup, &now, >))
+			return task;
+		if (!timerisset(next) || timercmp(&task->wakeup, next, <))
+			*next = task->wakeup;
+	}
+
+	return NULL;
+}
+
+static void *executor_func(void *arg)
+{
+	struct dsmcc_executor_thread *thread = (struct dsmcc_executor_thread *) arg;
+	struct dsmcc_executor *executor = thread->executor;
+	struct dsmcc_task *task;
+	struct timeval next, wakeup;
+	struct timespec ts;
+	bool again;
+
+	pthread_mutex_lock(&executor->mutex);
+	while (!executor->stop)
+	{
+		task = next_task(thread, &next);
+		if (!task)
+		{
+			executor->idle++;
+			executor->idle_wakeup = next;
+			if (timerisset(&next))
+			{
+				ts.tv_sec = next.tv_sec;
+				ts.tv_nsec = next.tv_usec * 1000;
+				pthread_cond_timedwait(&executor->cond, &executor->mutex, &ts);
+			}
+			else
+				pthread_cond_wait(&executor->cond, &executor->mutex);
+			executor->idle--;
+			continue;
+		}
+
+		task->scheduled = 0;
+		task->running = 1;
+		timerclear(&task->wakeup);
+		pthread_mutex_unlock(&executor->mutex);
+
+		again = (*task->run)(task, &wakeup);
+
+		pthread_mutex_lock(&executor->mutex);
+		task->running = 0;
+		task->wakeup = wakeup;
+		if (!task->attached)
+		{
+			/* dsmcc_executor_detach is waiting for the task */
+			pthread_cond_broadcast(&executor->detach_cond);
+			continue;
+		}
+		if (again)
+			task->scheduled = 1;
+		if (task->scheduled)
+		{
+			append_ready(task->home, task);
+			if (task->home != thread && executor->idle)
+				pthread_cond_signal(&executor->cond);
+		}
+		else if (timerisset(&wakeup) && executor->idle &&
+				(!timerisset(&executor->idle_wakeup) || timercmp(&wakeup, &executor->idle_wakeup, <)))
+		{
+			/* the idle threads sleep past the new wakeup time */
+			pthread_cond_signal(&executor->cond);
+		}
+	}
+	pthread_mutex_unlock(&executor->mutex);
+
+	return NULL;
+}
+
+struct dsmcc_executor *dsmcc_executor_new(int threads, int workers)
+{
+	struct dsmcc_executor *executor;
+	pthread_condattr_t attr;
+	int i;
+
+	executor = calloc(1, sizeof(struct dsmcc_executor));
+	pthread_mutex_init(&executor->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&executor->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&executor->detach_cond, NULL);
+	executor->workers = dsmcc_workers_new(workers);
+
+	executor->thread_count = threads > 0 ? threads : 1;
+	executor->threads = calloc(executor->thread_count, sizeof(struct dsmcc_executor_thread));
+	for (i = 0; i < executor->thread_count; i++)
+	{
+		executor->threads[i].executor = executor;
+		executor->threads[i].index = i;
+		pthread_create(&executor->threads[i].thread, NULL, &executor_func, &executor->threads[i]);
+	}
+
+	return executor;
+}
+
+/**
+  * The states using the executor must have been closed
+  */
+void dsmcc_executor_free(struct dsmcc_executor *executor)
+{
+	int i;
+
+	if (!executor)
+		return;
+
+	if (executor->task_count)
+		DSMCC_ERROR("Executor freed while %d shard(s) are attached", executor->task_count);
+
+	pthread_mutex_lock(&executor->mutex);
+	executor->stop = 1;
+	pthread_cond_broadcast(&executor->cond);
+	pthread_mutex_unlock(&executor->mutex);
+
+	for (i = 0; i < executor->thread_count; i++)
+		pthread_join(executor->threads[i].thread, NULL);
+	dsmcc_workers_free(executor->workers);
+
+	pthread_cond_destroy(&executor->detach_cond);
+	pthread_cond_destroy(&executor->cond);
+	pthread_mutex_destroy(&executor->mutex);
+	free(executor->tasks);
+	free(executor->threads);
+	free(executor);
+}
+
+void dsmcc_executor_attach(struct dsmcc_executor *executor, struct dsmcc_task *task)
+{
+	pthread_mutex_lock(&executor->mutex);
+	if (executor->task_count == executor->task_size)
+	{
+		executor->task_size = executor->task_size ? executor->task_size * 2 : 8;
+		executor->tasks = realloc(executor->tasks, executor->task_size * sizeof(struct dsmcc_task *));
+	}
+	executor->tasks[executor->task_count++] = task;
+	task->home = &executor->threads[executor->next_home];
+	executor->next_home = (executor->next_home + 1) % executor->thread_count;
+	task->attached = 1;
+	task->scheduled = 0;
+	task->running = 0;
+	timerclear(&task->wakeup);
+	pthread_mutex_unlock(&executor->mutex);
+}
+
+/**
+  * wait until the task is not running anymore and forget it, it is not run again once this returns
+  */
+void dsmcc_executor_detach(struct dsmcc_executor *executor, struct dsmcc_task *task)
+{
+	int i;
+
+	pthread_mutex_lock(&executor->mutex);
+	task->attached = 0;
+	if (task->scheduled && !task->running)
+		remove_ready(task->home, task);
+	task->scheduled = 0;
+	while (task->running)
+		pthread_cond_wait(&executor->detach_cond, &executor->mutex);
+
+	for (i = 0; i < executor->task_count; i++)
+	{
+		if (executor->tasks[i] == task)
+		{
+			executor->tasks[i] = executor->tasks[--executor->task_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&executor->mutex);
+}
+
+void dsmcc_executor_schedule(struct dsmcc_executor *executor, struct dsmcc_task *task)
+{
+	pthread_mutex_lock(&executor->mutex);
+	if (task->attached && !task->scheduled)
+	{
+		task->scheduled = 1;
+		/* a running task is queued again by its thread once it has run */
+		if (!task->running)
+		{
+			append_ready(task->home, task);
+			if (executor->idle)
+				pthread_cond_signal(&executor->cond);
+		}
+	}
+	pthread_mutex_unlock(&executor->mutex);
+}
@@ -0,0 +1,62 @@
+#ifndef DSMCC_EXECUTOR_H
+#define DSMCC_EXECUTOR_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* threads shared by several library states, running the shards of all of them */
+
+/* from dsmcc-worker.h */
+struct dsmcc_workers;
+
+struct dsmcc_executor_thread;
+
+struct dsmcc_task
+{
+	/* called by an executor thread, returns true if the task has to run again. wakeup is set to the time the task has
+	 * to run again if nothing schedules it before, or cleared if there is none */
+	bool (*run)(struct dsmcc_task *task, struct timeval *wakeup);
+
+	/* the following fields are protected by the mutex of the executor */
+	struct dsmcc_executor_thread *home;      /*< thread the task is queued to, other threads steal it when idle */
+	bool                          attached;
+	bool                          scheduled; /*< queued on its home thread, or to be queued once it has run */
+	bool                          running;
+	struct timeval                wakeup;
+	struct dsmcc_task            *next_ready;
+};
+
+struct dsmcc_executor_thread
+{
+	struct dsmcc_executor *executor;
+	int                    index;
+	struct dsmcc_task     *first, *last; /*< tasks ready to run */
+	pthread_t              thread;
+};
+
+struct dsmcc_executor
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;          /*< signaled when a task is ready */
+	pthread_cond_t  detach_cond;   /*< broadcast when a task being detached has run */
+	int             idle;          /*< threads waiting on cond */
+	struct timeval  idle_wakeup;   /*< time the idle threads wake up at, cleared if they wait for a task */
+	bool            stop;
+
+	struct dsmcc_task **tasks;     /*< attached tasks, searched for expired wakeups by the idle threads */
+	int                 task_count;
+	int                 task_size;
+	int                 next_home;
+
+	int                           thread_count;
+	struct dsmcc_executor_thread *threads;
+
+	struct dsmcc_workers *workers; /*< shared by the states, see dsmcc_state_parameters */
+};
+
+void dsmcc_executor_attach(struct dsmcc_executor *executor, struct dsmcc_task *task);
+void dsmcc_executor_detach(struct dsmcc_executor *executor, struct dsmcc_task *task);
+void dsmcc_executor_schedule(struct dsmcc_executor *executor, struct dsmcc_task *task);
+
+#endif
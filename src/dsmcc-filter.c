@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsmcc.h"
+#include "dsmcc-carousel.h"
+#include "dsmcc-debug.h"
+#include "dsmcc-filter.h"
+
+void dsmcc_section_filters_init(struct dsmcc_state *state)
+{
+	pthread_rwlock_init(&state->section_filters.lock, NULL);
+	state->section_filters.filters = NULL;
+}
+
+void dsmcc_section_filters_free(struct dsmcc_state *state)
+{
+	struct dsmcc_section_filter *filter, *next;
+
+	filter = state->section_filters.filters;
+	while (filter)
+	{
+		next = filter->next;
+		free(filter);
+		filter = next;
+	}
+	state->section_filters.filters = NULL;
+	pthread_rwlock_destroy(&state->section_filters.lock);
+}
+
+/**
+  * Record the filter in the state (replacing the previous filter set by the carousel for the same type and module) and
+  * pass it to the add_section_filter callback
+  */
+void dsmcc_section_filter_add(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id, uint16_t pid,
+		uint8_t *pattern, uint8_t *equal, uint8_t *notequal, uint16_t depth)
+{
+	struct dsmcc_state *state = carousel->state;
+	struct dsmcc_section_filter *filter, **last;
+
+	if (depth > DSMCC_SECTION_FILTER_DEPTH)
+	{
+		DSMCC_ERROR("Section filter too deep (%hu bytes, max is %d)", depth, DSMCC_SECTION_FILTER_DEPTH);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&state->section_filters.lock);
+
+	last = &state->section_filters.filters;
+	for (filter = *last; filter; filter = filter->next)
+	{
+		if (filter->carousel == carousel && filter->type == type && filter->module_id == module_id)
+			break;
+		last = &filter->next;
+	}
+	if (!filter)
+	{
+		/* new filters are appended, so the DSI and DII filters of a carousel are matched before its DDB filters */
+		filter = calloc(1, sizeof(struct dsmcc_section_filter));
+		filter->carousel = carousel;
+		filter->type = type;
+		filter->module_id = module_id;
+		*last = filter;
+	}
+	filter->pid = pid;
+	memset(filter->pattern, 0, DSMCC_SECTION_FILTER_DEPTH);
+	memset(filter->equal, 0, DSMCC_SECTION_FILTER_DEPTH);
+	memset(filter->notequal, 0, DSMCC_SECTION_FILTER_DEPTH);
+	memcpy(filter->pattern, pattern, depth);
+	memcpy(filter->equal, equal, depth);
+	memcpy(filter->notequal, notequal, depth);
+	filter->depth = depth;
+
+	pthread_rwlock_unlock(&state->section_filters.lock);
+
+	if (state->callbacks.add_section_filter)
+		(*state->callbacks.add_section_filter)(state->callbacks.add_section_filter_arg, pid, pattern, equal, notequal, depth);
+}
+
+static void remove_filters(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id, bool all)
+{
+	struct dsmcc_state *state = carousel->state;
+	struct dsmcc_section_filter *filter, **last;
+
+	pthread_rwlock_wrlock(&state->section_filters.lock);
+
+	last = &state->section_filters.filters;
+	while ((filter = *last))
+	{
+		if (filter->carousel == carousel && (all || (filter->type == type && filter->module_id == module_id)))
+		{
+			*last = filter->next;
+			free(filter);
+		}
+		else
+		{
+			last = &filter->next;
+		}
+	}
+
+	pthread_rwlock_unlock(&state->section_filters.lock);
+}
+
+void dsmcc_section_filter_remove(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id)
+{
+	remove_filters(carousel, type, module_id, 0);
+}
+
+void dsmcc_section_filter_remove_all(struct dsmcc_object_carousel *carousel)
+{
+	remove_filters(carousel, 0, 0, 1);
+}
+
+/**
+  * Same semantics as the Linux DVB demux: filter byte 0 applies to the table ID, the following bytes skip the section
+  * length, all the bits selected by the equal mask must be equal to the pattern and, if the notequal mask is not empty,
+  * at least one of the bits it selects must differ from the pattern.
+  */
+static bool filter_match(struct dsmcc_section_filter *filter, const uint8_t *data, int length)
+{
+	bool notequal = 0, check_notequal = 0;
+	uint8_t diff;
+	int i, off;
+
+	for (i = 0; i < filter->depth; i++)
+	{
+		off = i ? i + 2 : 0;
+		if (off >= length)
+			return 0;
+
+		diff = data[off] ^ filter->pattern[i];
+		if (diff & filter->equal[i])
+			return 0;
+		if (filter->notequal[i])
+		{
+			check_notequal = 1;
+			if (diff & filter->notequal[i])
+				notequal = 1;
+		}
+	}
+
+	return !check_notequal || notequal;
+}
+
+bool dsmcc_section_filter_match(struct dsmcc_state *state, uint16_t pid, const uint8_t *data, int length)
+{
+	struct dsmcc_section_filter *filter;
+	bool match = 0;
+
+	pthread_rwlock_rdlock(&state->section_filters.lock);
+
+	for (filter = state->section_filters.filters; filter; filter = filter->next)
+	{
+		if (filter->pid == pid && filter_match(filter, data, length))
+		{
+			match = 1;
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&state->section_filters.lock);
+
+	return match;
+}
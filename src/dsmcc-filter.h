@@ -0,0 +1,52 @@
+#ifndef DSMCC_FILTER_H
+#define DSMCC_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* from dsmcc.h */
+struct dsmcc_state;
+
+/* from dsmcc-carousel.h */
+struct dsmcc_object_carousel;
+
+/* maximum filter depth, same as the Linux DVB demux */
+#define DSMCC_SECTION_FILTER_DEPTH 16
+
+/* number of section bytes needed to match a filter of maximum depth (the section length bytes are not filtered) */
+#define DSMCC_SECTION_FILTER_LENGTH (DSMCC_SECTION_FILTER_DEPTH + 2)
+
+struct dsmcc_section_filter
+{
+	struct dsmcc_object_carousel *carousel;  /*< carousel that set this filter */
+	int                           type;      /*< DSMCC_QUEUE_ENTRY_DSI, DSMCC_QUEUE_ENTRY_DII or DSMCC_QUEUE_ENTRY_DDB */
+	uint16_t                      module_id; /*< module ID, for type == DSMCC_QUEUE_ENTRY_DDB */
+
+	uint16_t pid;
+	uint8_t  pattern[DSMCC_SECTION_FILTER_DEPTH];
+	uint8_t  equal[DSMCC_SECTION_FILTER_DEPTH];
+	uint8_t  notequal[DSMCC_SECTION_FILTER_DEPTH];
+	uint16_t depth;
+
+	struct dsmcc_section_filter *next;
+};
+
+/* filters set by all the carousels of a state, matched by the TS parser */
+struct dsmcc_section_filters
+{
+	pthread_rwlock_t             lock;
+	struct dsmcc_section_filter *filters;
+};
+
+void dsmcc_section_filters_init(struct dsmcc_state *state);
+void dsmcc_section_filters_free(struct dsmcc_state *state);
+
+void dsmcc_section_filter_add(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id, uint16_t pid,
+		uint8_t *pattern, uint8_t *equal, uint8_t *notequal, uint16_t depth);
+void dsmcc_section_filter_remove(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id);
+void dsmcc_section_filter_remove_all(struct dsmcc_object_carousel *carousel);
+
+bool dsmcc_section_filter_match(struct dsmcc_state *state, uint16_t pid, const uint8_t *data, int length);
+
+#endif
@@ -0,0 +1,263 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsmcc-pool.h"
+
+/* alignment of the objects, enough for any of the structures stored in a pool */
+#define POOL_ALIGN sizeof(long double)
+
+/* so that the index of the objects of the last slab still fits in 32 bits */
+#define MAX_FIRST_SLAB_OBJECTS 256
+
+/**
+  * The free objects form a stack (Treiber's), so that the threads getting and releasing section buffers and actions
+  * do not take any lock. The head is the index of the first free object with a tag incremented on each change: a
+  * thread that read the head, then the link of its first object, can only swap it if no other thread popped and
+  * pushed that object meanwhile. The links are kept apart from the objects, so that reading the link of an object
+  * another thread has just taken does not race with its use. Only adding a slab takes the mutex.
+  *
+  * Slab k holds slab_objects << k objects, the slab of an index is found from its highest bit and the array of slabs
+  * never moves. A pool needing more objects than its last slab can hold falls back to malloc.
+  */
+
+#define HEAD_INDEX(head) ((uint32_t) (head))
+#define HEAD_TAG(head)   ((uint32_t) ((head) >> 32))
+#define MAKE_HEAD(tag, index) (((uint64_t) (tag) << 32) | (index))
+
+struct dsmcc_pool *dsmcc_pool_new(size_t object_size, int slab_objects)
+{
+	struct dsmcc_pool *pool;
+
+	if (object_size < sizeof(void *))
+		object_size = sizeof(void *);
+
+	pool = calloc(1, sizeof(struct dsmcc_pool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pool->object_size = (object_size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+	pool->slab_objects = slab_objects > 0 ? slab_objects : 1;
+	if (pool->slab_objects > MAX_FIRST_SLAB_OBJECTS)
+		pool->slab_objects = MAX_FIRST_SLAB_OBJECTS;
+	pool->refcount = 1;
+
+	return pool;
+}
+
+static void free_pool(struct dsmcc_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->slab_count; i++)
+		free(pool->slabs[i]);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+static void release_pool(struct dsmcc_pool *pool)
+{
+	if (!__atomic_sub_fetch(&pool->refcount, 1, __ATOMIC_ACQ_REL))
+		free_pool(pool);
+}
+
+/**
+  * Called by the owner of the pool when it is freed. Objects still used (e.g. section buffers held by a TS parser) stay
+  * valid, the pool is freed when the last one is released.
+  */
+void dsmcc_pool_close(struct dsmcc_pool *pool)
+{
+	if (pool)
+		release_pool(pool);
+}
+
+/**
+  * returns the slab holding the object of the given index
+  */
+static inline struct dsmcc_pool_slab *index_slab(struct dsmcc_pool *pool, uint32_t index)
+{
+	uint32_t n = index / pool->slab_objects + 1;
+
+	return __atomic_load_n(&pool->slabs[31 - __builtin_clz(n)], __ATOMIC_ACQUIRE);
+}
+
+/**
+  * returns the slab holding the object, or NULL if it was not allocated from a slab
+  */
+static struct dsmcc_pool_slab *object_slab(struct dsmcc_pool *pool, void *object)
+{
+	struct dsmcc_pool_slab *slab;
+	int i;
+
+	/* most objects are in the last slabs, which are the largest */
+	for (i = __atomic_load_n(&pool->slab_count, __ATOMIC_ACQUIRE) - 1; i >= 0; i--)
+	{
+		slab = __atomic_load_n(&pool->slabs[i], __ATOMIC_ACQUIRE);
+		if ((uint8_t *) object >= slab->objects && (uint8_t *) object < slab->objects + slab->count * pool->object_size)
+			return slab;
+	}
+	return NULL;
+}
+
+/**
+  * add a slab to the pool and push its objects on the free stack, unless another thread did it meanwhile. Returns 0 if
+  * the pool cannot grow anymore.
+  */
+static bool add_slab(struct dsmcc_pool *pool)
+{
+	struct dsmcc_pool_slab *slab;
+	size_t header, links_size;
+	uint64_t head;
+	uint32_t i;
+	bool ok = 1;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (HEAD_INDEX(__atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE)))
+		goto out;
+	if (pool->slab_count == DSMCC_POOL_MAX_SLABS)
+	{
+		ok = 0;
+		goto out;
+	}
+
+	header = (sizeof(struct dsmcc_pool_slab) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+	links_size = ((pool->slab_objects << pool->slab_count) * sizeof(uint32_t) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+	slab = malloc(header + links_size + (pool->slab_objects << pool->slab_count) * pool->object_size);
+	slab->first = pool->slab_objects * ((1 << pool->slab_count) - 1);
+	slab->count = pool->slab_objects << pool->slab_count;
+	slab->links = (uint32_t *) ((uint8_t *) slab + header);
+	slab->objects = (uint8_t *) slab + header + links_size;
+	for (i = 0; i < slab->count - 1; i++)
+		slab->links[i] = slab->first + i + 2;
+
+	__atomic_store_n(&pool->slabs[pool->slab_count], slab, __ATOMIC_RELEASE);
+	__atomic_store_n(&pool->slab_count, pool->slab_count + 1, __ATOMIC_RELEASE);
+
+	head = __atomic_load_n(&pool->free_head, __ATOMIC_RELAXED);
+	do
+	{
+		__atomic_store_n(&slab->links[slab->count - 1], HEAD_INDEX(head), __ATOMIC_RELAXED);
+	}
+	while (!__atomic_compare_exchange_n(&pool->free_head, &head, MAKE_HEAD(HEAD_TAG(head) + 1, slab->first + 1),
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+out:
+	pthread_mutex_unlock(&pool->mutex);
+	return ok;
+}
+
+/**
+  * returns an uninitialized object
+  */
+void *dsmcc_pool_alloc(struct dsmcc_pool *pool)
+{
+	struct dsmcc_pool_slab *slab;
+	uint64_t head;
+	uint32_t index, next;
+
+	__atomic_add_fetch(&pool->refcount, 1, __ATOMIC_RELAXED);
+
+	head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+	while (1)
+	{
+		index = HEAD_INDEX(head);
+		if (!index)
+		{
+			if (!add_slab(pool))
+				return malloc(pool->object_size);
+			head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+			continue;
+		}
+
+		index--;
+		slab = index_slab(pool, index);
+		next = __atomic_load_n(&slab->links[index - slab->first], __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&pool->free_head, &head, MAKE_HEAD(HEAD_TAG(head) + 1, next),
+					1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	return slab->objects + (index - slab->first) * pool->object_size;
+}
+
+/**
+  * get count uninitialized objects at once, the first ones of the free stack are detached with a single swap of its
+  * head
+  */
+void dsmcc_pool_alloc_many(struct dsmcc_pool *pool, void **objects, int count)
+{
+	struct dsmcc_pool_slab *slab;
+	uint64_t head;
+	uint32_t index, next;
+	int i = 0, n;
+
+	__atomic_add_fetch(&pool->refcount, count, __ATOMIC_RELAXED);
+
+	head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+	while (i < count)
+	{
+		if (!HEAD_INDEX(head))
+		{
+			if (!add_slab(pool))
+			{
+				for (; i < count; i++)
+					objects[i] = malloc(pool->object_size);
+				return;
+			}
+			head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+			continue;
+		}
+
+		/* the links read are only used if the head did not change meanwhile */
+		next = HEAD_INDEX(head);
+		for (n = 0; next && i + n < count; n++)
+		{
+			index = next - 1;
+			slab = index_slab(pool, index);
+			objects[i + n] = slab->objects + (index - slab->first) * pool->object_size;
+			next = __atomic_load_n(&slab->links[index - slab->first], __ATOMIC_RELAXED);
+		}
+		if (__atomic_compare_exchange_n(&pool->free_head, &head, MAKE_HEAD(HEAD_TAG(head) + 1, next),
+					1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		{
+			i += n;
+			head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+		}
+	}
+}
+
+/**
+  * returns an object filled with zeros
+  */
+void *dsmcc_pool_zalloc(struct dsmcc_pool *pool)
+{
+	void *object = dsmcc_pool_alloc(pool);
+
+	memset(object, 0, pool->object_size);
+	return object;
+}
+
+void dsmcc_pool_free(struct dsmcc_pool *pool, void *object)
+{
+	struct dsmcc_pool_slab *slab;
+	uint64_t head;
+	uint32_t index;
+
+	if (!object)
+		return;
+
+	slab = object_slab(pool, object);
+	if (slab)
+	{
+		index = slab->first + ((uint8_t *) object - slab->objects) / pool->object_size;
+		head = __atomic_load_n(&pool->free_head, __ATOMIC_RELAXED);
+		do
+		{
+			__atomic_store_n(&slab->links[index - slab->first], HEAD_INDEX(head), __ATOMIC_RELAXED);
+		}
+		while (!__atomic_compare_exchange_n(&pool->free_head, &head, MAKE_HEAD(HEAD_TAG(head) + 1, index + 1),
+					1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	else
+		free(object);
+
+	release_pool(pool);
+}
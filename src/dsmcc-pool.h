@@ -0,0 +1,40 @@
+#ifndef DSMCC_POOL_H
+#define DSMCC_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* pool of fixed-size objects, carved from slabs that are only freed with the pool */
+
+/* each slab is twice as large as the previous one, this many of them are enough for any pool */
+#define DSMCC_POOL_MAX_SLABS 24
+
+struct dsmcc_pool_slab
+{
+	uint32_t  first;   /*< index of the first object of the slab in the pool */
+	uint32_t  count;   /*< number of objects in the slab */
+	uint32_t *links;   /*< for each free object of the slab, index + 1 of the next free object (0 for none) */
+	uint8_t  *objects;
+};
+
+struct dsmcc_pool
+{
+	uint64_t                free_head;    /*< index + 1 of the first free object in the low 32 bits, ABA tag in the high ones */
+	int                     refcount;     /*< number of objects out of the pool, plus one until the pool is closed */
+	pthread_mutex_t         mutex;        /*< only taken to add a slab */
+	size_t                  object_size;  /*< size of an object, rounded up for alignment */
+	uint32_t                slab_objects; /*< number of objects in the first slab */
+	int                     slab_count;
+	struct dsmcc_pool_slab *slabs[DSMCC_POOL_MAX_SLABS];
+};
+
+struct dsmcc_pool *dsmcc_pool_new(size_t object_size, int slab_objects);
+void dsmcc_pool_close(struct dsmcc_pool *pool);
+void *dsmcc_pool_alloc(struct dsmcc_pool *pool);
+void dsmcc_pool_alloc_many(struct dsmcc_pool *pool, void **objects, int count);
+void *dsmcc_pool_zalloc(struct dsmcc_pool *pool);
+void dsmcc_pool_free(struct dsmcc_pool *pool, void *object);
+
+#endif
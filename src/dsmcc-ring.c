@@ -0,0 +1,173 @@
+#include <stdlib.h>
+
+#include "dsmcc-ring.h"
+
+/**
+  * Bounded multi-producer multi-consumer queue from Dmitry Vyukov: each cell has a sequence number which is equal to
+  * its position when it is free and to its position + 1 when it holds an item, so producers only compete on the
+  * enqueue position, consumers on the dequeue position, and items are read in the order the positions were reserved.
+  */
+
+/**
+  * size must be a power of 2
+  */
+struct dsmcc_ring *dsmcc_ring_new(uint32_t size)
+{
+	struct dsmcc_ring *ring;
+	uint32_t i;
+
+	if (size < 2 || (size & (size - 1)))
+		return NULL;
+
+	ring = calloc(1, sizeof(struct dsmcc_ring));
+	ring->mask = size - 1;
+	ring->cells = malloc(size * sizeof(struct dsmcc_ring_cell));
+	for (i = 0; i < size; i++)
+	{
+		ring->cells[i].seq = i;
+		ring->cells[i].item = NULL;
+	}
+	ring->enqueue_pos = 0;
+	ring->dequeue_pos = 0;
+
+	return ring;
+}
+
+void dsmcc_ring_free(struct dsmcc_ring *ring)
+{
+	if (!ring)
+		return;
+
+	free(ring->cells);
+	free(ring);
+}
+
+/**
+  * returns false if the ring is full
+  */
+bool dsmcc_ring_push(struct dsmcc_ring *ring, void *item)
+{
+	struct dsmcc_ring_cell *cell;
+	uint64_t pos, seq;
+	int64_t diff;
+
+	pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	while (1)
+	{
+		cell = &ring->cells[pos & ring->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t) seq - (int64_t) pos;
+		if (diff == 0)
+		{
+			/* cell is free, try to reserve it */
+			if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+		{
+			/* cell still holds the item of the previous round */
+			return 0;
+		}
+		else
+		{
+			/* another producer reserved this position */
+			pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->item = item;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/**
+  * push up to count items with a single reservation of consecutive cells, returns the number of items pushed (0 if
+  * the ring is full)
+  */
+uint32_t dsmcc_ring_push_many(struct dsmcc_ring *ring, void **items, uint32_t count)
+{
+	struct dsmcc_ring_cell *cell;
+	uint64_t pos, seq;
+	int64_t diff;
+	uint32_t i, n;
+
+	pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	while (1)
+	{
+		/* count the free cells from the current position */
+		for (n = 0; n < count && n <= ring->mask; n++)
+			if (__atomic_load_n(&ring->cells[(pos + n) & ring->mask].seq, __ATOMIC_ACQUIRE) != pos + n)
+				break;
+
+		if (n > 0)
+		{
+			if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			continue;
+		}
+
+		seq = __atomic_load_n(&ring->cells[pos & ring->mask].seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t) seq - (int64_t) pos;
+		if (diff < 0)
+			return 0;
+		pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		cell = &ring->cells[(pos + i) & ring->mask];
+		cell->item = items[i];
+		__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	return n;
+}
+
+/**
+  * returns NULL if the ring is empty or if the next item is being written by a producer.
+  * Can be called concurrently, e.g. by a producer dropping the oldest item.
+  */
+void *dsmcc_ring_pop(struct dsmcc_ring *ring)
+{
+	struct dsmcc_ring_cell *cell;
+	uint64_t pos, seq;
+	int64_t diff;
+	void *item;
+
+	pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+	while (1)
+	{
+		cell = &ring->cells[pos & ring->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t) seq - (int64_t) (pos + 1);
+		if (diff == 0)
+		{
+			/* cell holds an item, try to take it */
+			if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+		{
+			/* ring is empty */
+			return NULL;
+		}
+		else
+		{
+			/* another consumer took this item */
+			pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	item = cell->item;
+	__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+bool dsmcc_ring_empty(struct dsmcc_ring *ring)
+{
+	uint64_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&ring->cells[pos & ring->mask].seq, __ATOMIC_ACQUIRE) != pos + 1;
+}
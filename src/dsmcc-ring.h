@@ -0,0 +1,30 @@
+#ifndef DSMCC_RING_H
+#define DSMCC_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* bounded lock-free queue of pointers, any number of producers and consumers */
+
+struct dsmcc_ring_cell
+{
+	uint64_t  seq;  /*< sequence number, tells if the cell is free or holds an item for the current round */
+	void     *item;
+};
+
+struct dsmcc_ring
+{
+	uint64_t                mask;        /*< number of cells - 1 */
+	struct dsmcc_ring_cell *cells;
+	uint64_t                enqueue_pos; /*< next position to reserve, shared by the producers */
+	uint64_t                dequeue_pos; /*< next position to read, shared by the consumers */
+};
+
+struct dsmcc_ring *dsmcc_ring_new(uint32_t size);
+void dsmcc_ring_free(struct dsmcc_ring *ring);
+bool dsmcc_ring_push(struct dsmcc_ring *ring, void *item);
+uint32_t dsmcc_ring_push_many(struct dsmcc_ring *ring, void **items, uint32_t count);
+void *dsmcc_ring_pop(struct dsmcc_ring *ring);
+bool dsmcc_ring_empty(struct dsmcc_ring *ring);
+
+#endif
@@ -18,6 +18,7 @@
 #include "dsmcc-cache-module.h"
 #include "dsmcc-cache-file.h"
 #include "dsmcc-util.h"
+#include "dsmcc-crc.h"
 #include "dsmcc-carousel.h"
 #include "dsmcc-gii.h"
 
@@ -41,15 +42,41 @@ struct dsmcc_data_header
 	uint16_t message_length;
 };
 
+/**
+  * returns 0 if the section is truncated or its CRC is wrong
+  */
+bool dsmcc_section_check_crc(uint8_t *data, int data_length)
+{
+	uint16_t length;
+	uint32_t crc;
+
+	if (!dsmcc_getshort(&length, data, 1, data_length))
+		return 0;
+	length = (length & 0xFFF) + 3;
+	if (length > data_length)
+	{
+		DSMCC_ERROR("Dropping truncated section (need %hu bytes but only got %d)", length, data_length);
+		return 0;
+	}
+
+	crc = dsmcc_crc32(data, length);
+	if (crc != 0)
+	{
+		DSMCC_ERROR("Dropping corrupt section (Got CRC 0x%08x)", crc);
+		return 0;
+	}
+
+	return 1;
+}
+
 /**
   * returns number of bytes to skip to get to next data or -1 on error
   */
-static int parse_section_header(struct dsmcc_section_header *header, uint8_t *data, int data_length)
+static int parse_section_header(struct dsmcc_section_header *header, uint8_t *data, int data_length, bool check_crc)
 {
 	int off = 0;
 	int section_syntax_indicator;
 	int private_indicator;
-	int crc;
 
 	if (!dsmcc_getbyte(&header->table_id, data, off, data_length))
 		return -1;
@@ -73,13 +100,8 @@ static int parse_section_header(struct dsmcc_section_header *header, uint8_t *da
 #endif
 	}
 
-	/* Check CRC */
-	crc = dsmcc_crc32(data, header->length + off);
-	if (crc != 0)
-	{
-		DSMCC_ERROR("Dropping corrupt section (Got CRC 0x%08x)", crc);
+	if (check_crc && !dsmcc_section_check_crc(data, data_length))
 		return -1;
-	}
 
 	if (!dsmcc_getshort(&header->table_id_extension, data, off, data_length))
 		return -1;
@@ -288,12 +310,12 @@ static int parse_section_dsi(struct dsmcc_object_carousel *carousel, uint8_t *da
 
 
 	/* add section filter on stream for DII (table_id == 0x3B, table_id_extension != 0x0000 or 0x0001) */
-	if (carousel->state->callbacks.add_section_filter && stream)
+	if (stream)
 	{
 		uint8_t pattern[3]  = { carousel->section_control_table_id, 0x00, 0x00 };
 		uint8_t equal[3]    = { 0xff, 0x00, 0x00 };
 		uint8_t notequal[3] = { 0x00, 0xff, 0xfe };
-		(*carousel->state->callbacks.add_section_filter)(carousel->state->callbacks.add_section_filter_arg, stream->pid, pattern, equal, notequal, 3);
+		dsmcc_section_filter_add(carousel, DSMCC_QUEUE_ENTRY_DII, 0, stream->pid, pattern, equal, notequal, 3);
 	}
 	/* update timeouts */
 	dsmcc_timeout_remove(carousel, DSMCC_TIMEOUT_DSI, 0);
@@ -440,21 +462,8 @@ static int parse_section_dii(struct dsmcc_object_carousel *carousel, uint8_t *da
 						DSMCC_STREAM_SELECTOR_PID, carousel->requested_pid,
 						DSMCC_QUEUE_ENTRY_DDB, download_id);
 			}
-			/* add section filter on stream for DDB (table_id == 0x3C, table_id_extension == module_id, version_number == module_version % 32) */
-			if (carousel->state->callbacks.add_section_filter)
-			{
-				uint8_t pattern[4];
-				uint8_t equal[4]    = { 0xff, 0xff, 0xff, 0x3e }; /* bits 2-6 */
-				uint8_t notequal[4] = { 0x00, 0x00, 0x00, 0x00 };
-				pattern[0] = carousel->section_data_table_id;
-				pattern[1] = (modules_id[i].module_id >> 8) & 0xff;
-				pattern[2] = modules_id[i].module_id & 0xff;
-				pattern[3] = (modules_id[i].module_version & 0x1f) << 1;
-				(*carousel->state->callbacks.add_section_filter)(carousel->state->callbacks.add_section_filter_arg, stream->pid, pattern, equal, notequal, 4);
-			}
-
-			/* add module timeout */
-			dsmcc_timeout_set(carousel, DSMCC_TIMEOUT_MODULE, modules_id[i].module_id, modules_info[i].mod_timeout);
+			/* add section filter on stream for DDB and module timeout */
+			dsmcc_cache_download_module(carousel, &modules_id[i], stream ? stream->pid : -1, modules_info[i].mod_timeout);
 		}
 	}
 
@@ -500,6 +509,7 @@ static int parse_section_control(struct dsmcc_stream *stream, uint8_t *data, int
 					if (ret < 0)
 						return -1;
 					carousel->dsi_transaction_id = header.transaction_id;
+					dsmcc_snapshot_invalidate(carousel->shard);
 				}
 				else
 					DSMCC_DEBUG("Ignoring duplicate DSI with Transaction ID 0x%x", header.transaction_id);
@@ -705,22 +715,25 @@ static int parse_section_data(struct dsmcc_stream *stream, uint8_t *data, int da
 	return off;
 }
 
-int dsmcc_parse_section(struct dsmcc_state *state, struct dsmcc_section *section)
+int dsmcc_parse_section(struct dsmcc_shard *shard, struct dsmcc_section *section)
 {
 	int off = 0, ret;
 	struct dsmcc_section_header header;
 	struct dsmcc_stream *stream;
 	struct dsmcc_object_carousel *carousel;
 	uint8_t section_control_table_id, section_data_table_id, skip_leading_bytes;
+	bool check_crc;
 
-	stream = dsmcc_stream_find_by_pid(state, section->pid);
+	stream = dsmcc_stream_find_by_pid(shard, section->pid);
 	if (!stream)
 	{
 		DSMCC_WARN("Skipping section for unknown PID 0x%hx", section->pid);
 		return 0;
 	}
 
-	ret = parse_section_header(&header, section->data, section->length);
+	/* the CRC may have been checked when the section was added, or be trusted, see dsmcc_set_crc_check */
+	check_crc = !section->crc_checked && __atomic_load_n(&shard->state->crc_check, __ATOMIC_RELAXED) != DSMCC_CRC_CHECK_NONE;
+	ret = parse_section_header(&header, section->data, section->length, check_crc);
 	if (ret < 0)
 		return 0;
 	off += ret;
@@ -731,7 +744,7 @@ int dsmcc_parse_section(struct dsmcc_state *state, struct dsmcc_section *section
 		return 0;
 	}
 
-	carousel = find_carousel_by_requested_pid(state, section->pid);
+	carousel = find_carousel_by_requested_pid(shard, section->pid);
 	if (carousel)
 	{
 		section_control_table_id = carousel->section_control_table_id;
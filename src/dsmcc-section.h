@@ -4,13 +4,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* maximum size of a DSM-CC section (12 bits section_length plus the 3 bytes before it) */
+#define DSMCC_SECTION_MAX_SIZE 4096
+
 struct dsmcc_section
 {
 	uint16_t pid;
 	uint8_t *data;
 	int      length;
+	bool     crc_checked; /*< CRC already checked by the thread that added the section */
 };
 
-int dsmcc_parse_section(struct dsmcc_state *state, struct dsmcc_section *section);
+struct dsmcc_shard;
+
+bool dsmcc_section_check_crc(uint8_t *data, int data_length);
+int dsmcc_parse_section(struct dsmcc_shard *shard, struct dsmcc_section *section);
 
 #endif
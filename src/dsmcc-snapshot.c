@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsmcc.h"
+#include "dsmcc-snapshot.h"
+#include "dsmcc-carousel.h"
+#include "dsmcc-cache-module.h"
+#include "dsmcc-cache-file.h"
+
+/**
+  * The parsing thread of a shard builds new snapshots of its carousels at the end of each pass where their status,
+  * modules, download progression or saved dentries changed, and publishes them all at once by swapping the index of
+  * the shard. A reader increments the snapshot_readers counter of the shard, reads its index and takes a reference on
+  * the snapshot it is looking for, then decrements the counter. An index replaced by a newer one is only freed once
+  * the counter of its shard was seen at zero after the swap: the readers that could have read it have taken their
+  * reference by then, and the following ones read the newer index. Readers looking at the other shards do not delay
+  * it.
+  */
+
+static void release_dentries(struct dsmcc_snapshot_dentries *dentries)
+{
+	int i;
+
+	if (__atomic_sub_fetch(&dentries->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (i = 0; i < dentries->count; i++)
+		free((char *) dentries->dentries[i].path);
+	free(dentries->dentries);
+	free(dentries);
+}
+
+static void release_snapshot(struct dsmcc_snapshot *snapshot)
+{
+	if (__atomic_sub_fetch(&snapshot->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	release_dentries(snapshot->dentries);
+	free((struct dsmcc_module_status *) snapshot->carousel.modules);
+	free(snapshot);
+}
+
+static void free_index(struct dsmcc_snapshot_index *index)
+{
+	int i;
+
+	for (i = 0; i < index->count; i++)
+		release_snapshot(index->snapshots[i]);
+	free(index->snapshots);
+	free(index);
+}
+
+static struct dsmcc_snapshot *find_snapshot(struct dsmcc_snapshot_index *index, uint32_t queue_id)
+{
+	int i;
+
+	if (!index)
+		return NULL;
+
+	for (i = 0; i < index->count; i++)
+		if (index->snapshots[i]->carousel.queue_id == queue_id)
+			return index->snapshots[i];
+	return NULL;
+}
+
+static struct dsmcc_snapshot *new_snapshot(struct dsmcc_object_carousel *carousel, struct dsmcc_file_cache *filecache, struct dsmcc_snapshot *previous)
+{
+	struct dsmcc_snapshot *snapshot;
+	struct dsmcc_module_status *modules;
+	uint32_t version;
+
+	snapshot = calloc(1, sizeof(struct dsmcc_snapshot));
+	snapshot->refcount = 1;
+	snapshot->carousel.queue_id = dsmcc_filecache_queue_id(filecache);
+	snapshot->carousel.cid = carousel->cid;
+	snapshot->carousel.status = carousel->status;
+	snapshot->carousel.transaction_id = carousel->dsi_transaction_id;
+	snapshot->carousel.module_count = dsmcc_cache_get_module_status(carousel, &modules,
+			&snapshot->carousel.downloaded, &snapshot->carousel.total);
+	snapshot->carousel.modules = modules;
+
+	/* the list of saved dentries can be long, only copy it when it changed */
+	version = dsmcc_filecache_saved_version(filecache);
+	if (previous && previous->dentries->version == version)
+	{
+		snapshot->dentries = previous->dentries;
+		__atomic_add_fetch(&snapshot->dentries->refcount, 1, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		snapshot->dentries = calloc(1, sizeof(struct dsmcc_snapshot_dentries));
+		snapshot->dentries->refcount = 1;
+		snapshot->dentries->version = version;
+		snapshot->dentries->count = dsmcc_filecache_get_saved_dentries(filecache, &snapshot->dentries->dentries);
+	}
+	snapshot->carousel.dentry_count = snapshot->dentries->count;
+	snapshot->carousel.dentries = snapshot->dentries->dentries;
+
+	return snapshot;
+}
+
+static void swap_index(struct dsmcc_shard *shard, struct dsmcc_snapshot_index *index)
+{
+	struct dsmcc_snapshot_index *old;
+
+	old = __atomic_exchange_n(&shard->snapshots, index, __ATOMIC_SEQ_CST);
+	if (old)
+	{
+		old->next_retired = shard->retired_snapshots;
+		shard->retired_snapshots = old;
+	}
+
+	dsmcc_snapshot_reclaim(shard);
+}
+
+/**
+  * called by the parsing thread when the state of its carousels shown in the snapshots changes
+  */
+void dsmcc_snapshot_invalidate(struct dsmcc_shard *shard)
+{
+	shard->snapshots_dirty = 1;
+}
+
+void dsmcc_snapshot_publish(struct dsmcc_shard *shard)
+{
+	struct dsmcc_snapshot_index *index;
+	struct dsmcc_object_carousel *carousel;
+	struct dsmcc_file_cache *filecache;
+	int count = 0;
+
+	shard->snapshots_dirty = 0;
+	for (carousel = shard->carousels; carousel; carousel = carousel->next)
+		for (filecache = carousel->filecaches; filecache; filecache = dsmcc_filecache_next(filecache))
+			count++;
+
+	index = calloc(1, sizeof(struct dsmcc_snapshot_index));
+	index->snapshots = calloc(count ? count : 1, sizeof(struct dsmcc_snapshot *));
+	for (carousel = shard->carousels; carousel; carousel = carousel->next)
+	{
+		for (filecache = carousel->filecaches; filecache; filecache = dsmcc_filecache_next(filecache))
+		{
+			index->snapshots[index->count++] = new_snapshot(carousel, filecache,
+					find_snapshot(shard->snapshots, dsmcc_filecache_queue_id(filecache)));
+		}
+	}
+
+	swap_index(shard, index);
+}
+
+/**
+  * publish new snapshots of the requests of a single carousel, keeping those of the other carousels, so that its
+  * new status is visible from the status callback. The shard is still published as a whole at the end of the pass.
+  */
+void dsmcc_snapshot_publish_carousel(struct dsmcc_shard *shard, struct dsmcc_object_carousel *carousel)
+{
+	struct dsmcc_snapshot_index *index, *old = shard->snapshots;
+	struct dsmcc_snapshot *snapshot;
+	struct dsmcc_file_cache *filecache;
+	int i, count = 0;
+	bool stale = 0;
+
+	for (filecache = carousel->filecaches; filecache; filecache = dsmcc_filecache_next(filecache))
+	{
+		snapshot = find_snapshot(old, dsmcc_filecache_queue_id(filecache));
+		if (!snapshot || snapshot->carousel.status != carousel->status)
+			stale = 1;
+		count++;
+	}
+	/* already published for another request of the carousel */
+	if (!stale)
+		return;
+	if (old)
+		count += old->count;
+
+	index = calloc(1, sizeof(struct dsmcc_snapshot_index));
+	index->snapshots = calloc(count ? count : 1, sizeof(struct dsmcc_snapshot *));
+	for (i = 0; old && i < old->count; i++)
+	{
+		for (filecache = carousel->filecaches; filecache; filecache = dsmcc_filecache_next(filecache))
+			if (dsmcc_filecache_queue_id(filecache) == old->snapshots[i]->carousel.queue_id)
+				break;
+		if (filecache)
+			continue;
+		__atomic_add_fetch(&old->snapshots[i]->refcount, 1, __ATOMIC_RELAXED);
+		index->snapshots[index->count++] = old->snapshots[i];
+	}
+	for (filecache = carousel->filecaches; filecache; filecache = dsmcc_filecache_next(filecache))
+		index->snapshots[index->count++] = new_snapshot(carousel, filecache,
+				find_snapshot(old, dsmcc_filecache_queue_id(filecache)));
+
+	swap_index(shard, index);
+}
+
+/**
+  * free the replaced indexes if no reader can still be using them, otherwise try again on the next call
+  */
+void dsmcc_snapshot_reclaim(struct dsmcc_shard *shard)
+{
+	struct dsmcc_snapshot_index *index;
+
+	if (!shard->retired_snapshots || __atomic_load_n(&shard->snapshot_readers, __ATOMIC_SEQ_CST))
+		return;
+
+	while (shard->retired_snapshots)
+	{
+		index = shard->retired_snapshots;
+		shard->retired_snapshots = index->next_retired;
+		free_index(index);
+	}
+}
+
+/**
+  * the snapshots still referenced by the application are freed when they are released
+  */
+void dsmcc_snapshot_free_all(struct dsmcc_shard *shard)
+{
+	struct dsmcc_snapshot_index *index;
+
+	while (shard->retired_snapshots)
+	{
+		index = shard->retired_snapshots;
+		shard->retired_snapshots = index->next_retired;
+		free_index(index);
+	}
+	if (shard->snapshots)
+		free_index(shard->snapshots);
+	shard->snapshots = NULL;
+}
+
+struct dsmcc_carousel_snapshot *dsmcc_carousel_snapshot_get(struct dsmcc_state *state, uint32_t queue_id)
+{
+	struct dsmcc_snapshot *snapshot = NULL;
+	struct dsmcc_shard *shard;
+	int i;
+
+	for (i = 0; i < state->shard_count && !snapshot; i++)
+	{
+		shard = &state->shards[i];
+		__atomic_add_fetch(&shard->snapshot_readers, 1, __ATOMIC_SEQ_CST);
+		snapshot = find_snapshot(__atomic_load_n(&shard->snapshots, __ATOMIC_SEQ_CST), queue_id);
+		if (snapshot)
+			__atomic_add_fetch(&snapshot->refcount, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&shard->snapshot_readers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return snapshot ? &snapshot->carousel : NULL;
+}
+
+void dsmcc_carousel_snapshot_release(struct dsmcc_carousel_snapshot *snapshot)
+{
+	if (snapshot)
+		release_snapshot((struct dsmcc_snapshot *) snapshot);
+}
@@ -0,0 +1,45 @@
+#ifndef DSMCC_SNAPSHOT_H
+#define DSMCC_SNAPSHOT_H
+
+#include <stdint.h>
+#include <dsmcc/dsmcc.h>
+
+/* immutable copies of the state of the carousels, published by the parsing threads for dsmcc_carousel_snapshot_get */
+
+/* from dsmcc.h */
+struct dsmcc_shard;
+/* from dsmcc-carousel.h */
+struct dsmcc_object_carousel;
+
+/* saved directories and files of a filecache, shared by the snapshots until a dentry is saved */
+struct dsmcc_snapshot_dentries
+{
+	int                         refcount;
+	uint32_t                    version;  /*< saved_version of the filecache */
+	int                         count;
+	struct dsmcc_dentry_status *dentries;
+};
+
+struct dsmcc_snapshot
+{
+	struct dsmcc_carousel_snapshot  carousel; /*< returned to the application */
+	int                             refcount;
+	struct dsmcc_snapshot_dentries *dentries;
+};
+
+/* snapshots of the queued carousels of a shard */
+struct dsmcc_snapshot_index
+{
+	int                    count;
+	struct dsmcc_snapshot **snapshots;
+
+	struct dsmcc_snapshot_index *next_retired;
+};
+
+void dsmcc_snapshot_invalidate(struct dsmcc_shard *shard);
+void dsmcc_snapshot_publish(struct dsmcc_shard *shard);
+void dsmcc_snapshot_publish_carousel(struct dsmcc_shard *shard, struct dsmcc_object_carousel *carousel);
+void dsmcc_snapshot_reclaim(struct dsmcc_shard *shard);
+void dsmcc_snapshot_free_all(struct dsmcc_shard *shard);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsmcc-timeout.h"
+
+#define DSMCC_TIMEOUT_HEAP_MIN_SIZE 64
+
+static unsigned int bucket_index(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id)
+{
+	uintptr_t h = (uintptr_t) carousel >> 4;
+
+	h = h * 31 + type;
+	h = h * 65599 + module_id;
+	return (h ^ (h >> 9)) & (DSMCC_TIMEOUT_BUCKETS - 1);
+}
+
+static void heap_set(struct dsmcc_timeouts *timeouts, int index, struct dsmcc_timeout *timeout)
+{
+	timeouts->heap[index] = timeout;
+	timeout->heap_index = index;
+}
+
+static void sift_up(struct dsmcc_timeouts *timeouts, int index)
+{
+	struct dsmcc_timeout *timeout = timeouts->heap[index];
+	int parent;
+
+	while (index > 0)
+	{
+		parent = (index - 1) / 2;
+		if (!timercmp(&timeout->abstime, &timeouts->heap[parent]->abstime, <))
+			break;
+		heap_set(timeouts, index, timeouts->heap[parent]);
+		index = parent;
+	}
+	heap_set(timeouts, index, timeout);
+}
+
+static void sift_down(struct dsmcc_timeouts *timeouts, int index)
+{
+	struct dsmcc_timeout *timeout = timeouts->heap[index];
+	int child;
+
+	while ((child = 2 * index + 1) < timeouts->count)
+	{
+		if (child + 1 < timeouts->count && timercmp(&timeouts->heap[child + 1]->abstime, &timeouts->heap[child]->abstime, <))
+			child++;
+		if (!timercmp(&timeouts->heap[child]->abstime, &timeout->abstime, <))
+			break;
+		heap_set(timeouts, index, timeouts->heap[child]);
+		index = child;
+	}
+	heap_set(timeouts, index, timeout);
+}
+
+static void unlink_bucket(struct dsmcc_timeouts *timeouts, struct dsmcc_timeout *timeout)
+{
+	struct dsmcc_timeout **prev;
+
+	prev = &timeouts->buckets[bucket_index(timeout->carousel, timeout->type, timeout->module_id)];
+	while (*prev != timeout)
+		prev = &(*prev)->next;
+	*prev = timeout->next;
+	timeout->next = NULL;
+}
+
+void dsmcc_timeouts_init(struct dsmcc_timeouts *timeouts)
+{
+	memset(timeouts, 0, sizeof(struct dsmcc_timeouts));
+}
+
+/**
+  * the timeouts themselves are owned by the caller
+  */
+void dsmcc_timeouts_free(struct dsmcc_timeouts *timeouts)
+{
+	free(timeouts->heap);
+	memset(timeouts, 0, sizeof(struct dsmcc_timeouts));
+}
+
+void dsmcc_timeouts_add(struct dsmcc_timeouts *timeouts, struct dsmcc_timeout *timeout)
+{
+	unsigned int bucket;
+
+	if (timeouts->count == timeouts->size)
+	{
+		timeouts->size = timeouts->size ? timeouts->size * 2 : DSMCC_TIMEOUT_HEAP_MIN_SIZE;
+		timeouts->heap = realloc(timeouts->heap, timeouts->size * sizeof(struct dsmcc_timeout *));
+	}
+	heap_set(timeouts, timeouts->count++, timeout);
+	sift_up(timeouts, timeout->heap_index);
+
+	bucket = bucket_index(timeout->carousel, timeout->type, timeout->module_id);
+	timeout->next = timeouts->buckets[bucket];
+	timeouts->buckets[bucket] = timeout;
+}
+
+void dsmcc_timeouts_remove(struct dsmcc_timeouts *timeouts, struct dsmcc_timeout *timeout)
+{
+	int index = timeout->heap_index;
+
+	timeouts->count--;
+	if (index != timeouts->count)
+	{
+		heap_set(timeouts, index, timeouts->heap[timeouts->count]);
+		dsmcc_timeouts_update(timeouts, timeouts->heap[index]);
+	}
+
+	unlink_bucket(timeouts, timeout);
+}
+
+/**
+  * restore the heap order after the abstime of the timeout was changed
+  */
+void dsmcc_timeouts_update(struct dsmcc_timeouts *timeouts, struct dsmcc_timeout *timeout)
+{
+	int index = timeout->heap_index;
+
+	if (index > 0 && timercmp(&timeout->abstime, &timeouts->heap[(index - 1) / 2]->abstime, <))
+		sift_up(timeouts, index);
+	else
+		sift_down(timeouts, index);
+}
+
+/**
+  * remove all the timeouts of a carousel, and return them in a list linked by next for the caller to free them
+  */
+struct dsmcc_timeout *dsmcc_timeouts_remove_carousel(struct dsmcc_timeouts *timeouts, struct dsmcc_object_carousel *carousel)
+{
+	struct dsmcc_timeout *removed = NULL, *timeout;
+	int i, count = 0;
+
+	for (i = 0; i < timeouts->count; i++)
+	{
+		timeout = timeouts->heap[i];
+		if (timeout->carousel == carousel)
+		{
+			unlink_bucket(timeouts, timeout);
+			timeout->next = removed;
+			removed = timeout;
+		}
+		else
+			heap_set(timeouts, count++, timeout);
+	}
+
+	if (count != timeouts->count)
+	{
+		timeouts->count = count;
+		for (i = count / 2 - 1; i >= 0; i--)
+			sift_down(timeouts, i);
+	}
+
+	return removed;
+}
+
+struct dsmcc_timeout *dsmcc_timeouts_find(struct dsmcc_timeouts *timeouts, struct dsmcc_object_carousel *carousel, int type, uint16_t module_id)
+{
+	struct dsmcc_timeout *timeout;
+
+	timeout = timeouts->buckets[bucket_index(carousel, type, module_id)];
+	while (timeout)
+	{
+		if (timeout->carousel == carousel && timeout->type == type && timeout->module_id == module_id)
+			return timeout;
+		timeout = timeout->next;
+	}
+	return NULL;
+}
+
+struct dsmcc_timeout *dsmcc_timeouts_first(struct dsmcc_timeouts *timeouts)
+{
+	return timeouts->count ? timeouts->heap[0] : NULL;
+}
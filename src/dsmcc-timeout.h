@@ -0,0 +1,51 @@
+#ifndef DSMCC_TIMEOUT_H
+#define DSMCC_TIMEOUT_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* timeouts of the carousels of a shard, in a binary min-heap ordered by expiry time, and in a hash table to find the
+ * timeout of a carousel by type and module ID */
+
+enum
+{
+	DSMCC_TIMEOUT_DSI,
+	DSMCC_TIMEOUT_DII,
+	DSMCC_TIMEOUT_MODULE,
+	DSMCC_TIMEOUT_NEXTBLOCK
+};
+
+struct dsmcc_object_carousel;
+
+struct dsmcc_timeout
+{
+	struct dsmcc_object_carousel *carousel;   /*< carousel this timeout applies to */
+	int                           type;       /*< type of timeout */
+	uint16_t                      module_id;  /*< module ID, for type == DSMCC_TIMEOUT_MODULE or DSMCC_TIMEOUT_NEXTBLOCK, 0 otherwise */
+	struct timeval                abstime;    /*< absolute time, position in the heap */
+	struct timeval                deadline;   /*< real absolute time, later than abstime if the timeout was extended without moving it in the heap */
+	int                           heap_index;
+
+	struct dsmcc_timeout *next; /*< next timeout in the same hash bucket */
+};
+
+#define DSMCC_TIMEOUT_BUCKETS 512
+
+struct dsmcc_timeouts
+{
+	struct dsmcc_timeout **heap;  /*< heap[0] is the earliest timeout */
+	int                    count;
+	int                    size;
+	struct dsmcc_timeout  *buckets[DSMCC_TIMEOUT_BUCKETS];
+};
+
+void dsmcc_timeouts_init(struct dsmcc_timeouts *timeouts);
+void dsmcc_timeouts_free(struct dsmcc_timeouts *timeouts);
+void dsmcc_timeouts_add(struct dsmcc_timeouts *timeouts, struct dsmcc_timeout *timeout);
+void dsmcc_timeouts_remove(struct dsmcc_timeouts *timeouts, struct dsmcc_timeout *timeout);
+void dsmcc_timeouts_update(struct dsmcc_timeouts *timeouts, struct dsmcc_timeout *timeout);
+struct dsmcc_timeout *dsmcc_timeouts_remove_carousel(struct dsmcc_timeouts *timeouts, struct dsmcc_object_carousel *carousel);
+struct dsmcc_timeout *dsmcc_timeouts_find(struct dsmcc_timeouts *timeouts, struct dsmcc_object_carousel *carousel, int type, uint16_t module_id);
+struct dsmcc_timeout *dsmcc_timeouts_first(struct dsmcc_timeouts *timeouts);
+
+#endif
@@ -12,65 +12,300 @@
 #define TRANSPORT_ERROR 0x80
 #define START_INDICATOR 0x40
 
-void dsmcc_tsparser_add_pid(struct dsmcc_tsparser_buffer **buffers, uint16_t pid)
+/* adaptation_field_control values */
+#define AF_RESERVED           0x0
+#define AF_PAYLOAD            0x1
+#define AF_ADAPTATION         0x2
+#define AF_ADAPTATION_PAYLOAD 0x3
+
+#define DISCONTINUITY_INDICATOR 0x80
+
+/* number of following sync bytes that must be found before locking on a packet boundary */
+#define SYNC_LOCK_COUNT 2
+
+static inline struct dsmcc_tsparser_pid_buffer *find_pid_buffer(struct dsmcc_tsparser_buffer *buffers, uint16_t pid)
+{
+	uint16_t slot = buffers->pid_index[pid];
+
+	return slot ? buffers->pids[slot - 1] : NULL;
+}
+
+static struct dsmcc_tsparser_pid_buffer *add_pid_buffer(struct dsmcc_tsparser_buffer *buffers, uint16_t pid)
 {
-	struct dsmcc_tsparser_buffer *buf;
+	struct dsmcc_tsparser_pid_buffer *buf;
 
 	/* check that we do not already track this PID */
-	for (buf = *buffers; buf != NULL; buf = buf->next)
-	{
-		if (buf->pid == pid)
-			return;
-	}
+	buf = find_pid_buffer(buffers, pid);
+	if (buf)
+		return buf;
 
 	/* create and register PID buffer */
-	buf = malloc(sizeof(struct dsmcc_tsparser_buffer));
+	buf = calloc(1, sizeof(struct dsmcc_tsparser_pid_buffer));
 	buf->pid = pid;
-	buf->si_seen = 0;
 	buf->in_section = 0;
 	buf->cont = -1;
-	buf->next = *buffers;
-	*buffers = buf;
+	buf->duplicate = 0;
+	buffers->pids = realloc(buffers->pids, (buffers->pid_count + 1) * sizeof(*buffers->pids));
+	buffers->pids[buffers->pid_count++] = buf;
+	buffers->pid_index[pid] = buffers->pid_count;
 	DSMCC_DEBUG("Created buffer for PID 0x%x", pid);
+
+	return buf;
 }
 
-void dsmcc_tsparser_free_buffers(struct dsmcc_tsparser_buffer **buffers)
+static void remove_pid_buffer(struct dsmcc_tsparser_buffer *buffers, struct dsmcc_tsparser_pid_buffer *buf)
 {
-	struct dsmcc_tsparser_buffer *buffer = *buffers;
+	int slot = buffers->pid_index[buf->pid] - 1;
 
-	while (buffer)
+	/* move the last tracked PID to the freed slot */
+	buffers->pid_index[buf->pid] = 0;
+	buffers->pid_count--;
+	if (slot != buffers->pid_count)
 	{
-		struct dsmcc_tsparser_buffer *bufnext = buffer->next;
-		free(buffer);
-		buffer = bufnext;
+		buffers->pids[slot] = buffers->pids[buffers->pid_count];
+		buffers->pid_index[buffers->pids[slot]->pid] = slot + 1;
 	}
 
-	*buffers = NULL;
+	DSMCC_DEBUG("Removed buffer for PID 0x%x", buf->pid);
+	if (buf->section)
+		dsmcc_section_buffer_put(buf->section);
+	free(buf);
 }
 
-void dsmcc_tsparser_parse_packet(struct dsmcc_state *state, struct dsmcc_tsparser_buffer **buffers, uint8_t *packet, int packet_length)
+void dsmcc_tsparser_add_pid(struct dsmcc_tsparser_buffer **buffers, uint16_t pid)
 {
-	struct dsmcc_tsparser_buffer *buf;
-	uint16_t pid;
-	int cont;
-
-	if (packet_length <= 0 || packet_length != 188)
+	if (pid >= DSMCC_TS_PID_COUNT)
 	{
-		DSMCC_WARN("Skipping packet: Invalid packet size (got %d, expected 188)", packet_length);
+		DSMCC_ERROR("Invalid PID 0x%x", pid);
 		return;
 	}
 
-	if (!packet)
+	if (!*buffers)
+		*buffers = calloc(1, sizeof(struct dsmcc_tsparser_buffer));
+
+	add_pid_buffer(*buffers, pid)->manual = 1;
+}
+
+void dsmcc_tsparser_remove_pid(struct dsmcc_tsparser_buffer **buffers, uint16_t pid)
+{
+	struct dsmcc_tsparser_pid_buffer *buf;
+
+	if (!*buffers || pid >= DSMCC_TS_PID_COUNT)
+		return;
+
+	buf = find_pid_buffer(*buffers, pid);
+	if (buf)
+		remove_pid_buffer(*buffers, buf);
+}
+
+void dsmcc_tsparser_set_pid_tracking(struct dsmcc_tsparser_buffer **buffers, bool enable)
+{
+	int i;
+
+	if (!*buffers)
+		*buffers = calloc(1, sizeof(struct dsmcc_tsparser_buffer));
+
+	/* stop parsing the PIDs that were only added by the tracking, with their partial sections */
+	if (!enable)
 	{
-		DSMCC_WARN("Skipping NULL packet");
+		for (i = (*buffers)->pid_count - 1; i >= 0; i--)
+			if (!(*buffers)->pids[i]->manual)
+				remove_pid_buffer(*buffers, (*buffers)->pids[i]);
+	}
+
+	(*buffers)->track_pids = enable;
+	/* force a resynchronization on the next parsed data */
+	(*buffers)->pid_generation = 0;
+}
+
+/**
+  * add and remove the tracked PIDs to follow the streams where the library has queued requests.
+  * The PIDs added by dsmcc_tsparser_add_pid are never removed.
+  */
+static void track_stream_pids(struct dsmcc_state *state, struct dsmcc_tsparser_buffer *buffers)
+{
+	struct dsmcc_tsparser_pid_buffer *buf;
+	uint8_t map[DSMCC_PID_MAP_SIZE];
+	int i, bit;
+
+	if (!buffers->track_pids || __atomic_load_n(&state->stream_pids.generation, __ATOMIC_ACQUIRE) == buffers->pid_generation)
 		return;
+
+	buffers->pid_generation = dsmcc_stream_pids_get(state, map);
+
+	for (i = buffers->pid_count - 1; i >= 0; i--)
+	{
+		buf = buffers->pids[i];
+		if (!buf->manual && !(map[buf->pid >> 3] & (1 << (buf->pid & 7))))
+			remove_pid_buffer(buffers, buf);
 	}
 
-	if (packet[0] != SYNC_BYTE)
+	for (i = 0; i < DSMCC_PID_MAP_SIZE; i++)
 	{
-		DSMCC_WARN("Skipping packet: Invalid sync byte: got 0x%02hhx, expected 0x%02hhx", *packet, SYNC_BYTE);
+		if (!map[i])
+			continue;
+		for (bit = 0; bit < 8; bit++)
+			if (map[i] & (1 << bit))
+				add_pid_buffer(buffers, (i << 3) | bit);
+	}
+}
+
+void dsmcc_tsparser_free_buffers(struct dsmcc_tsparser_buffer **buffers)
+{
+	int i;
+
+	if (!*buffers)
 		return;
+
+	for (i = 0; i < (*buffers)->pid_count; i++)
+	{
+		if ((*buffers)->pids[i]->section)
+			dsmcc_section_buffer_put((*buffers)->pids[i]->section);
+		free((*buffers)->pids[i]);
 	}
+	free((*buffers)->pids);
+
+	free(*buffers);
+	*buffers = NULL;
+}
+
+int dsmcc_tsparser_get_pid_stats(struct dsmcc_tsparser_buffer *buffers, uint16_t pid, struct dsmcc_tsparser_pid_stats *stats)
+{
+	struct dsmcc_tsparser_pid_buffer *buf;
+
+	if (!buffers || pid >= DSMCC_TS_PID_COUNT)
+		return -1;
+
+	buf = find_pid_buffer(buffers, pid);
+	if (!buf)
+		return -1;
+
+	memcpy(stats, &buf->stats, sizeof(struct dsmcc_tsparser_pid_stats));
+	return 0;
+}
+
+static inline void append_section_data(struct dsmcc_tsparser_pid_buffer *buf, const uint8_t *data, int length)
+{
+	memcpy(buf->section->data + buf->in_section, data, length);
+	buf->in_section += length;
+}
+
+/**
+  * make sure the section buffer of buf can hold the whole section and copy the section header to it
+  */
+static void start_section_data(struct dsmcc_state *state, struct dsmcc_tsparser_pid_buffer *buf, int section_length)
+{
+	if (buf->section && buf->section->size < section_length)
+	{
+		dsmcc_section_buffer_put(buf->section);
+		buf->section = NULL;
+	}
+	if (!buf->section)
+		buf->section = dsmcc_section_buffer_get(state, section_length);
+
+	memcpy(buf->section->data, buf->header, 3);
+}
+
+static void queue_section(struct dsmcc_state *state, struct dsmcc_tsparser_pid_buffer *buf)
+{
+	DSMCC_DEBUG("Processing section data: PID 0x%hx, table ID 0x%02hhx, buffer length %d", buf->pid, buf->header[0], buf->in_section);
+
+	/* the buffer is handed over to the parsing thread, a new one will be taken from the pool for the next section */
+	dsmcc_section_buffer_queue(state, buf->section, buf->pid, buf->in_section);
+	buf->section = NULL;
+	buf->in_section = 0;
+	buf->stats.sections++;
+}
+
+static inline void drop_section(struct dsmcc_tsparser_pid_buffer *buf)
+{
+	buf->in_section = 0;
+	buf->discard = 0;
+}
+
+/**
+  * append data to the current section of buf, up to the end of the section, and queue it when it is complete.
+  * When section filtering is enabled, the section is matched as soon as enough bytes are received and the rest of
+  * its data is skipped if no filter matches.
+  * returns the number of bytes consumed.
+  */
+static int continue_section(struct dsmcc_state *state, struct dsmcc_tsparser_buffer *buffers, struct dsmcc_tsparser_pid_buffer *buf, const uint8_t *data, int length)
+{
+	int consumed = 0, n, section_length, filter_length;
+
+	/* section header: table_id (8 bits), flags (4 bits), section_length (12 bits) */
+	if (buf->in_section < 3)
+	{
+		n = 3 - buf->in_section;
+		if (n > length)
+			n = length;
+		memcpy(buf->header + buf->in_section, data, n);
+		buf->in_section += n;
+		consumed += n;
+		if (buf->in_section < 3)
+			return consumed;
+	}
+
+	section_length = 3 + (((buf->header[1] & 0x0F) << 8) | buf->header[2]);
+	if (section_length > DSMCC_SECTION_MAX_SIZE)
+	{
+		DSMCC_ERROR("Section too long (%d bytes, max is %d) (table ID is 0x%02hhx), dropping", section_length, DSMCC_SECTION_MAX_SIZE, buf->header[0]);
+		drop_section(buf);
+		return length;
+	}
+
+	/* the section length is known, take a buffer of the matching size class */
+	if (buf->in_section == 3)
+		start_section_data(state, buf, section_length);
+
+	if (buffers->section_filtering && !buf->discard)
+	{
+		filter_length = section_length < DSMCC_SECTION_FILTER_LENGTH ? section_length : DSMCC_SECTION_FILTER_LENGTH;
+		if (buf->in_section < filter_length)
+		{
+			n = filter_length - buf->in_section;
+			if (n > length - consumed)
+				n = length - consumed;
+			append_section_data(buf, data + consumed, n);
+			consumed += n;
+
+			if (buf->in_section == filter_length && !dsmcc_section_filter_match(state, buf->pid, buf->section->data, filter_length))
+			{
+				DSMCC_DEBUG("Skipping filtered section: PID 0x%hx, table ID 0x%02hhx, section length %d", buf->pid, buf->header[0], section_length);
+				buf->discard = 1;
+				buf->stats.filtered++;
+			}
+		}
+	}
+
+	n = section_length - buf->in_section;
+	if (n > length - consumed)
+		n = length - consumed;
+	if (buf->discard)
+		buf->in_section += n;
+	else
+		append_section_data(buf, data + consumed, n);
+	consumed += n;
+
+	if (buf->in_section == section_length)
+	{
+		if (buf->discard)
+			drop_section(buf);
+		else
+			queue_section(state, buf);
+	}
+
+	return consumed;
+}
+
+static void parse_packet(struct dsmcc_state *state, struct dsmcc_tsparser_buffer *buffers, uint8_t *packet)
+{
+	struct dsmcc_tsparser_pid_buffer *buf;
+	uint8_t *payload;
+	uint8_t pointer_field, adaptation_field_control;
+	uint16_t pid;
+	int cont, off, payload_length;
+	bool discontinuity = 0;
 
 	/* Test if error bit is set */
 	if (packet[1] & TRANSPORT_ERROR)
@@ -82,117 +317,426 @@ void dsmcc_tsparser_parse_packet(struct dsmcc_state *state, struct dsmcc_tsparse
 	pid = ((packet[1] & 0x1F) << 8) | packet[2];
 
 	/* Find correct buffer for stream */
-	for (buf = *buffers; buf != NULL; buf = buf->next)
-	{
-		if (buf->pid == pid)
-			break;
-	}
+	buf = find_pid_buffer(buffers, pid);
 	if (buf == NULL)
 		return;
+	buf->stats.packets++;
+	buf->stats.arrival_time = buffers->arrival_time;
+
+	adaptation_field_control = (packet[3] >> 4) & 0x3;
+	if (adaptation_field_control == AF_RESERVED)
+	{
+		DSMCC_WARN("Skipping packet: Reserved adaptation_field_control value");
+		return;
+	}
+
+	payload = packet + 4;
+	payload_length = DSMCC_TS_PAYLOAD_SIZE;
+	if (adaptation_field_control & AF_ADAPTATION)
+	{
+		uint8_t adaptation_field_length = packet[4];
+
+		if (adaptation_field_length > DSMCC_TS_PAYLOAD_SIZE - 1 || (adaptation_field_control == AF_ADAPTATION_PAYLOAD && adaptation_field_length == DSMCC_TS_PAYLOAD_SIZE - 1))
+		{
+			DSMCC_WARN("Skipping packet: Invalid adaptation field length %d", adaptation_field_length);
+			drop_section(buf);
+			return;
+		}
+		if (adaptation_field_length)
+			discontinuity = (packet[5] & DISCONTINUITY_INDICATOR) != 0;
+
+		payload += 1 + adaptation_field_length;
+		payload_length -= 1 + adaptation_field_length;
+	}
+	if (!(adaptation_field_control & AF_PAYLOAD))
+		payload_length = 0;
 
-	/* Test if start on new dsmcc_section */
 	cont = packet[3] & 0x0F;
 
-	if (buf->cont == 0xF && cont == 0)
+	if (discontinuity)
 	{
-		buf->cont = 0;
+		/* continuity counter may be discontinuous, this is not an error */
+		DSMCC_DEBUG("Discontinuity indicator set on PID 0x%hx (cont=%d, buf->cont=%d)", buf->pid, cont, buf->cont);
+		buf->stats.discontinuities++;
+		if (payload_length && buf->cont != -1 && cont != ((buf->cont + 1) & 0x0F))
+			drop_section(buf);
+		/* a packet without payload does not carry the new counter value, resynchronize on the next one */
+		buf->cont = payload_length ? cont : -1;
+		buf->duplicate = 0;
 	}
-	else if (buf->cont + 1 == cont)
+	else if (!payload_length)
 	{
-		buf->cont++;
+		/* continuity counter is not incremented for packets without payload */
+		return;
 	}
-	else if (buf->cont == -1)
+	else if (buf->cont == -1 || cont == ((buf->cont + 1) & 0x0F))
 	{
 		buf->cont = cont;
+		buf->duplicate = 0;
+	}
+	else if (cont == buf->cont && !buf->duplicate)
+	{
+		/* a packet may be sent twice, the duplicate is ignored */
+		DSMCC_DEBUG("Skipping duplicate packet on PID 0x%hx (cont=%d)", buf->pid, cont);
+		buf->stats.duplicates++;
+		buf->duplicate = 1;
+		return;
 	}
 	else
 	{
 		/* Out of sequence packet, drop current section */
 		DSMCC_WARN("Packet out of sequence (cont=%d, buf->cont=%d), resetting", cont, buf->cont);
-		buf->in_section = 0;
-		memset(buf->data, 0xFF, DSMCC_TSPARSER_BUFFER_SIZE);
+		buf->stats.cc_errors++;
+		buf->cont = cont;
+		buf->duplicate = 0;
+		drop_section(buf);
+	}
+
+	if (!payload_length)
+		return;
+
+	if (!(packet[1] & START_INDICATOR))
+	{
+		/* continuation of the current section, if any, anything after its end is stuffing */
+		if (buf->in_section)
+			continue_section(state, buffers, buf, payload, payload_length);
+		return;
+	}
+
+	pointer_field = payload[0];
+	if (pointer_field >= payload_length)
+	{
+		/* corrupted ? */
+		DSMCC_ERROR("Invalid pointer field %d", pointer_field);
+		drop_section(buf);
+		return;
 	}
 
-	if (packet[1] & START_INDICATOR)
+	/* end of the current section, up to the pointer field */
+	if (buf->in_section)
+	{
+		continue_section(state, buffers, buf, payload + 1, pointer_field);
+		if (buf->in_section)
+		{
+			DSMCC_WARN("Dropping truncated section: PID 0x%hx, table ID 0x%02hhx, buffer length %d", buf->pid, buf->header[0], buf->in_section);
+			drop_section(buf);
+		}
+	}
+
+	/* new sections packed in the rest of the payload, up to the first stuffing byte */
+	off = 1 + pointer_field;
+	while (off < payload_length && payload[off] != 0xFF)
 	{
 		DSMCC_DEBUG("New section");
+		off += continue_section(state, buffers, buf, payload + off, payload_length - off);
+
+		/* section continues in the next packets */
 		if (buf->in_section)
+			break;
+	}
+}
+
+static inline int packet_prefix(int packet_size)
+{
+	return packet_size == DSMCC_TS_M2TS_PACKET_SIZE ? DSMCC_TS_M2TS_PACKET_SIZE - DSMCC_TS_PACKET_SIZE : 0;
+}
+
+/**
+  * parse a packet of any supported size, unit points to the start of the packet including the M2TS header if any
+  */
+static void parse_unit(struct dsmcc_state *state, struct dsmcc_tsparser_buffer *buffers, uint8_t *unit, int packet_size)
+{
+	if (packet_size == DSMCC_TS_M2TS_PACKET_SIZE)
+	{
+		/* TP_extra_header: 2 bits copy_permission_indicator, 30 bits arrival_time_stamp */
+		buffers->arrival_time = ((unit[0] & 0x3F) << 24) | (unit[1] << 16) | (unit[2] << 8) | unit[3];
+		unit += DSMCC_TS_M2TS_PACKET_SIZE - DSMCC_TS_PACKET_SIZE;
+	}
+	/* 204 bytes packets: the Reed-Solomon parity bytes at the end are ignored */
+
+	parse_packet(state, buffers, unit);
+}
+
+void dsmcc_tsparser_parse_packet(struct dsmcc_state *state, struct dsmcc_tsparser_buffer **buffers, uint8_t *packet, int packet_length)
+{
+	if (packet_length != DSMCC_TS_PACKET_SIZE && packet_length != DSMCC_TS_M2TS_PACKET_SIZE && packet_length != DSMCC_TS_RS_PACKET_SIZE)
+	{
+		DSMCC_WARN("Skipping packet: Invalid packet size (got %d, expected 188, 192 or 204)", packet_length);
+		return;
+	}
+
+	if (!packet)
+	{
+		DSMCC_WARN("Skipping NULL packet");
+		return;
+	}
+
+	if (packet[packet_prefix(packet_length)] != SYNC_BYTE)
+	{
+		DSMCC_WARN("Skipping packet: Invalid sync byte: got 0x%02hhx, expected 0x%02hhx", packet[packet_prefix(packet_length)], SYNC_BYTE);
+		return;
+	}
+
+	if (!*buffers)
+		return;
+
+	track_stream_pids(state, *buffers);
+	parse_unit(state, *buffers, packet, packet_length);
+}
+
+/**
+  * returns true if the sync byte at offset off is followed by sync bytes every packet_size bytes.
+  * Sync bytes beyond the end of the data are not checked, but at least one of them must be available unless
+  * the data is made of this single packet.
+  */
+static bool check_sync(const uint8_t *data, int off, int length, int packet_size)
+{
+	int i, next;
+
+	if (off == packet_prefix(packet_size) && packet_size == length)
+		return 1;
+
+	for (i = 1; i <= SYNC_LOCK_COUNT; i++)
+	{
+		next = off + i * packet_size;
+		if (next >= length)
+			return i > 1;
+		if (data[next] != SYNC_BYTE)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+  * returns the offset of the next packet at or after off, or length if none was found.
+  * When the packet size is not forced, it is detected from the periodicity of the sync bytes.
+  * pending is set to the offset of the first packet whose sync byte could not be checked because the next one is past
+  * the end of the data, or of the bytes at the end of the data that could be the M2TS header of the next packet, or -1.
+  */
+static int find_sync(struct dsmcc_tsparser_buffer *buffers, const uint8_t *data, int off, int length, int *pending)
+{
+	static const int packet_sizes[] = { DSMCC_TS_PACKET_SIZE, DSMCC_TS_M2TS_PACKET_SIZE, DSMCC_TS_RS_PACKET_SIZE };
+	const uint8_t *p;
+	int i, size, start = off;
+
+	*pending = -1;
+	while (off < length)
+	{
+		p = memchr(data + off, SYNC_BYTE, length - off);
+		if (!p)
+			break;
+		off = p - data;
+
+		for (i = 0; i < (int) (sizeof(packet_sizes) / sizeof(packet_sizes[0])); i++)
 		{
-			uint8_t pointer_field = packet[4];
-			if (pointer_field <= 183)
-			{
-				if (pointer_field)
-				{
-					if (buf->in_section + pointer_field > DSMCC_TSPARSER_BUFFER_SIZE)
-					{
-						DSMCC_ERROR("Section buffer overflow, no room for %d bytes (buffer is already at %d bytes) (table ID is 0x%02hhx)", pointer_field, buf->in_section, buf->data[0]);
-						memcpy(buf->data + buf->in_section, packet + 5, DSMCC_TSPARSER_BUFFER_SIZE - buf->in_section);
-						buf->in_section = DSMCC_TSPARSER_BUFFER_SIZE;
-					}
-					else
-					{
-						memcpy(buf->data + buf->in_section, packet + 5, pointer_field);
-						buf->in_section += pointer_field;
-					}
-				}
-
-				if (buf->si_seen)
-				{
-					DSMCC_DEBUG("Processing section data: PID 0x%hx, table ID 0x%02hhx, buffer length %d", buf->pid, buf->data[0], buf->in_section);
-					dsmcc_add_section(state, pid, buf->data, buf->in_section);
-				}
-				else
-				{
-					DSMCC_DEBUG("Ignoring section data with no start indicator: PID 0x%hx, buffer length %d", buf->pid, buf->in_section);
-				}
-				
-				/* read data upto this and copy into buf */
-				buf->si_seen = 1;
-				buf->in_section = 183 - pointer_field;
-				buf->cont = -1;
-				memset(buf->data, 0xFF, DSMCC_TSPARSER_BUFFER_SIZE);
-				memcpy(buf->data, packet + 5 + pointer_field, buf->in_section);
-			}
-			else
+			size = buffers->requested_packet_size ? buffers->requested_packet_size : packet_sizes[i];
+			if (off >= packet_prefix(size) && check_sync(data, off, length, size))
 			{
-				/* corrupted ? */
-				DSMCC_ERROR("Invalid pointer field %d", pointer_field);
+				if (size != buffers->packet_size)
+					DSMCC_DEBUG("Locked on %d bytes packets", size);
+				buffers->packet_size = size;
+				return off - packet_prefix(size);
 			}
+			if ((*pending < 0 || *pending > off - packet_prefix(size)) && off >= packet_prefix(size) && off + size >= length)
+				*pending = off - packet_prefix(size);
+			if (buffers->requested_packet_size)
+				break;
+		}
+		off++;
+	}
+
+	size = buffers->requested_packet_size ? buffers->requested_packet_size : DSMCC_TS_M2TS_PACKET_SIZE;
+	if (*pending < 0 && packet_prefix(size))
+		*pending = length - packet_prefix(size) > start ? length - packet_prefix(size) : start;
+	return length;
+}
+
+void dsmcc_tsparser_set_packet_size(struct dsmcc_tsparser_buffer **buffers, int packet_size)
+{
+	if (packet_size != 0 && packet_size != DSMCC_TS_PACKET_SIZE && packet_size != DSMCC_TS_M2TS_PACKET_SIZE && packet_size != DSMCC_TS_RS_PACKET_SIZE)
+	{
+		DSMCC_ERROR("Unsupported packet size %d", packet_size);
+		return;
+	}
+
+	if (!*buffers)
+		*buffers = calloc(1, sizeof(struct dsmcc_tsparser_buffer));
+
+	(*buffers)->requested_packet_size = packet_size;
+	(*buffers)->packet_size = packet_size;
+	(*buffers)->synced = 0;
+	(*buffers)->partial_length = 0;
+}
+
+void dsmcc_tsparser_set_section_filtering(struct dsmcc_tsparser_buffer **buffers, bool enable)
+{
+	if (!*buffers)
+		*buffers = calloc(1, sizeof(struct dsmcc_tsparser_buffer));
+
+	(*buffers)->section_filtering = enable;
+}
+
+int dsmcc_tsparser_get_packet_size(struct dsmcc_tsparser_buffer *buffers)
+{
+	return buffers ? buffers->packet_size : 0;
+}
+
+/**
+  * the previous call ended with a packet whose sync byte could not be checked against the next one: look for the
+  * packet boundaries again from its start, followed by the start of this buffer. Returns the offset in data where the
+  * parsing goes on.
+  */
+static int resume_sync(struct dsmcc_state *state, struct dsmcc_tsparser_buffer *ctx, const uint8_t *data, int data_length)
+{
+	uint8_t staging[DSMCC_TS_RS_PACKET_SIZE * (SYNC_LOCK_COUNT + 2)];
+	int kept = ctx->partial_length, length, sync, pending;
+
+	length = kept + data_length;
+	if (length > (int) sizeof(staging))
+		length = sizeof(staging);
+	memcpy(staging, ctx->partial, kept);
+	memcpy(staging + kept, data, length - kept);
+	ctx->partial_length = 0;
+
+	if (!ctx->requested_packet_size)
+		ctx->packet_size = 0;
+	sync = find_sync(ctx, staging, 0, length, &pending);
+	if (sync < kept)
+	{
+		/* lock confirmed, the packet ends in this buffer */
+		if (sync)
+			DSMCC_WARN("Resyncing on TS packet boundary, skipped %d bytes", sync);
+		ctx->synced = 1;
+		parse_unit(state, ctx, staging + sync, ctx->packet_size);
+		return sync + ctx->packet_size - kept;
+	}
+
+	if (sync >= length && pending >= 0 && pending < kept)
+	{
+		/* still not enough data to check it */
+		ctx->partial_length = length - pending;
+		memcpy(ctx->partial, staging + pending, ctx->partial_length);
+		return data_length;
+	}
+
+	DSMCC_WARN("Resyncing on TS packet boundary, skipped %d bytes", kept);
+	return 0;
+}
+
+void dsmcc_tsparser_parse_buffer(struct dsmcc_state *state, struct dsmcc_tsparser_buffer **buffers, uint8_t *data, int data_length)
+{
+	struct dsmcc_tsparser_buffer *ctx = *buffers;
+	int off = 0, size;
+
+	if (!ctx || !data || data_length <= 0)
+		return;
+
+	track_stream_pids(state, ctx);
+
+	/* finish packet split across the previous call and this one */
+	if (ctx->partial_length && !ctx->synced)
+		off = resume_sync(state, ctx, data, data_length);
+	else if (ctx->partial_length)
+	{
+		int missing;
+
+		size = ctx->packet_size;
+		missing = size - ctx->partial_length;
+		if (data_length < missing)
+		{
+			memcpy(ctx->partial + ctx->partial_length, data, data_length);
+			ctx->partial_length += data_length;
+			return;
+		}
+
+		if (missing + packet_prefix(size) < data_length && data[missing + packet_prefix(size)] != SYNC_BYTE)
+		{
+			DSMCC_WARN("Lost sync on packet split across buffers, dropping %d bytes", ctx->partial_length);
+			ctx->synced = 0;
 		}
 		else
 		{
-			buf->si_seen = 1;
-			buf->in_section = 183;
-			memcpy(buf->data, packet + 5, 183);
+			memcpy(ctx->partial + ctx->partial_length, data, missing);
+			parse_unit(state, ctx, ctx->partial, size);
+			off = missing;
 		}
+		ctx->partial_length = 0;
 	}
-	else
+
+	while (off < data_length)
 	{
-		/* append data to buf */
-		if (buf->in_section + 184 > DSMCC_TSPARSER_BUFFER_SIZE)
+		size = ctx->packet_size;
+		if (!ctx->synced || off + packet_prefix(size) >= data_length || data[off + packet_prefix(size)] != SYNC_BYTE)
 		{
-			DSMCC_ERROR("Section buffer overflow, no room for %d bytes (buffer is already at %d bytes) (table ID is 0x%02hhx)", 184, buf->in_section, buf->data[0]);
-			memcpy(buf->data + buf->in_section, packet + 4, DSMCC_TSPARSER_BUFFER_SIZE - buf->in_section);
-			buf->in_section = DSMCC_TSPARSER_BUFFER_SIZE;
+			int sync, pending;
+
+			if (ctx->synced && off + packet_prefix(size) >= data_length)
+			{
+				/* M2TS header of the next packet at the end of the buffer */
+				ctx->partial_length = data_length - off;
+				memcpy(ctx->partial, data + off, ctx->partial_length);
+				break;
+			}
+
+			if (!ctx->requested_packet_size)
+				ctx->packet_size = 0;
+			sync = find_sync(ctx, data, off, data_length, &pending);
+			if (sync >= data_length && pending >= 0)
+			{
+				/* the lock on the last packet is confirmed with the next buffer */
+				if (pending != off)
+					DSMCC_WARN("Resyncing on TS packet boundary, skipped %d bytes", pending - off);
+				ctx->synced = 0;
+				ctx->partial_length = data_length - pending;
+				memcpy(ctx->partial, data + pending, ctx->partial_length);
+				break;
+			}
+			if (sync != off)
+				DSMCC_WARN("Resyncing on TS packet boundary, skipped %d bytes", sync - off);
+			off = sync;
+			if (off >= data_length)
+			{
+				ctx->synced = 0;
+				break;
+			}
+			ctx->synced = 1;
+			size = ctx->packet_size;
 		}
-		else
+
+		if (data_length - off < size)
 		{
-			memcpy(buf->data + buf->in_section, packet + 4, 184);
-			buf->in_section += 184;
+			ctx->partial_length = data_length - off;
+			memcpy(ctx->partial, data + off, ctx->partial_length);
+			break;
 		}
+
+		parse_unit(state, ctx, data + off, size);
+		off += size;
 	}
 }
 
 void dsmcc_tsparser_parse_buffered_sections(struct dsmcc_state *state, struct dsmcc_tsparser_buffer *buffers)
 {
-	while (buffers)
+	struct dsmcc_tsparser_pid_buffer *buf;
+	int i;
+
+	(void) state;
+
+	if (!buffers)
+		return;
+
+	for (i = 0; i < buffers->pid_count; i++)
 	{
-		DSMCC_DEBUG("Processing section data PID 0x%hx, buffer length %d", buffers->pid, buffers->in_section);
-		dsmcc_add_section(state, buffers->pid, buffers->data, buffers->in_section);
-		buffers->si_seen = 0;
-		buffers->in_section = 0;
-		buffers->cont = -1;
-		memset(buffers->data, 0xFF, DSMCC_TSPARSER_BUFFER_SIZE);
-		buffers = buffers->next;
+		buf = buffers->pids[i];
+		if (buf->in_section)
+		{
+			DSMCC_DEBUG("Dropping incomplete section: PID 0x%hx, table ID 0x%02hhx, buffer length %d", buf->pid, buf->header[0], buf->in_section);
+			drop_section(buf);
+		}
+		buf->cont = -1;
+		buf->duplicate = 0;
 	}
+	buffers->partial_length = 0;
+	buffers->synced = 0;
 }
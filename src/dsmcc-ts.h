@@ -2,18 +2,50 @@
 #define DSMCC_TS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
-#define DSMCC_TSPARSER_BUFFER_SIZE 8192
+#include <dsmcc/dsmcc-tsparser.h>
 
-struct dsmcc_tsparser_buffer
+/* from dsmcc.h */
+struct dsmcc_section_buffer;
+
+#define DSMCC_TS_PACKET_SIZE      188
+#define DSMCC_TS_M2TS_PACKET_SIZE 192
+#define DSMCC_TS_RS_PACKET_SIZE   204
+#define DSMCC_TS_PID_COUNT        8192
+#define DSMCC_TS_PAYLOAD_SIZE     184
+
+struct dsmcc_tsparser_pid_buffer
 {
 	uint16_t pid;
-	int      si_seen;
 	int      in_section;
+	bool     discard;    /*< the current section did not match any section filter, its data is skipped */
 	int      cont;
-	uint8_t  data[DSMCC_TSPARSER_BUFFER_SIZE];
+	bool     duplicate;  /*< the last packet was already received once */
+	bool     manual;     /*< added by dsmcc_tsparser_add_pid, never removed by PID tracking */
+
+	uint8_t                      header[3]; /*< header of the current section, copied to the section buffer once the length is known */
+	struct dsmcc_section_buffer *section;   /*< pooled buffer where the current section is assembled, queued as-is when complete */
+
+	struct dsmcc_tsparser_pid_stats stats;
+};
+
+struct dsmcc_tsparser_buffer
+{
+	uint16_t                           pid_index[DSMCC_TS_PID_COUNT]; /*< slot number + 1 of each tracked PID, 0 if the PID is not tracked */
+	struct dsmcc_tsparser_pid_buffer **pids;                          /*< compact array of the tracked PIDs */
+	int                                pid_count;
 
-	struct dsmcc_tsparser_buffer *next;
+	int      requested_packet_size;            /*< packet size set by dsmcc_tsparser_set_packet_size, 0 for auto-detection */
+	int      packet_size;                      /*< current packet size, 0 if not yet detected */
+	bool     synced;                           /*< true when locked on the packet boundaries of the input stream */
+	uint8_t  partial[DSMCC_TS_RS_PACKET_SIZE]; /*< start of a packet split across two dsmcc_tsparser_parse_buffer calls, not yet
+	                                                checked against the next sync byte if !synced */
+	int      partial_length;
+	uint32_t arrival_time;                     /*< arrival time stamp of the current packet (192 bytes packets only) */
+	bool     section_filtering;                /*< match sections against the section filters of the state */
+	bool     track_pids;                       /*< follow the PIDs of the streams where the library has queued requests */
+	uint32_t pid_generation;                   /*< generation of the stream PIDs last synchronized */
 };
 
 #endif
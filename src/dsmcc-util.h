@@ -8,8 +8,6 @@
 
 #include "dsmcc.h"
 
-uint32_t dsmcc_crc32(uint8_t *data, uint32_t len);
-
 char *dsmcc_tolower(char *s);
 bool dsmcc_file_copy(const char *dstfile, const char *srcfile, int offset, int length);
 bool dsmcc_file_link(const char *dstfile, const char *srcfile, int length, const char *relativeFile);
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+
+#include "dsmcc-worker.h"
+
+/**
+  * returns the next waiting job, the background jobs once there is no other one. Called with the mutex held.
+  */
+static struct dsmcc_job *pop_job(struct dsmcc_workers *workers)
+{
+	struct dsmcc_job *job;
+
+	if (workers->first)
+	{
+		job = workers->first;
+		workers->first = job->next;
+		if (!workers->first)
+			workers->last = NULL;
+	}
+	else
+	{
+		job = workers->first_background;
+		if (job)
+			workers->first_background = job->next;
+		if (!workers->first_background)
+			workers->last_background = NULL;
+	}
+
+	return job;
+}
+
+static void *worker_func(void *arg)
+{
+	struct dsmcc_workers *workers = (struct dsmcc_workers *) arg;
+	struct dsmcc_job *job;
+	int index;
+
+	pthread_mutex_lock(&workers->mutex);
+	index = workers->started++;
+	while (1)
+	{
+		while (!workers->first && !workers->first_background && !workers->stop)
+			pthread_cond_wait(&workers->cond, &workers->mutex);
+		if (workers->stop)
+			break;
+
+		job = pop_job(workers);
+		workers->running[index] = job->owner;
+		pthread_mutex_unlock(&workers->mutex);
+
+		(*job->run)(job);
+		(*job->done)(job);
+
+		pthread_mutex_lock(&workers->mutex);
+		workers->running[index] = NULL;
+		pthread_cond_broadcast(&workers->done_cond);
+	}
+	pthread_mutex_unlock(&workers->mutex);
+
+	return NULL;
+}
+
+struct dsmcc_workers *dsmcc_workers_new(int count)
+{
+	struct dsmcc_workers *workers;
+	int i;
+
+	workers = calloc(1, sizeof(struct dsmcc_workers));
+	pthread_mutex_init(&workers->mutex, NULL);
+	pthread_cond_init(&workers->cond, NULL);
+	pthread_cond_init(&workers->done_cond, NULL);
+	workers->count = count > 0 ? count : 1;
+	workers->threads = calloc(workers->count, sizeof(pthread_t));
+	workers->running = calloc(workers->count, sizeof(void *));
+	for (i = 0; i < workers->count; i++)
+		pthread_create(&workers->threads[i], NULL, &worker_func, workers);
+
+	return workers;
+}
+
+/**
+  * Stop the workers once their current job is finished, the jobs that did not run are completed without running
+  */
+void dsmcc_workers_free(struct dsmcc_workers *workers)
+{
+	struct dsmcc_job *job;
+	int i;
+
+	if (!workers)
+		return;
+
+	pthread_mutex_lock(&workers->mutex);
+	workers->stop = 1;
+	pthread_cond_broadcast(&workers->cond);
+	pthread_mutex_unlock(&workers->mutex);
+
+	for (i = 0; i < workers->count; i++)
+		pthread_join(workers->threads[i], NULL);
+
+	while ((job = pop_job(workers)))
+		(*job->done)(job);
+
+	pthread_cond_destroy(&workers->done_cond);
+	pthread_cond_destroy(&workers->cond);
+	pthread_mutex_destroy(&workers->mutex);
+	free(workers->running);
+	free(workers->threads);
+	free(workers);
+}
+
+void dsmcc_workers_queue(struct dsmcc_workers *workers, struct dsmcc_job *job)
+{
+	struct dsmcc_job **first, **last;
+
+	job->next = NULL;
+
+	pthread_mutex_lock(&workers->mutex);
+	first = job->background ? &workers->first_background : &workers->first;
+	last = job->background ? &workers->last_background : &workers->last;
+	if (*last)
+		(*last)->next = job;
+	else
+		*first = job;
+	*last = job;
+	pthread_cond_signal(&workers->cond);
+	pthread_mutex_unlock(&workers->mutex);
+}
+
+static bool owner_running(struct dsmcc_workers *workers, void *owner)
+{
+	int i;
+
+	for (i = 0; i < workers->count; i++)
+		if (workers->running[i] == owner)
+			return 1;
+	return 0;
+}
+
+static void remove_owner_jobs(struct dsmcc_job **first, struct dsmcc_job **last, void *owner, struct dsmcc_job **removed)
+{
+	struct dsmcc_job **prev = first, *job;
+
+	*last = NULL;
+	while ((job = *prev))
+	{
+		if (job->owner == owner)
+		{
+			*prev = job->next;
+			job->next = *removed;
+			*removed = job;
+		}
+		else
+		{
+			*last = job;
+			prev = &job->next;
+		}
+	}
+}
+
+/**
+  * Complete the waiting jobs of the owner without running them, and wait for its running jobs to be done, when the
+  * workers are shared by several owners
+  */
+void dsmcc_workers_cancel(struct dsmcc_workers *workers, void *owner)
+{
+	struct dsmcc_job *removed = NULL, *job;
+
+	pthread_mutex_lock(&workers->mutex);
+	remove_owner_jobs(&workers->first, &workers->last, owner, &removed);
+	remove_owner_jobs(&workers->first_background, &workers->last_background, owner, &removed);
+	while (owner_running(workers, owner))
+		pthread_cond_wait(&workers->done_cond, &workers->mutex);
+	pthread_mutex_unlock(&workers->mutex);
+
+	while (removed)
+	{
+		job = removed;
+		removed = job->next;
+		(*job->done)(job);
+	}
+}
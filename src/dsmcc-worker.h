@@ -0,0 +1,38 @@
+#ifndef DSMCC_WORKER_H
+#define DSMCC_WORKER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/* pool of threads running the jobs that are too slow for the parsing threads (module inflate, parse and copy) */
+
+struct dsmcc_job
+{
+	void (*run)(struct dsmcc_job *job);  /*< called by a worker thread */
+	void (*done)(struct dsmcc_job *job); /*< called by the worker thread after run, or by dsmcc_workers_free if the job did not run */
+	bool background;                     /*< only run when no other job is waiting */
+	void *owner;                         /*< the jobs of an owner can be cancelled with dsmcc_workers_cancel */
+
+	struct dsmcc_job *next;
+};
+
+struct dsmcc_workers
+{
+	pthread_mutex_t   mutex;
+	pthread_cond_t    cond;
+	pthread_cond_t    done_cond;    /*< broadcast when a job is done */
+	struct dsmcc_job *first, *last; /*< jobs waiting for a worker */
+	struct dsmcc_job *first_background, *last_background;
+	void            **running;      /*< owner of the job run by each thread, the job itself may be freed once done */
+	int               started;      /*< threads that have taken their index in running */
+	bool              stop;
+	int               count;
+	pthread_t        *threads;
+};
+
+struct dsmcc_workers *dsmcc_workers_new(int count);
+void dsmcc_workers_free(struct dsmcc_workers *workers);
+void dsmcc_workers_queue(struct dsmcc_workers *workers, struct dsmcc_job *job);
+void dsmcc_workers_cancel(struct dsmcc_workers *workers, void *owner);
+
+#endif
@@ -6,7 +6,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
 #include <linux/limits.h>
 
 #include "dsmcc.h"
@@ -14,6 +19,7 @@
 #include "dsmcc-carousel.h"
 #include "dsmcc-section.h"
 #include "dsmcc-cache-file.h"
+#include "dsmcc-cache-module.h"
 
 
 struct dsmcc_queue_entry
@@ -26,43 +32,82 @@ struct dsmcc_queue_entry
 	struct dsmcc_queue_entry *next, *prev;
 };
 
-static void load_state(struct dsmcc_state *state)
+/* data sizes of the section pools */
+static const int section_sizes[DSMCC_SECTION_SIZE_CLASS_COUNT] = DSMCC_SECTION_SIZE_CLASSES;
+
+/* shard whose actions are being processed by the current thread */
+static __thread struct dsmcc_shard *current_shard;
+
+static char *shard_cachefile(struct dsmcc_state *state, int index)
+{
+	char *cachefile;
+
+	cachefile = malloc(strlen(state->cachedir) + 11);
+	if (index)
+		sprintf(cachefile, "%s/state.%d", state->cachedir, index);
+	else
+		sprintf(cachefile, "%s/state", state->cachedir);
+
+	return cachefile;
+}
+
+static void save_state(struct dsmcc_shard *shard)
 {
 	FILE *f;
-	struct stat s;
 
-	if (stat(state->cachefile, &s) < 0)
+	if (!shard->state->keep_cache)
 		return;
 
-	DSMCC_DEBUG("Loading cached state");
+	DSMCC_DEBUG("Saving state of shard %d", shard->index);
 
-	f = fopen(state->cachefile, "r");
-	if (!dsmcc_object_carousel_load_all(f, state))
-		DSMCC_ERROR("Error while loading cached state");
+	f = fopen(shard->cachefile, "w");
+	if (!dsmcc_object_carousel_save_all(f, shard))
+		DSMCC_ERROR("Error while saving cached state");
 	fclose(f);
 }
 
-static void save_state(struct dsmcc_state *state)
+/**
+  * Load the state files of all the shards, whatever the number of shards when they were saved. Carousels are given to
+  * the shard of their requested PID, so the state files are saved again and those of the missing shards removed.
+  */
+static void load_state(struct dsmcc_state *state)
 {
 	FILE *f;
+	struct stat s;
+	char *cachefile;
+	bool loaded = 0;
+	int i;
 
-	if (!state->keep_cache)
-		return;
+	for (i = 0; i < DSMCC_MAX_SHARDS; i++)
+	{
+		cachefile = shard_cachefile(state, i);
+		if (stat(cachefile, &s) == 0)
+		{
+			DSMCC_DEBUG("Loading cached state %s", cachefile);
 
-	DSMCC_DEBUG("Saving state");
+			f = fopen(cachefile, "r");
+			if (!dsmcc_object_carousel_load_all(f, state))
+				DSMCC_ERROR("Error while loading cached state");
+			fclose(f);
+			loaded = 1;
 
-	f = fopen(state->cachefile, "w");
-	if (!dsmcc_object_carousel_save_all(f, state))
-		DSMCC_ERROR("Error while saving cached state");
-	fclose(f);
+			if (i >= state->shard_count)
+				unlink(cachefile);
+		}
+		free(cachefile);
+	}
+
+	if (loaded)
+		for (i = 0; i < state->shard_count; i++)
+			save_state(&state->shards[i]);
 }
 
-static void clear_single_carousel(struct dsmcc_state *state, uint32_t carousel_id)
+static void clear_single_carousel(struct dsmcc_shard *shard, uint32_t carousel_id)
 {
 	struct dsmcc_object_carousel *carousel, **prev;
 
-	carousel = state->carousels;
-	prev = &state->carousels;
+	carousel = shard->carousels;
+	prev = &shard->carousels;
 
 	while (carousel)
 	{
@@ -80,212 +125,1203 @@ static void clear_single_carousel(struct dsmcc_state *state, uint32_t carousel_i
 	}
 }
 
+static void free_action(struct dsmcc_state *state, struct dsmcc_action *action)
+{
+	switch (action->type)
+	{
+		case DSMCC_ACTION_ADD_CAROUSEL:
+			free(action->add_carousel.parameters->downloadpath);
+			free(action->add_carousel.parameters);
+			break;
+		case DSMCC_ACTION_ADD_SECTION:
+			if (action->add_section.buffer)
+			{
+				/* the action is part of the pooled buffer */
+				dsmcc_section_buffer_put(action->add_section.buffer);
+				return;
+			}
+			if (action->add_section.section == &action->add_section.ref)
+			{
+				/* the data belongs to the caller of dsmcc_add_section_ref */
+				if (action->add_section.release)
+					(*action->add_section.release)(action->add_section.release_arg, action->add_section.ref.data, action->add_section.ref.length);
+			}
+			else
+				free(action->add_section.section);
+			break;
+		case DSMCC_ACTION_MODULE_PROCESSED:
+			if (action->module_processed.job)
+				dsmcc_cache_module_job_cancel(action->module_processed.job);
+			break;
+	}
+	dsmcc_pool_free(state->action_pool, action);
+}
+
 void timespec_to_timeval(struct timespec *ts, struct timeval *tv)
 {
 	tv->tv_sec  = ts->tv_sec;
 	tv->tv_usec = ts->tv_nsec / 1000;
 }
 
-void *dsmcc_thread_func(void *arg)
+static void process_action(struct dsmcc_shard *shard, struct dsmcc_action *action)
+{
+	switch (action->type)
+	{
+		case DSMCC_ACTION_ADD_CAROUSEL:
+			DSMCC_DEBUG("Adding carousel to queue, PID 0x%04x queue_id %u",
+					action->add_carousel.parameters->pid, action->add_carousel.queue_id);
+			dsmcc_object_carousel_queue_add(shard, action->add_carousel.queue_id,
+					action->add_carousel.parameters, &action->add_carousel.callbacks, action->add_carousel.priority);
+			break;
+		case DSMCC_ACTION_REMOVE_CAROUSEL:
+			DSMCC_DEBUG("Removing carousel from queue, queue_id %u", action->remove_carousel.queue_id);
+			dsmcc_object_carousel_queue_remove(shard, action->remove_carousel.queue_id);
+			break;
+		case DSMCC_ACTION_ADD_SECTION:
+			DSMCC_DEBUG("Parsing a section for PID 0x%04x size %d", action->add_section.section->pid,
+					action->add_section.section->length);
+			dsmcc_parse_section(shard, action->add_section.section);
+			break;
+		case DSMCC_ACTION_CACHE_CLEAR:
+			DSMCC_DEBUG("Clearing all cache");
+			dsmcc_object_carousel_free_all(shard, 0);
+			break;
+		case DSMCC_ACTION_CACHE_CLEAR_CAROUSEL:
+			DSMCC_DEBUG("Clearing cache for carousel 0x%08x", action->cache_clear_carousel.carousel_id);
+			clear_single_carousel(shard, action->cache_clear_carousel.carousel_id);
+			break;
+		case DSMCC_ACTION_MODULE_PROCESSED:
+			dsmcc_cache_module_job_complete(action->module_processed.job);
+			action->module_processed.job = NULL;
+			break;
+		default:
+			break;
+	}
+	free_action(shard->state, action);
+}
+
+static bool background_pending(struct dsmcc_shard *shard)
+{
+	return shard->next_background_action || !dsmcc_ring_empty(shard->data_queue.background_ring);
+}
+
+/**
+  * refill the budget of background DDB sections for the time elapsed since the last refill, at most one second worth
+  * of it. Returns true if background sections can be processed.
+  */
+static bool background_allowed(struct dsmcc_shard *shard)
+{
+	uint32_t budget = __atomic_load_n(&shard->state->background_budget, __ATOMIC_RELAXED);
+	struct timespec ts;
+	struct timeval curtime, elapsed;
+	int64_t refill;
+
+	if (!budget)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timespec_to_timeval(&ts, &curtime);
+	timersub(&curtime, &shard->background_refill, &elapsed);
+	if (elapsed.tv_sec >= 1)
+		refill = budget;
+	else
+		refill = (int64_t) elapsed.tv_usec * budget / 1000000;
+	/* only move the refill time when tokens were added, so that frequent calls do not lose the fractions */
+	if (refill > 0)
+	{
+		shard->background_tokens += refill;
+		if (shard->background_tokens > budget)
+			shard->background_tokens = budget;
+		shard->background_refill = curtime;
+	}
+
+	return shard->background_tokens > 0;
+}
+
+/**
+  * sets resume to the time the budget allows background DDB sections to be processed again, returns false if there
+  * are none waiting for it
+  */
+static bool background_resume_time(struct dsmcc_shard *shard, struct timeval *resume)
+{
+	uint32_t budget = __atomic_load_n(&shard->state->background_budget, __ATOMIC_RELAXED);
+	struct timeval delay;
+	int64_t us;
+
+	if (!budget || !background_pending(shard) || shard->background_tokens > 0)
+		return 0;
+
+	us = (1 - shard->background_tokens) * 1000000 / budget + 1;
+	delay.tv_sec = us / 1000000;
+	delay.tv_usec = us % 1000000;
+	timeradd(&shard->background_refill, &delay, resume);
+	return 1;
+}
+
+/**
+  * returns the time of the next timeout of the shard, or of the end of the wait for the background budget if earlier.
+  * Returns NULL if there is none.
+  */
+static struct timeval *next_wakeup_time(struct dsmcc_shard *shard, struct timeval *resume)
+{
+	struct dsmcc_timeout *timeout;
+
+	timeout = dsmcc_timeouts_first(&shard->timeouts);
+	if (background_resume_time(shard, resume))
+		return timeout && timercmp(&timeout->abstime, resume, <) ? &timeout->abstime : resume;
+	return timeout ? &timeout->abstime : NULL;
+}
+
+/**
+  * returns the delay in milliseconds until the next timeout, or -1 if there is none
+  */
+static int next_timeout_delay(struct dsmcc_shard *shard)
+{
+	struct timespec ts;
+	struct timeval curtime, waittime, resume, *wakeup;
+
+	wakeup = next_wakeup_time(shard, &resume);
+	if (!wakeup)
+	{
+		DSMCC_DEBUG("Wait indefinitely for wakeup");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timespec_to_timeval(&ts, &curtime);
+	if (!timercmp(wakeup, &curtime, >))
+		return 0;
+
+	timersub(wakeup, &curtime, &waittime);
+	DSMCC_DEBUG("Waiting %d.%06d second(s) for wakeup", waittime.tv_sec, waittime.tv_usec);
+
+	/* round up, so that the timeout has expired when we wake up */
+	return waittime.tv_sec * 1000 + (waittime.tv_usec + 999) / 1000;
+}
+
+static void release_data_space(struct dsmcc_shard *shard, int count, uint32_t length)
+{
+	struct dsmcc_data_queue *queue = &shard->data_queue;
+
+	__atomic_sub_fetch(&queue->queued_sections, count, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&queue->queued_bytes, length, __ATOMIC_SEQ_CST);
+
+	/* producers set waiters before checking the queue state */
+	if (__atomic_load_n(&queue->waiters, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&queue->mutex);
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->mutex);
+	}
+}
+
+/**
+  * returns true if there is nothing the thread can process now, background DDB sections over the budget do not count
+  */
+static bool queues_empty(struct dsmcc_shard *shard)
+{
+	return !shard->next_action && !shard->next_data_action &&
+		dsmcc_ring_empty(shard->actions) && dsmcc_ring_empty(shard->data_queue.ring) &&
+		(!background_pending(shard) || !background_allowed(shard));
+}
+
+/**
+  * returns the next action to process. The action queue (requests, DSI and DII sections) has priority over the DDB
+  * queue, so that carousel control is not delayed by a backlog of blocks, unless DSMCC_MAX_OVERTAKE actions were
+  * processed while a DDB section was waiting. The DDB sections of the background carousels come last, within their
+  * budget, with the same bound on the actions processed before them.
+  */
+static struct dsmcc_action *next_queued_action(struct dsmcc_shard *shard)
+{
+	struct dsmcc_action *action;
+
+	if (!shard->next_action)
+		shard->next_action = dsmcc_ring_pop(shard->actions);
+	if (!shard->next_data_action)
+	{
+		shard->next_data_action = dsmcc_ring_pop(shard->data_queue.ring);
+		if (shard->next_data_action)
+			release_data_space(shard, 1, shard->next_data_action->add_section.section->length);
+	}
+	if (!shard->next_background_action && background_allowed(shard))
+	{
+		shard->next_background_action = dsmcc_ring_pop(shard->data_queue.background_ring);
+		if (shard->next_background_action)
+			release_data_space(shard, 1, shard->next_background_action->add_section.section->length);
+	}
+
+	if (shard->next_background_action && background_allowed(shard) &&
+			(shard->background_overtaken >= DSMCC_MAX_OVERTAKE || (!shard->next_action && !shard->next_data_action)))
+	{
+		action = shard->next_background_action;
+		shard->next_background_action = NULL;
+		shard->background_overtaken = 0;
+		shard->background_tokens -= action->add_section.section->length;
+		return action;
+	}
+	if (shard->next_background_action && (shard->next_action || shard->next_data_action))
+		shard->background_overtaken++;
+
+	if (shard->next_action && (!shard->next_data_action || shard->overtaken < DSMCC_MAX_OVERTAKE))
+	{
+		action = shard->next_action;
+		shard->next_action = NULL;
+		if (shard->next_data_action)
+			shard->overtaken++;
+	}
+	else
+	{
+		action = shard->next_data_action;
+		shard->next_data_action = NULL;
+		shard->overtaken = 0;
+	}
+
+	return action;
+}
+
+/**
+  * sleep until an action is queued, stop is requested or the next timeout expires
+  */
+static void wait_for_actions(struct dsmcc_shard *shard)
+{
+	struct pollfd pfd;
+	uint64_t count;
+	int delay;
+
+	delay = next_timeout_delay(shard);
+	if (!delay)
+		return;
+
+	/* producers only signal the eventfd when this flag is set, recheck the queue after setting it */
+	__atomic_store_n(&shard->waiting, 1, __ATOMIC_SEQ_CST);
+	if (!queues_empty(shard) || __atomic_load_n(&shard->state->stop, __ATOMIC_SEQ_CST))
+	{
+		__atomic_store_n(&shard->waiting, 0, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	pfd.fd = shard->event_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, delay) > 0)
+	{
+		if (read(shard->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			DSMCC_ERROR("Error while reading eventfd: %s", strerror(errno));
+	}
+	__atomic_store_n(&shard->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+static void wake_thread(struct dsmcc_shard *shard)
+{
+	uint64_t one = 1;
+
+	if (shard->state->executor)
+	{
+		dsmcc_executor_schedule(shard->state->executor, &shard->task);
+		return;
+	}
+
+	if (write(shard->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		DSMCC_ERROR("Error while writing eventfd: %s", strerror(errno));
+}
+
+static void update_time(struct dsmcc_shard *shard)
 {
-	struct dsmcc_state *state = (struct dsmcc_state *) arg;
 	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timespec_to_timeval(&ts, &shard->now);
+}
+
+/**
+  * returns the number of expired timeouts
+  */
+static int handle_timeouts(struct dsmcc_shard *shard)
+{
+	struct dsmcc_timeout *timeout;
+	struct dsmcc_object_carousel *carousel;
+	int count = 0;
+
+	update_time(shard);
+	while ((timeout = dsmcc_timeouts_first(&shard->timeouts)) && !timercmp(&timeout->abstime, &shard->now, >))
+	{
+		if (timercmp(&timeout->deadline, &timeout->abstime, >))
+		{
+			/* the timeout was extended since it was added, move it to its real expiry time */
+			timeout->abstime = timeout->deadline;
+			dsmcc_timeouts_update(&shard->timeouts, timeout);
+			continue;
+		}
+
+		DSMCC_DEBUG("Timeout expired: CID 0x%08x TYPE %d MODULE_ID 0x%04hhx", timeout->carousel->cid, timeout->type, timeout->module_id);
+
+		carousel = timeout->carousel;
+		dsmcc_timeouts_remove(&shard->timeouts, timeout);
+		dsmcc_pool_free(shard->state->timeout_pool, timeout);
+
+		dsmcc_object_carousel_set_status(carousel, DSMCC_STATUS_TIMEDOUT);
+		dsmcc_filecache_notify_status(carousel, NULL);
+		count++;
+	}
+
+	return count;
+}
+
+/**
+  * process the actions queued for the shard, at most budget of them so that timeouts are still handled under load,
+  * then the expired timeouts. Returns the number of processed actions.
+  */
+static int process_shard(struct dsmcc_shard *shard, int budget)
+{
+	struct dsmcc_state *state = shard->state;
+	struct dsmcc_action *action;
+	int count = 0;
+
+	current_shard = shard;
+	update_time(shard);
+
+	/* actions queued by the thread itself, from a callback, while the queue was full */
+	while (shard->first_deferred && !__atomic_load_n(&state->stop, __ATOMIC_RELAXED))
+	{
+		action = shard->first_deferred;
+		shard->first_deferred = action->next;
+		if (!shard->first_deferred)
+			shard->last_deferred = NULL;
+		process_action(shard, action);
+		count++;
+	}
+
+	/* handle queued actions */
+	while (count < budget && !__atomic_load_n(&state->stop, __ATOMIC_RELAXED))
+	{
+		action = next_queued_action(shard);
+		if (!action)
+			break;
+		process_action(shard, action);
+		count++;
+	}
+
+	if (count)
+		shard->dirty = 1;
+
+	/* handle expired timeouts */
+	if (!__atomic_load_n(&state->stop, __ATOMIC_RELAXED) && handle_timeouts(shard))
+		shard->dirty = 1;
+
+	dsmcc_ddb_index_publish(&shard->ddb_index);
+
+	if (shard->snapshots_dirty)
+		dsmcc_snapshot_publish(shard);
+	else
+		dsmcc_snapshot_reclaim(shard);
+
+	if (shard->dirty)
+	{
+		save_state(shard);
+		shard->dirty = 0;
+	}
+
+	current_shard = NULL;
+
+	return count;
+}
+
+void *dsmcc_thread_func(void *arg)
+{
+	struct dsmcc_shard *shard = (struct dsmcc_shard *) arg;
+
 	while (1)
 	{
-		struct dsmcc_action *buffered_actions;
+		if (queues_empty(shard) && !shard->first_deferred)
+			wait_for_actions(shard);
+
+		/* stop is requested, quit thread immediately (queued actions are freed by dsmcc_close) */
+		if (__atomic_load_n(&shard->state->stop, __ATOMIC_SEQ_CST))
+			break;
 
-		pthread_mutex_lock(&state->mutex);
+		process_shard(shard, DSMCC_ACTION_QUEUE_SIZE);
+	}
+
+	pthread_exit(0);
+}
+
+/**
+  * run by an executor thread when the shard is scheduled or its next timeout is due
+  */
+static bool run_shard_task(struct dsmcc_task *task, struct timeval *wakeup)
+{
+	struct dsmcc_shard *shard = (struct dsmcc_shard *) task;
+	struct timeval resume, *next;
+
+	process_shard(shard, DSMCC_ACTION_QUEUE_SIZE);
+
+	next = next_wakeup_time(shard, &resume);
+	if (next)
+		*wakeup = *next;
+	else
+		timerclear(wakeup);
+
+	/* producers schedule the shard again once the flag is set, recheck the queues after setting it */
+	__atomic_store_n(&shard->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shard->state->stop, __ATOMIC_SEQ_CST))
+		return 0;
+	if (queues_empty(shard) && !shard->first_deferred)
+		return 0;
+	return __atomic_exchange_n(&shard->waiting, 0, __ATOMIC_SEQ_CST);
+}
 
-		if (!state->stop && !state->first_action)
+static void init_data_queue(struct dsmcc_shard *shard)
+{
+	struct dsmcc_data_queue *queue = &shard->data_queue;
+
+	queue->ring = dsmcc_ring_new(DSMCC_DATA_QUEUE_SIZE);
+	queue->background_ring = dsmcc_ring_new(DSMCC_DATA_QUEUE_SIZE);
+	queue->max_sections = DSMCC_DATA_QUEUE_SIZE;
+	queue->max_bytes = 0;
+	queue->policy = DSMCC_QUEUE_POLICY_BLOCK;
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+}
+
+static void create_pools(struct dsmcc_state *state)
+{
+	int i;
+
+	for (i = 0; i < DSMCC_SECTION_SIZE_CLASS_COUNT; i++)
+		state->section_pools[i] = dsmcc_pool_new(sizeof(struct dsmcc_section_buffer) + section_sizes[i], DSMCC_SECTION_POOL_SLAB_OBJECTS);
+	state->action_pool = dsmcc_pool_new(sizeof(struct dsmcc_action), DSMCC_POOL_SLAB_OBJECTS);
+	state->timeout_pool = dsmcc_pool_new(sizeof(struct dsmcc_timeout), DSMCC_POOL_SLAB_OBJECTS);
+	state->queue_entry_pool = dsmcc_pool_new(sizeof(struct dsmcc_queue_entry), DSMCC_POOL_SLAB_OBJECTS);
+	state->dentry_pool = dsmcc_pool_new(dsmcc_cache_dentry_size(), DSMCC_POOL_SLAB_OBJECTS);
+}
+
+static void close_pools(struct dsmcc_state *state)
+{
+	int i;
+
+	/* section buffers may still be held by TS parsers, their pools are freed when they are released */
+	for (i = 0; i < DSMCC_SECTION_SIZE_CLASS_COUNT; i++)
+		dsmcc_pool_close(state->section_pools[i]);
+	dsmcc_pool_close(state->action_pool);
+	dsmcc_pool_close(state->timeout_pool);
+	dsmcc_pool_close(state->queue_entry_pool);
+	dsmcc_pool_close(state->dentry_pool);
+}
+
+static void init_shard(struct dsmcc_state *state, int index)
+{
+	struct dsmcc_shard *shard = &state->shards[index];
+
+	shard->state = state;
+	shard->index = index;
+	shard->cachefile = shard_cachefile(state, index);
+	shard->actions = dsmcc_ring_new(DSMCC_ACTION_QUEUE_SIZE);
+	init_data_queue(shard);
+	shard->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	dsmcc_timeouts_init(&shard->timeouts);
+	dsmcc_ddb_index_init(&shard->ddb_index);
+}
+
+static void add_epoll_fd(struct dsmcc_state *state, int fd)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		DSMCC_ERROR("Error while adding fd to epoll: %s", strerror(errno));
+}
+
+/**
+  * in threadless mode, the caller polls a single fd gathering the eventfds of the shards and a timerfd for the
+  * timeouts
+  */
+static void init_threadless(struct dsmcc_state *state)
+{
+	int i;
+
+	pthread_mutex_init(&state->process_mutex, NULL);
+	state->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	add_epoll_fd(state, state->timer_fd);
+	for (i = 0; i < state->shard_count; i++)
+	{
+		add_epoll_fd(state, state->shards[i].event_fd);
+		/* the shard is not sleeping, but the caller is only woken up through the fd */
+		state->shards[i].waiting = 1;
+	}
+}
+
+struct dsmcc_state *dsmcc_open(const char *cachedir, bool keep_cache, struct dsmcc_dvb_callbacks *callbacks)
+{
+	return dsmcc_open2(cachedir, keep_cache, callbacks, NULL);
+}
+
+struct dsmcc_state *dsmcc_open2(const char *cachedir, bool keep_cache, struct dsmcc_dvb_callbacks *callbacks,
+		struct dsmcc_state_parameters *parameters)
+{
+	struct dsmcc_state *state = NULL;
+	int i;
+
+	state = calloc(1, sizeof(struct dsmcc_state));
+
+	memcpy(&state->callbacks, callbacks, sizeof(struct dsmcc_dvb_callbacks));
+
+	if (cachedir == NULL || strlen(cachedir) == 0)
+	{
+		char buffer[32];
+		sprintf(buffer, "/tmp/libdsmcc-cache-%d", getpid());
+		if (buffer[strlen(buffer) - 1] == '/')
+			buffer[strlen(buffer) - 1] = '\0';
+		state->cachedir = strdup(buffer);
+	}
+	else
+		state->cachedir = strdup(cachedir);
+	mkdir(state->cachedir, 0770);
+	state->keep_cache = keep_cache;
+
+	state->threadless = parameters && parameters->threadless;
+	if (parameters && parameters->executor && !state->threadless)
+	{
+		state->executor = parameters->executor;
+		state->workers = state->executor->workers;
+	}
+	else
+		state->workers = dsmcc_workers_new(parameters ? parameters->workers : 0);
+	if (parameters && parameters->async_callbacks)
+		state->dispatcher = dsmcc_dispatcher_new();
+
+	state->shard_count = parameters ? parameters->threads : 0;
+	if (state->shard_count < 1)
+		state->shard_count = 1;
+	else if (state->shard_count > DSMCC_MAX_SHARDS)
+		state->shard_count = DSMCC_MAX_SHARDS;
+	state->shards = calloc(state->shard_count, sizeof(struct dsmcc_shard));
+	for (i = 0; i < state->shard_count; i++)
+		init_shard(state, i);
+	state->data_table_refs[DEFAULT_SECTION_DATA_TABLE_ID] = 1;
+
+	dsmcc_section_filters_init(state);
+	pthread_mutex_init(&state->stream_pids.mutex, NULL);
+	create_pools(state);
+
+	if (keep_cache)
+		load_state(state);
+
+	pthread_mutex_init(&state->mutex, NULL);
+	if (state->threadless)
+		init_threadless(state);
+	else if (state->executor)
+	{
+		for (i = 0; i < state->shard_count; i++)
 		{
-			/* compute waiting time: next timeout or if none, infinite waiting time */
-			if (state->timeouts)
-			{
-				struct timeval *waketime;
-				struct timespec wakets;
+			state->shards[i].task.run = &run_shard_task;
+			dsmcc_executor_attach(state->executor, &state->shards[i].task);
+			dsmcc_executor_schedule(state->executor, &state->shards[i].task);
+		}
+	}
+	else
+	{
+		for (i = 0; i < state->shard_count; i++)
+			pthread_create(&state->shards[i].thread, NULL, &dsmcc_thread_func, &state->shards[i]);
+	}
 
-				waketime = &state->timeouts->abstime;
+	return state;
+}
 
-				if (dsmcc_log_enabled(DSMCC_LOG_DEBUG))
-				{
-					struct timeval curtime;
-					struct timeval waittime;
+struct dsmcc_shard *dsmcc_shard_for_pid(struct dsmcc_state *state, uint16_t pid)
+{
+	return &state->shards[pid % state->shard_count];
+}
 
-					clock_gettime(CLOCK_MONOTONIC, &ts);
-					timespec_to_timeval(&ts, &curtime);
-					timersub(waketime, &curtime, &waittime);
-					DSMCC_DEBUG("Waiting %d.%06d second(s) for wakeup", waittime.tv_sec, waittime.tv_usec);
-				}
+static void wake_thread_if_waiting(struct dsmcc_shard *shard)
+{
+	/* only wake up the thread if it is sleeping */
+	if (__atomic_exchange_n(&shard->waiting, 0, __ATOMIC_SEQ_CST))
+		wake_thread(shard);
+}
 
-				wakets.tv_sec = waketime->tv_sec;
-				wakets.tv_nsec = waketime->tv_usec * 1000;
-				pthread_cond_timedwait(&state->cond, &state->mutex, &wakets);
-			}
+/**
+  * returns true if the current thread is processing the actions of the shard, in which case it cannot wait for room
+  * in the shard queues
+  */
+static bool is_consumer(struct dsmcc_shard *shard)
+{
+	/* in threadless mode, all the shards are processed by the thread calling dsmcc_process */
+	if (shard->state->threadless)
+		return current_shard && current_shard->state == shard->state;
+	return current_shard == shard;
+}
+
+/**
+  * arm the timerfd for the earliest timeout of the shards, or the end of the wait for the background budget
+  */
+static void arm_timer(struct dsmcc_state *state)
+{
+	struct itimerspec its;
+	struct timeval *next = NULL, *wakeup, resume[DSMCC_MAX_SHARDS];
+	int i;
+
+	for (i = 0; i < state->shard_count; i++)
+	{
+		wakeup = next_wakeup_time(&state->shards[i], &resume[i]);
+		if (wakeup && (!next || timercmp(wakeup, next, <)))
+			next = wakeup;
+	}
+
+	memset(&its, 0, sizeof(its));
+	if (next)
+	{
+		its.it_value.tv_sec = next->tv_sec;
+		its.it_value.tv_nsec = next->tv_usec * 1000;
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(state->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		DSMCC_ERROR("Error while setting timerfd: %s", strerror(errno));
+}
+
+/**
+  * process the actions of all the shards in threadless mode, with the process mutex held
+  */
+static int process_all(struct dsmcc_state *state, int budget)
+{
+	struct dsmcc_shard *shard;
+	uint64_t count;
+	int i, processed = 0;
+
+	if (read(state->timer_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		DSMCC_ERROR("Error while reading timerfd: %s", strerror(errno));
+	for (i = 0; i < state->shard_count; i++)
+		if (read(state->shards[i].event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			DSMCC_ERROR("Error while reading eventfd: %s", strerror(errno));
+
+	/* start with a different shard each time, so that a busy shard does not use all the budget */
+	for (i = 0; i < state->shard_count; i++)
+	{
+		shard = &state->shards[(state->next_shard + i) % state->shard_count];
+		processed += process_shard(shard, budget > 0 ? budget - processed : DSMCC_ACTION_QUEUE_SIZE);
+	}
+	state->next_shard = (state->next_shard + 1) % state->shard_count;
+
+	arm_timer(state);
+
+	/* producers signal the eventfd when the flag is set, keep it signaled if there are actions left */
+	for (i = 0; i < state->shard_count; i++)
+	{
+		shard = &state->shards[i];
+		__atomic_store_n(&shard->waiting, 1, __ATOMIC_SEQ_CST);
+		if (!queues_empty(shard) || shard->first_deferred)
+			wake_thread_if_waiting(shard);
+	}
+
+	return processed;
+}
+
+/**
+  * in threadless mode, process the queued actions in the calling thread unless another thread is doing it, so that a
+  * producer waiting for room in a queue is not waiting for itself. Returns false if nothing was processed.
+  */
+static bool process_inline(struct dsmcc_state *state)
+{
+	if (!state->threadless || pthread_mutex_trylock(&state->process_mutex))
+		return 0;
+	process_all(state, 0);
+	pthread_mutex_unlock(&state->process_mutex);
+	return 1;
+}
+
+int dsmcc_get_fd(struct dsmcc_state *state)
+{
+	return state->threadless ? state->epoll_fd : -1;
+}
+
+int dsmcc_process(struct dsmcc_state *state, int budget)
+{
+	int processed;
+
+	if (!state->threadless)
+	{
+		DSMCC_ERROR("dsmcc_process called but the library has its own threads");
+		return 0;
+	}
+
+	pthread_mutex_lock(&state->process_mutex);
+	processed = process_all(state, budget);
+	pthread_mutex_unlock(&state->process_mutex);
+
+	return processed;
+}
+
+/**
+  * queue an action for the thread, the caller has to wake it up
+  */
+static void push_action(struct dsmcc_shard *shard, struct dsmcc_action *action)
+{
+	action->next = NULL;
+
+	while (!dsmcc_ring_push(shard->actions, action))
+	{
+		if (is_consumer(shard))
+		{
+			/* queued from a callback, the thread cannot wait for itself */
+			if (shard->last_deferred)
+				shard->last_deferred->next = action;
 			else
-			{
-				DSMCC_DEBUG("Wait indefinitely for wakeup");
-				pthread_cond_wait(&state->cond, &state->mutex);
-			}
+				shard->first_deferred = action;
+			shard->last_deferred = action;
+			return;
 		}
 
-		buffered_actions = state->first_action;
-		state->first_action = state->last_action = NULL;
+		if (__atomic_load_n(&shard->state->stop, __ATOMIC_SEQ_CST))
+		{
+			free_action(shard->state, action);
+			return;
+		}
+
+		/* queue is full, let the thread catch up */
+		if (!process_inline(shard->state))
+			sched_yield();
+	}
+}
+
+static void buffer_action(struct dsmcc_shard *shard, struct dsmcc_action *action)
+{
+	push_action(shard, action);
+	wake_thread_if_waiting(shard);
+}
+
+/**
+  * hand a module processed by a worker thread back to the shard of its carousel
+  */
+void dsmcc_shard_queue_module_job(struct dsmcc_shard *shard, struct dsmcc_module_job *job)
+{
+	struct dsmcc_action *action;
+
+	action = dsmcc_pool_zalloc(shard->state->action_pool);
+	action->type = DSMCC_ACTION_MODULE_PROCESSED;
+	action->module_processed.job = job;
+	buffer_action(shard, action);
+}
+
+/**
+  * queue a control action for every shard, the action is copied for all of them but the first one
+  */
+static void buffer_action_all(struct dsmcc_state *state, struct dsmcc_action *action)
+{
+	struct dsmcc_action *copy;
+	int i;
+
+	for (i = 1; i < state->shard_count; i++)
+	{
+		copy = dsmcc_pool_alloc(state->action_pool);
+		*copy = *action;
+		buffer_action(&state->shards[i], copy);
+	}
+	buffer_action(&state->shards[0], action);
+}
+
+/**
+  * reserve room for count sections of a total of length bytes in the DDB queue, returns false if the queue limits
+  * would be exceeded. A single section is always accepted in an empty queue, even if it is larger than max_bytes.
+  */
+static bool reserve_data_space(struct dsmcc_shard *shard, int count, uint32_t length)
+{
+	struct dsmcc_data_queue *queue = &shard->data_queue;
+	uint32_t sections, bytes, max_sections, max_bytes;
+
+	sections = __atomic_add_fetch(&queue->queued_sections, count, __ATOMIC_SEQ_CST);
+	bytes = __atomic_add_fetch(&queue->queued_bytes, length, __ATOMIC_SEQ_CST);
+	max_sections = __atomic_load_n(&queue->max_sections, __ATOMIC_RELAXED);
+	max_bytes = __atomic_load_n(&queue->max_bytes, __ATOMIC_RELAXED);
+
+	if (sections > 1 && (sections > max_sections || (max_bytes && bytes > max_bytes)))
+	{
+		__atomic_sub_fetch(&queue->queued_sections, count, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&queue->queued_bytes, length, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+
+	return 1;
+}
+
+static bool has_data_space(struct dsmcc_shard *shard, int length)
+{
+	struct dsmcc_data_queue *queue = &shard->data_queue;
+	uint32_t sections, bytes, max_bytes;
+
+	sections = __atomic_load_n(&queue->queued_sections, __ATOMIC_SEQ_CST);
+	bytes = __atomic_load_n(&queue->queued_bytes, __ATOMIC_SEQ_CST);
+	max_bytes = __atomic_load_n(&queue->max_bytes, __ATOMIC_RELAXED);
+
+	return !sections || (sections < __atomic_load_n(&queue->max_sections, __ATOMIC_RELAXED) && (!max_bytes || bytes + length <= max_bytes));
+}
+
+static void wait_for_data_space(struct dsmcc_shard *shard, int length)
+{
+	struct dsmcc_data_queue *queue = &shard->data_queue;
+
+	__atomic_add_fetch(&queue->blocked, 1, __ATOMIC_RELAXED);
+
+	/* sections queued by the caller before this one may not have woken up the thread yet */
+	wake_thread_if_waiting(shard);
+
+	pthread_mutex_lock(&queue->mutex);
+	__atomic_add_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+	while (!has_data_space(shard, length) && !__atomic_load_n(&shard->state->stop, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+	__atomic_sub_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+static bool is_background_pid(struct dsmcc_shard *shard, uint16_t pid)
+{
+	return (__atomic_load_n(&shard->background_pid_map[pid >> 3], __ATOMIC_RELAXED) >> (pid & 7)) & 1;
+}
+
+/**
+  * drop the oldest section of the ring to make room in the DDB queue, returns false if the ring is empty
+  */
+static bool drop_oldest_data_action(struct dsmcc_shard *shard, struct dsmcc_ring *ring)
+{
+	struct dsmcc_action *oldest;
+
+	oldest = dsmcc_ring_pop(ring);
+	if (!oldest)
+		return 0;
+
+	DSMCC_DEBUG("DDB queue full, dropping oldest section");
+	release_data_space(shard, 1, oldest->add_section.section->length);
+	__atomic_add_fetch(&shard->data_queue.dropped_oldest, 1, __ATOMIC_RELAXED);
+	free_action(shard->state, oldest);
+	return 1;
+}
+
+/**
+  * queue a DDB section for the thread, applying the limits and policy of the DDB queue. The sections of the background
+  * carousels are dropped first when the queue is full, and never block the producer. The caller has to wake up the
+  * thread.
+  */
+static void push_data_action(struct dsmcc_shard *shard, struct dsmcc_action *action)
+{
+	struct dsmcc_data_queue *queue = &shard->data_queue;
+	int length = action->add_section.section->length;
+	bool background = is_background_pid(shard, action->add_section.section->pid);
+	int policy;
+
+	action->next = NULL;
+
+	while (1)
+	{
+		if (reserve_data_space(shard, 1, length))
+		{
+			if (dsmcc_ring_push(background ? queue->background_ring : queue->ring, action))
+				return;
+			release_data_space(shard, 1, length);
+		}
+
+		if (__atomic_load_n(&shard->state->stop, __ATOMIC_SEQ_CST))
+		{
+			free_action(shard->state, action);
+			return;
+		}
+
+		policy = __atomic_load_n(&queue->policy, __ATOMIC_RELAXED);
+		if (background)
+		{
+			if (policy == DSMCC_QUEUE_POLICY_DROP_OLDEST && drop_oldest_data_action(shard, queue->background_ring))
+				continue;
+			policy = DSMCC_QUEUE_POLICY_DROP_NEWEST;
+		}
+		else if (drop_oldest_data_action(shard, queue->background_ring))
+			continue;
+
+		switch (policy)
+		{
+			case DSMCC_QUEUE_POLICY_DROP_OLDEST:
+				drop_oldest_data_action(shard, queue->ring);
+				break;
+			case DSMCC_QUEUE_POLICY_BLOCK:
+				/* queued from a callback, the thread cannot wait for itself */
+				if (!is_consumer(shard))
+				{
+					if (!process_inline(shard->state))
+						wait_for_data_space(shard, length);
+					break;
+				}
+				/* fall through */
+			default:
+				DSMCC_DEBUG("DDB queue full, dropping new section");
+				__atomic_add_fetch(&queue->dropped_newest, 1, __ATOMIC_RELAXED);
+				free_action(shard->state, action);
+				return;
+		}
+	}
+}
+
+static bool is_data_table_id(struct dsmcc_state *state, uint8_t table_id)
+{
+	return __atomic_load_n(&state->data_table_refs[table_id], __ATOMIC_RELAXED) &&
+		!__atomic_load_n(&state->control_table_refs[table_id], __ATOMIC_RELAXED);
+}
+
+/**
+  * called by the parsing threads when a request is added (delta is 1) or removed (delta is -1), with the table IDs of
+  * its carousel
+  */
+void dsmcc_table_ids_update(struct dsmcc_state *state, uint8_t control_table_id, uint8_t data_table_id, int delta)
+{
+	__atomic_add_fetch(&state->control_table_refs[control_table_id], delta, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&state->data_table_refs[data_table_id], delta, __ATOMIC_RELAXED);
+}
+
+static bool is_data_section(struct dsmcc_state *state, struct dsmcc_section *section)
+{
+	return section->length >= 1 && is_data_table_id(state, section->data[0]);
+}
+
+/**
+  * returns the smallest size class that can hold length bytes
+  */
+static int section_size_class(int length)
+{
+	int i;
+
+	for (i = 0; i < DSMCC_SECTION_SIZE_CLASS_COUNT - 1; i++)
+		if (length <= section_sizes[i])
+			break;
+
+	return i;
+}
+
+/**
+  * Getting a buffer and queueing its action take no lock, the pool and the rings are lock-free. Only growing a pool
+  * takes its mutex and allocates, and a producer only waits on the mutex of the DDB queue when it is full with
+  * DSMCC_QUEUE_POLICY_BLOCK. Sections larger than the largest size class are allocated with malloc.
+  */
+struct dsmcc_section_buffer *dsmcc_section_buffer_get(struct dsmcc_state *state, int length)
+{
+	struct dsmcc_section_buffer *buffer;
+	int i = section_size_class(length);
+
+	buffer = dsmcc_pool_alloc(state->section_pools[i]);
+	buffer->pool = state->section_pools[i];
+	buffer->size = section_sizes[i];
+
+	return buffer;
+}
+
+void dsmcc_section_buffer_put(struct dsmcc_section_buffer *buffer)
+{
+	dsmcc_pool_free(buffer->pool, buffer);
+}
+
+static struct dsmcc_action *init_section_buffer_action(struct dsmcc_section_buffer *buffer, uint16_t pid, int length, bool crc_checked)
+{
+	buffer->section.pid = pid;
+	buffer->section.data = buffer->data;
+	buffer->section.length = length;
+	buffer->section.crc_checked = crc_checked;
+
+	buffer->action.type = DSMCC_ACTION_ADD_SECTION;
+	buffer->action.add_section.section = &buffer->section;
+	buffer->action.add_section.buffer = buffer;
+	buffer->action.next = NULL;
+
+	return &buffer->action;
+}
+
+/**
+  * returns an action for a section too large for the section pools
+  */
+static struct dsmcc_action *new_large_section_action(struct dsmcc_state *state, uint16_t pid, const uint8_t *data, int data_length, bool crc_checked)
+{
+	struct dsmcc_section *sect;
+	struct dsmcc_action *action;
+
+	sect = malloc(sizeof(struct dsmcc_section) + data_length);
+	sect->pid = pid;
+	sect->data = ((uint8_t *) sect) + sizeof(struct dsmcc_section);
+	memcpy(sect->data, data, data_length);
+	sect->length = data_length;
+	sect->crc_checked = crc_checked;
+
+	action = dsmcc_pool_zalloc(state->action_pool);
+	action->type = DSMCC_ACTION_ADD_SECTION;
+	action->add_section.section = sect;
+
+	return action;
+}
+
+/**
+  * returns an action with a copy of the section
+  */
+static struct dsmcc_action *copy_section_action(struct dsmcc_state *state, struct dsmcc_section *section)
+{
+	struct dsmcc_section_buffer *buffer;
+
+	if (section->length > DSMCC_SECTION_MAX_SIZE)
+		return new_large_section_action(state, section->pid, section->data, section->length, section->crc_checked);
 
-		pthread_mutex_unlock(&state->mutex);
+	buffer = dsmcc_section_buffer_get(state, section->length);
+	memcpy(buffer->data, section->data, section->length);
+	return init_section_buffer_action(buffer, section->pid, section->length, section->crc_checked);
+}
 
-		/* stop is requested, quit thread immediately */
-		if (state->stop)
-			break;
+static void queue_shard_section_action(struct dsmcc_shard *shard, struct dsmcc_action *action)
+{
+	if (is_data_section(shard->state, action->add_section.section))
+		push_data_action(shard, action);
+	else
+		push_action(shard, action);
+	wake_thread_if_waiting(shard);
+}
 
-		/* handle all buffered actions */
-		while (buffered_actions && !state->stop)
-		{
-			struct dsmcc_action *action = buffered_actions;
-			buffered_actions = buffered_actions->next;
-			switch (action->type)
-			{
-				case DSMCC_ACTION_ADD_CAROUSEL:
-					DSMCC_DEBUG("Adding carousel to queue, PID 0x%04x queue_id %u",
-							action->add_carousel.parameters->pid, action->add_carousel.queue_id);
-					dsmcc_object_carousel_queue_add(state, action->add_carousel.queue_id,
-							action->add_carousel.parameters, &action->add_carousel.callbacks);
-					free(action->add_carousel.parameters->downloadpath);
-					free(action->add_carousel.parameters);
-					break;
-				case DSMCC_ACTION_REMOVE_CAROUSEL:
-					DSMCC_DEBUG("Removing carousel from queue, queue_id %u", action->remove_carousel.queue_id);
-					dsmcc_object_carousel_queue_remove(state, action->remove_carousel.queue_id);
-					break;
-				case DSMCC_ACTION_ADD_SECTION:
-					DSMCC_DEBUG("Parsing a section for PID 0x%04x size %d", action->add_section.section->pid,
-							action->add_section.section->length);
-					dsmcc_parse_section(state, action->add_section.section);
-					free(action->add_section.section);
-					break;
-				case DSMCC_ACTION_CACHE_CLEAR:
-					DSMCC_DEBUG("Clearing all cache");
-					dsmcc_object_carousel_free_all(state, 0);
-					break;
-				case DSMCC_ACTION_CACHE_CLEAR_CAROUSEL:
-					DSMCC_DEBUG("Clearing cache for carousel 0x%08x", action->cache_clear_carousel.carousel_id);
-					clear_single_carousel(state, action->cache_clear_carousel.carousel_id);
-					break;
-				default:
-					break;
-			}
-			free(action);
-		}
-		if (buffered_actions)
-		{
-			// put back unprocessed actions
-			struct dsmcc_action *first_action = buffered_actions;
-			while (buffered_actions->next)
-				buffered_actions = buffered_actions->next;
-			pthread_mutex_lock(&state->mutex);
-			buffered_actions->next = state->first_action;
-			state->first_action = first_action;
-			pthread_mutex_unlock(&state->mutex);
-		}
+static bool shard_has_pid(struct dsmcc_shard *shard, uint16_t pid)
+{
+	return (__atomic_load_n(&shard->pid_map[pid >> 3], __ATOMIC_RELAXED) >> (pid & 7)) & 1;
+}
 
-		/* handle expired timeouts */
-		if (!state->stop)
-		{
-			struct dsmcc_timeout *prevtimeout, *timeout, *nexttimeout;
+/**
+  * fill the shards array with the shards that need the sections of the PID: those with a stream on the PID or, if
+  * there is none, the shard of the carousels requested on the PID. Returns the number of shards.
+  */
+static int route_pid(struct dsmcc_state *state, uint16_t pid, struct dsmcc_shard **shards)
+{
+	int i, count = 0;
 
-			DSMCC_DEBUG("Current timeouts:");
-			timeout = state->timeouts;
-			prevtimeout = NULL;
-			while (timeout)
-			{
-				struct timeval curtime;
+	if (state->shard_count > 1)
+	{
+		for (i = 0; i < state->shard_count; i++)
+			if (shard_has_pid(&state->shards[i], pid))
+				shards[count++] = &state->shards[i];
+	}
+	if (!count)
+		shards[count++] = dsmcc_shard_for_pid(state, pid);
 
-				clock_gettime(CLOCK_MONOTONIC, &ts);
-				timespec_to_timeval(&ts, &curtime);
+	return count;
+}
 
-				if (dsmcc_log_enabled(DSMCC_LOG_DEBUG))
-				{
-					struct timeval waittime;
-					timersub(&timeout->abstime, &curtime, &waittime);
-					DSMCC_DEBUG("CID 0x%08x DELAY %d.%06d TYPE %d MODULE_ID 0x%04hhx", timeout->carousel->cid, waittime.tv_sec, waittime.tv_usec, timeout->type, timeout->module_id);
-				}
+/**
+  * returns the mask of the shards of the array that need the section: all of them, except for a DDB section of a block
+  * the shard already has, see dsmcc-ddb-index.h
+  */
+static uint64_t shards_needing_section(struct dsmcc_state *state, struct dsmcc_shard **shards, int count, const uint8_t *data, int length)
+{
+	uint64_t mask = 0;
+	int i;
 
-				nexttimeout = timeout->next;
-				if (timercmp(&timeout->abstime, &curtime, <))
-				{
-					dsmcc_object_carousel_set_status(timeout->carousel, DSMCC_STATUS_TIMEDOUT);
-					dsmcc_filecache_notify_status(timeout->carousel, NULL);
-
-					/* remove timeout */
-					if (prevtimeout)
-						prevtimeout->next = timeout->next;
-					else
-						state->timeouts = timeout->next;
-					free(timeout);
-				}
-				timeout = nexttimeout;
-			}
-		}
+	if (length < 1 || !is_data_table_id(state, data[0]))
+		return ~0ULL;
 
-		save_state(state);
+	for (i = 0; i < count; i++)
+	{
+		if (dsmcc_ddb_index_known(&shards[i]->ddb_index, data, length))
+			__atomic_add_fetch(&shards[i]->data_queue.dropped_known, 1, __ATOMIC_RELAXED);
+		else
+			mask |= 1ULL << i;
 	}
 
-	pthread_exit(0);
+	return mask;
 }
 
-struct dsmcc_state *dsmcc_open(const char *cachedir, bool keep_cache, struct dsmcc_dvb_callbacks *callbacks)
+/**
+  * fill the shards array with the shards that need the section, returns their number
+  */
+static int route_section(struct dsmcc_state *state, uint16_t pid, const uint8_t *data, int length, struct dsmcc_shard **shards)
 {
-	struct dsmcc_state *state = NULL;
+	uint64_t mask;
+	int i, count, needed = 0;
 
-	state = calloc(1, sizeof(struct dsmcc_state));
+	count = route_pid(state, pid, shards);
+	mask = shards_needing_section(state, shards, count, data, length);
+	for (i = 0; i < count; i++)
+		if ((mask >> i) & 1)
+			shards[needed++] = shards[i];
 
-	memcpy(&state->callbacks, callbacks, sizeof(struct dsmcc_dvb_callbacks));
+	return needed;
+}
 
-	if (cachedir == NULL || strlen(cachedir) == 0)
+static void queue_section_action(struct dsmcc_state *state, struct dsmcc_action *action, struct dsmcc_shard **shards, int count)
+{
+	struct dsmcc_section *section = action->add_section.section;
+	int i;
+
+	/* the other shards get a copy, queued before the action as its data may be released once it is queued */
+	for (i = 1; i < count; i++)
+		queue_shard_section_action(shards[i], copy_section_action(state, section));
+	queue_shard_section_action(shards[0], action);
+}
+
+void dsmcc_set_queue_limits(struct dsmcc_state *state, uint32_t max_sections, uint32_t max_bytes, int policy)
+{
+	struct dsmcc_data_queue *queue;
+	int i;
+
+	if (!max_sections || max_sections > DSMCC_DATA_QUEUE_SIZE)
+		max_sections = DSMCC_DATA_QUEUE_SIZE;
+	if (policy != DSMCC_QUEUE_POLICY_DROP_OLDEST && policy != DSMCC_QUEUE_POLICY_DROP_NEWEST)
+		policy = DSMCC_QUEUE_POLICY_BLOCK;
+
+	for (i = 0; i < state->shard_count; i++)
 	{
-		char buffer[32];
-		sprintf(buffer, "/tmp/libdsmcc-cache-%d", getpid());
-		if (buffer[strlen(buffer) - 1] == '/')
-			buffer[strlen(buffer) - 1] = '\0';
-		state->cachedir = strdup(buffer);
-	}
-	else
-		state->cachedir = strdup(cachedir);
-	mkdir(state->cachedir, 0770);
-	state->keep_cache = keep_cache;
+		queue = &state->shards[i].data_queue;
 
-	state->cachefile = malloc(strlen(state->cachedir) + 7);
-	sprintf(state->cachefile, "%s/state", state->cachedir);
+		__atomic_store_n(&queue->max_sections, max_sections, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&queue->max_bytes, max_bytes, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&queue->policy, policy, __ATOMIC_SEQ_CST);
 
-	if (keep_cache)
-		load_state(state);
+		/* limits may have been raised, or the policy changed, wake up the waiting producers */
+		pthread_mutex_lock(&queue->mutex);
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->mutex);
+	}
+}
 
-	pthread_mutex_init(&state->mutex, NULL);
-	pthread_cond_init(&state->cond, NULL);
-	pthread_create(&state->thread, NULL, &dsmcc_thread_func, state);
+void dsmcc_set_background_budget(struct dsmcc_state *state, uint32_t bytes_per_second)
+{
+	int i;
 
-	return state;
+	__atomic_store_n(&state->background_budget, bytes_per_second, __ATOMIC_SEQ_CST);
+
+	/* the threads may be waiting for the previous budget */
+	for (i = 0; i < state->shard_count; i++)
+		wake_thread_if_waiting(&state->shards[i]);
 }
 
-static void buffer_action(struct dsmcc_state *state, struct dsmcc_action *action)
+void dsmcc_set_crc_check(struct dsmcc_state *state, int mode)
 {
-	pthread_mutex_lock(&state->mutex);
+	if (mode != DSMCC_CRC_CHECK_PRODUCER && mode != DSMCC_CRC_CHECK_NONE)
+		mode = DSMCC_CRC_CHECK_PARSER;
+
+	/* the sections already queued keep the mode they were added with */
+	__atomic_store_n(&state->crc_check, mode, __ATOMIC_SEQ_CST);
+}
 
-	if (state->last_action)
-		state->last_action->next = action;
-	state->last_action = action;
-	if (!state->first_action)
-		state->first_action = action;
+void dsmcc_get_queue_stats(struct dsmcc_state *state, struct dsmcc_queue_stats *stats)
+{
+	struct dsmcc_data_queue *queue;
+	int i;
 
-	pthread_cond_signal(&state->cond);
-	pthread_mutex_unlock(&state->mutex);
+	memset(stats, 0, sizeof(struct dsmcc_queue_stats));
+	for (i = 0; i < state->shard_count; i++)
+	{
+		queue = &state->shards[i].data_queue;
+
+		stats->queued_sections += __atomic_load_n(&queue->queued_sections, __ATOMIC_RELAXED);
+		stats->queued_bytes += __atomic_load_n(&queue->queued_bytes, __ATOMIC_RELAXED);
+		stats->dropped_oldest += __atomic_load_n(&queue->dropped_oldest, __ATOMIC_RELAXED);
+		stats->dropped_newest += __atomic_load_n(&queue->dropped_newest, __ATOMIC_RELAXED);
+		stats->dropped_known += __atomic_load_n(&queue->dropped_known, __ATOMIC_RELAXED);
+		stats->blocked += __atomic_load_n(&queue->blocked, __ATOMIC_RELAXED);
+	}
 }
 
-struct dsmcc_stream *dsmcc_stream_find_by_pid(struct dsmcc_state *state, uint16_t pid)
+struct dsmcc_stream *dsmcc_stream_find_by_pid(struct dsmcc_shard *shard, uint16_t pid)
 {
 	struct dsmcc_stream *str;
 
-	for (str = state->streams; str; str = str->next)
+	for (str = shard->streams; str; str = str->next)
 	{
 		if (str->pid == pid)
 			break;
@@ -322,15 +1358,16 @@ void dsmcc_stream_add_assoc_tag(struct dsmcc_stream *stream, uint16_t assoc_tag)
 	DSMCC_DEBUG("Added assoc_tag 0x%hx to stream with pid 0x%hx", assoc_tag, stream->pid);
 }
 
-static struct dsmcc_stream *find_stream(struct dsmcc_state *state, int stream_selector_type, uint16_t stream_selector, uint16_t default_pid, bool create_if_missing)
+static struct dsmcc_stream *find_stream(struct dsmcc_shard *shard, int stream_selector_type, uint16_t stream_selector, uint16_t default_pid, bool create_if_missing)
 {
+	struct dsmcc_state *state = shard->state;
 	struct dsmcc_stream *str;
 	uint16_t pid;
 	int ret;
 
 	if (stream_selector_type == DSMCC_STREAM_SELECTOR_ASSOC_TAG)
 	{
-		str = find_stream_by_assoc_tag(state->streams, stream_selector);
+		str = find_stream_by_assoc_tag(shard->streams, stream_selector);
 		if (str)
 		{
 			//ugly extra check in case assoc_tag isn't unique
@@ -366,15 +1403,15 @@ static struct dsmcc_stream *find_stream(struct dsmcc_state *state, int stream_se
 		return NULL;
 	}
 
-	str = dsmcc_stream_find_by_pid(state, pid);
+	str = dsmcc_stream_find_by_pid(shard, pid);
 	if (!str && create_if_missing)
 	{
 		str = calloc(1, sizeof(struct dsmcc_stream));
 		str->pid = pid;
-		str->next = state->streams;
+		str->next = shard->streams;
 		if (str->next)
 			str->next->prev = str;
-		state->streams = str;
+		shard->streams = str;
 	}
 
 	if (str && stream_selector_type == DSMCC_STREAM_SELECTOR_ASSOC_TAG)
@@ -383,18 +1420,95 @@ static struct dsmcc_stream *find_stream(struct dsmcc_state *state, int stream_se
 	return str;
 }
 
+static bool is_background_stream(struct dsmcc_stream *stream)
+{
+	struct dsmcc_queue_entry *entry;
+
+	for (entry = stream->queue; entry; entry = entry->next)
+		if (entry->carousel->priority != DSMCC_PRIORITY_BACKGROUND)
+			return 0;
+	return 1;
+}
+
+/**
+  * Publish the PIDs of the streams of the shard that have queued requests, used to route the sections to the shard,
+  * and the PIDs of all the shards for the TS parser, if they changed. The PIDs where all the requests are for
+  * background carousels are published too, to queue their DDB sections apart.
+  */
+void dsmcc_stream_pids_update(struct dsmcc_shard *shard)
+{
+	struct dsmcc_state *state = shard->state;
+	struct dsmcc_stream *str;
+	uint8_t map[DSMCC_PID_MAP_SIZE], background_map[DSMCC_PID_MAP_SIZE];
+	int i, j;
+
+	memset(map, 0, DSMCC_PID_MAP_SIZE);
+	memset(background_map, 0, DSMCC_PID_MAP_SIZE);
+	for (str = shard->streams; str; str = str->next)
+	{
+		if (!str->queue)
+			continue;
+		map[str->pid >> 3] |= 1 << (str->pid & 7);
+		if (is_background_stream(str))
+			background_map[str->pid >> 3] |= 1 << (str->pid & 7);
+	}
+	/* another stream can be on the same PID */
+	for (str = shard->streams; str; str = str->next)
+		if (str->queue && !is_background_stream(str))
+			background_map[str->pid >> 3] &= ~(1 << (str->pid & 7));
+
+	for (i = 0; i < DSMCC_PID_MAP_SIZE; i++)
+		if (background_map[i] != shard->background_pid_map[i])
+			__atomic_store_n(&shard->background_pid_map[i], background_map[i], __ATOMIC_RELAXED);
+
+	if (!memcmp(map, shard->pid_map, DSMCC_PID_MAP_SIZE))
+		return;
+	for (i = 0; i < DSMCC_PID_MAP_SIZE; i++)
+		__atomic_store_n(&shard->pid_map[i], map[i], __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&state->stream_pids.mutex);
+	for (i = 0; i < state->shard_count; i++)
+	{
+		if (&state->shards[i] == shard)
+			continue;
+		for (j = 0; j < DSMCC_PID_MAP_SIZE; j++)
+			map[j] |= __atomic_load_n(&state->shards[i].pid_map[j], __ATOMIC_RELAXED);
+	}
+	if (memcmp(map, state->stream_pids.map, DSMCC_PID_MAP_SIZE))
+	{
+		memcpy(state->stream_pids.map, map, DSMCC_PID_MAP_SIZE);
+		__atomic_add_fetch(&state->stream_pids.generation, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&state->stream_pids.mutex);
+}
+
+/**
+  * Copy the bitmap of the PIDs of the streams that have queued requests, returns its generation number
+  */
+uint32_t dsmcc_stream_pids_get(struct dsmcc_state *state, uint8_t *map)
+{
+	uint32_t generation;
+
+	pthread_mutex_lock(&state->stream_pids.mutex);
+	memcpy(map, state->stream_pids.map, DSMCC_PID_MAP_SIZE);
+	generation = state->stream_pids.generation;
+	pthread_mutex_unlock(&state->stream_pids.mutex);
+
+	return generation;
+}
+
 struct dsmcc_stream *dsmcc_stream_queue_add(struct dsmcc_object_carousel *carousel, int stream_selector_type, uint16_t stream_selector, int type, uint32_t id)
 {
 	struct dsmcc_stream *str;
 	struct dsmcc_queue_entry *entry;
 
-	str = find_stream(carousel->state, stream_selector_type, stream_selector, carousel->requested_pid, 1);
+	str = find_stream(carousel->shard, stream_selector_type, stream_selector, carousel->requested_pid, 1);
 	if (str)
 	{
 		if (dsmcc_stream_queue_find(str, type, id))
 			return str;
 
-		entry = calloc(1, sizeof(struct dsmcc_queue_entry));
+		entry = dsmcc_pool_zalloc(carousel->state->queue_entry_pool);
 		entry->stream = str;
 		entry->carousel = carousel;
 		entry->type = type;
@@ -405,6 +1519,8 @@ struct dsmcc_stream *dsmcc_stream_queue_add(struct dsmcc_object_carousel *carous
 		if (entry->next)
 			entry->next->prev = entry;
 		str->queue = entry;
+
+		dsmcc_stream_pids_update(carousel->shard);
 	}
 
 	return str;
@@ -436,7 +1552,7 @@ void dsmcc_stream_queue_remove(struct dsmcc_object_carousel *carousel, int type)
 	struct dsmcc_stream *stream;
 	struct dsmcc_queue_entry *entry, *next;
 
-	stream = carousel->state->streams;
+	stream = carousel->shard->streams;
 	while (stream)
 	{
 		entry = stream->queue;
@@ -451,199 +1567,427 @@ void dsmcc_stream_queue_remove(struct dsmcc_object_carousel *carousel, int type)
 					entry->stream->queue = entry->next;
 				if (entry->next)
 					entry->next->prev = entry->prev;
-				free(entry);
+				dsmcc_pool_free(carousel->state->queue_entry_pool, entry);
 			}
 			entry = next;
 		}
 		stream = stream->next;
 	}
+
+	dsmcc_stream_pids_update(carousel->shard);
 }
 
-static void free_queue_entries(struct dsmcc_queue_entry *entry)
+static void free_queue_entries(struct dsmcc_state *state, struct dsmcc_queue_entry *entry)
 {
 	while (entry)
 	{
 		struct dsmcc_queue_entry *next = entry->next;
-		free(entry);
+		dsmcc_pool_free(state->queue_entry_pool, entry);
 		entry = next;
 	}
 }
 
-static void free_all_streams(struct dsmcc_state *state)
+static void free_all_streams(struct dsmcc_shard *shard)
 {
-	struct dsmcc_stream *stream = state->streams;
+	struct dsmcc_stream *stream = shard->streams;
 	while (stream)
 	{
 		struct dsmcc_stream *next = stream->next;
 		if (stream->assoc_tags)
 			free(stream->assoc_tags);
-		free_queue_entries(stream->queue);
+		free_queue_entries(shard->state, stream->queue);
 		free(stream);
 		stream = next;
 	}
+	shard->streams = NULL;
 }
 
-void dsmcc_close(struct dsmcc_state *state)
+static void free_shard(struct dsmcc_shard *shard)
 {
-	struct dsmcc_action *nextaction;
+	struct dsmcc_state *state = shard->state;
+	struct dsmcc_action *action, *nextaction;
 	int count;
 
+	count = 0;
+	while (shard->first_deferred)
+	{
+		nextaction = shard->first_deferred->next;
+		free_action(state, shard->first_deferred);
+		shard->first_deferred = nextaction;
+		count++;
+	}
+	while ((action = next_queued_action(shard)))
+	{
+		free_action(state, action);
+		count++;
+	}
+	/* the background sections over the budget are not returned by next_queued_action */
+	if (shard->next_background_action)
+	{
+		free_action(state, shard->next_background_action);
+		count++;
+	}
+	while ((action = dsmcc_ring_pop(shard->data_queue.background_ring)))
+	{
+		free_action(state, action);
+		count++;
+	}
+	DSMCC_DEBUG("Dropped %d action(s) buffered but not parsed by shard %d", count, shard->index);
+	dsmcc_ring_free(shard->actions);
+	dsmcc_ring_free(shard->data_queue.ring);
+	dsmcc_ring_free(shard->data_queue.background_ring);
+	pthread_mutex_destroy(&shard->data_queue.mutex);
+	pthread_cond_destroy(&shard->data_queue.cond);
+	close(shard->event_fd);
+
+	dsmcc_object_carousel_free_all(shard, state->keep_cache);
+	free_all_streams(shard);
+	dsmcc_timeouts_free(&shard->timeouts);
+	dsmcc_snapshot_free_all(shard);
+	dsmcc_ddb_index_free(&shard->ddb_index);
+
+	if (!state->keep_cache)
+		unlink(shard->cachefile);
+	free(shard->cachefile);
+}
+
+void dsmcc_close(struct dsmcc_state *state)
+{
+	struct dsmcc_shard *shard;
+	int i;
+
 	if (!state)
 		return;
 
 	DSMCC_DEBUG("Sending stop signal");
-	pthread_mutex_lock(&state->mutex);
-	state->stop = 1;
-	pthread_cond_signal(&state->cond);
-	pthread_mutex_unlock(&state->mutex);
-	DSMCC_DEBUG("Waiting for thread to terminate");
-	pthread_join(state->thread, NULL);
-
-	count = 0;
-	while (state->first_action)
+	__atomic_store_n(&state->stop, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < state->shard_count; i++)
+	{
+		shard = &state->shards[i];
+		wake_thread(shard);
+		pthread_mutex_lock(&shard->data_queue.mutex);
+		pthread_cond_broadcast(&shard->data_queue.cond);
+		pthread_mutex_unlock(&shard->data_queue.mutex);
+	}
+	if (state->executor)
+	{
+		DSMCC_DEBUG("Waiting for the executor to release the shards");
+		for (i = 0; i < state->shard_count; i++)
+			dsmcc_executor_detach(state->executor, &state->shards[i].task);
+		/* the jobs still running are finished and handed back to the shards, which drop them */
+		dsmcc_workers_cancel(state->workers, state);
+	}
+	else
 	{
-		nextaction = state->first_action->next;
-		switch (state->first_action->type)
+		if (!state->threadless)
 		{
-			case DSMCC_ACTION_ADD_CAROUSEL:
-				free(state->first_action->add_carousel.parameters->downloadpath);
-				free(state->first_action->add_carousel.parameters);
-				break;
-			case DSMCC_ACTION_ADD_SECTION:
-				free(state->first_action->add_section.section);
-				break;
+			DSMCC_DEBUG("Waiting for threads to terminate");
+			for (i = 0; i < state->shard_count; i++)
+				pthread_join(state->shards[i].thread, NULL);
 		}
-		free(state->first_action);
-		state->first_action = nextaction;
-		count++;
+		/* the jobs still running are finished and handed back to the shards, which drop them */
+		dsmcc_workers_free(state->workers);
 	}
-	DSMCC_DEBUG("Dropped %d action(s) buffered but not parsed", count);
 
-	dsmcc_object_carousel_free_all(state, state->keep_cache);
-	state->carousels = NULL;
+	for (i = 0; i < state->shard_count; i++)
+		free_shard(&state->shards[i]);
+	free(state->shards);
 
-	free_all_streams(state);
-	state->streams = NULL;
+	/* deliver the last notifications, including the ones of the carousels freed above */
+	dsmcc_dispatcher_free(state->dispatcher);
 
-	if (!state->keep_cache)
+	if (state->threadless)
 	{
-		unlink(state->cachefile);
-		rmdir(state->cachedir);
+		close(state->epoll_fd);
+		close(state->timer_fd);
+		pthread_mutex_destroy(&state->process_mutex);
 	}
 
-	free(state->cachefile);
+	if (!state->keep_cache)
+		rmdir(state->cachedir);
+
+	dsmcc_section_filters_free(state);
+	pthread_mutex_destroy(&state->stream_pids.mutex);
+	close_pools(state);
+
 	free(state->cachedir);
 	free(state);
 }
 
+/**
+  * the DSI and DII timeouts are identified by the carousel and type only
+  */
+static uint16_t timeout_module_id(int type, uint16_t module_id)
+{
+	return (type == DSMCC_TIMEOUT_MODULE || type == DSMCC_TIMEOUT_NEXTBLOCK) ? module_id : 0;
+}
+
 void dsmcc_timeout_set(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id, uint32_t delay_us)
 {
+	struct dsmcc_shard *shard = carousel->shard;
 	struct dsmcc_timeout *timeout;
-	struct dsmcc_timeout *current, *next;
-	struct timeval now, delay;
-	struct timespec ts;
-
-	dsmcc_timeout_remove(carousel, type, module_id);
+	struct timeval now, delay, abstime;
 
+	module_id = timeout_module_id(type, module_id);
 	if (!delay_us)
+	{
+		dsmcc_timeout_remove(carousel, type, module_id);
+		return;
+	}
+
+	/* the time of the current processing pass is precise enough, and saves a clock read for each DDB block */
+	if (current_shard == shard)
+		now = shard->now;
+	else
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		timespec_to_timeval(&ts, &now);
+	}
+
+	delay.tv_sec = delay_us / 1000000;
+	delay.tv_usec = delay_us - delay.tv_sec * 1000000;
+	timeradd(&now, &delay, &abstime);
+
+	timeout = dsmcc_timeouts_find(&shard->timeouts, carousel, type, module_id);
+	if (timeout)
+	{
+		timeout->deadline = abstime;
+		/* a later expiry time is only checked when the timeout expires, the next block timeout is extended for each
+		 * block received */
+		if (timercmp(&abstime, &timeout->abstime, <))
+		{
+			timeout->abstime = abstime;
+			dsmcc_timeouts_update(&shard->timeouts, timeout);
+		}
 		return;
+	}
 
 	DSMCC_DEBUG("Adding timeout for carousel 0x%08x type %d module id 0x%04hhx delay %uus", carousel->cid, type, module_id, delay_us);
 
-	timeout = malloc(sizeof(struct dsmcc_timeout));
+	timeout = dsmcc_pool_alloc(carousel->state->timeout_pool);
 	timeout->carousel = carousel;
 	timeout->type = type;
 	timeout->module_id = module_id;
+	timeout->abstime = abstime;
+	timeout->deadline = abstime;
+	dsmcc_timeouts_add(&shard->timeouts, timeout);
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	timespec_to_timeval(&ts, &now);
+void dsmcc_timeout_remove(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id)
+{
+	struct dsmcc_timeout *timeout;
 
-	delay.tv_sec = delay_us / 1000000;
-	delay.tv_usec = delay_us - delay.tv_sec * 1000000;
-	timeradd(&now, &delay, &timeout->abstime);
+	timeout = dsmcc_timeouts_find(&carousel->shard->timeouts, carousel, type, timeout_module_id(type, module_id));
+	if (timeout)
+	{
+		dsmcc_timeouts_remove(&carousel->shard->timeouts, timeout);
+		dsmcc_pool_free(carousel->state->timeout_pool, timeout);
+	}
+}
+
+void dsmcc_timeout_remove_all(struct dsmcc_object_carousel *carousel)
+{
+	struct dsmcc_timeout *timeout, *next;
 
-	current = NULL;
-	next = carousel->state->timeouts;
-	while (next && timercmp(&next->abstime, &timeout->abstime, <))
+	timeout = dsmcc_timeouts_remove_carousel(&carousel->shard->timeouts, carousel);
+	while (timeout)
 	{
-		current = next;
-		next = current->next;
+		next = timeout->next;
+		dsmcc_pool_free(carousel->state->timeout_pool, timeout);
+		timeout = next;
 	}
-	timeout->next = next;
-	if (current)
-		current->next = timeout;
-	else
-		carousel->state->timeouts = timeout;
 }
 
-void dsmcc_timeout_remove(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id)
+/**
+  * returns true if the CRC of the sections is checked before they are queued, see dsmcc_set_crc_check
+  */
+static bool producer_checks_crc(struct dsmcc_state *state)
 {
-	struct dsmcc_timeout *current, *prev;
+	return __atomic_load_n(&state->crc_check, __ATOMIC_RELAXED) == DSMCC_CRC_CHECK_PRODUCER;
+}
+
+void dsmcc_section_buffer_queue(struct dsmcc_state *state, struct dsmcc_section_buffer *buffer, uint16_t pid, int length)
+{
+	struct dsmcc_shard *shards[DSMCC_MAX_SHARDS];
+	bool crc_checked = producer_checks_crc(state);
+	int count;
 
-	current = carousel->state->timeouts;
-	prev = NULL;
-	while (current)
+	count = route_section(state, pid, buffer->data, length, shards);
+	if (!count || (crc_checked && !dsmcc_section_check_crc(buffer->data, length)))
 	{
-		int match = current->carousel == carousel && current->type == type;
-		if (type == DSMCC_TIMEOUT_MODULE || type == DSMCC_TIMEOUT_NEXTBLOCK)
-			match &= current->module_id == module_id;
-		if (match)
-		{
-			if (prev)
-				prev->next = current->next;
-			else
-				carousel->state->timeouts = current->next;
-			free(current);
-			return;
-		}
-		prev = current;
-		current = current->next;
+		dsmcc_section_buffer_put(buffer);
+		return;
 	}
+
+	queue_section_action(state, init_section_buffer_action(buffer, pid, length, crc_checked), shards, count);
 }
 
-void dsmcc_timeout_remove_all(struct dsmcc_object_carousel *carousel)
+void dsmcc_add_section(struct dsmcc_state *state, uint16_t pid, uint8_t *data, int data_length)
 {
-	struct dsmcc_timeout *current, *prev, *next;
+	struct dsmcc_shard *shards[DSMCC_MAX_SHARDS];
+	bool crc_checked = producer_checks_crc(state);
+	int count;
+
+	count = route_section(state, pid, data, data_length, shards);
+	if (!count || (crc_checked && !dsmcc_section_check_crc(data, data_length)))
+		return;
+
+	if (data_length <= DSMCC_SECTION_MAX_SIZE)
+	{
+		struct dsmcc_section_buffer *buffer = dsmcc_section_buffer_get(state, data_length);
+		memcpy(buffer->data, data, data_length);
+		queue_section_action(state, init_section_buffer_action(buffer, pid, data_length, crc_checked), shards, count);
+		return;
+	}
+
+	queue_section_action(state, new_large_section_action(state, pid, data, data_length, crc_checked), shards, count);
+}
+
+void dsmcc_add_section_ref(struct dsmcc_state *state, uint16_t pid, uint8_t *data, int data_length, dsmcc_section_release_t *release, void *arg)
+{
+	struct dsmcc_shard *shards[DSMCC_MAX_SHARDS];
+	struct dsmcc_action *action;
+	bool crc_checked = producer_checks_crc(state);
+	int count;
+
+	count = route_section(state, pid, data, data_length, shards);
+	if (!count || (crc_checked && !dsmcc_section_check_crc(data, data_length)))
+	{
+		if (release)
+			(*release)(arg, data, data_length);
+		return;
+	}
+
+	action = dsmcc_pool_zalloc(state->action_pool);
+	action->type = DSMCC_ACTION_ADD_SECTION;
+	action->add_section.ref.pid = pid;
+	action->add_section.ref.data = data;
+	action->add_section.ref.length = data_length;
+	action->add_section.ref.crc_checked = crc_checked;
+	action->add_section.section = &action->add_section.ref;
+	action->add_section.release = release;
+	action->add_section.release_arg = arg;
+	queue_section_action(state, action, shards, count);
+}
 
-	current = carousel->state->timeouts;
-	prev = NULL;
-	while (current)
+/**
+  * queue up to DSMCC_SECTION_BATCH_SIZE sections for a shard, taking the buffers from the pools and reserving room in
+  * the queues for all of them at once
+  */
+static void add_section_batch(struct dsmcc_shard *shard, uint16_t pid, const struct iovec *sections, int count, bool crc_checked)
+{
+	struct dsmcc_state *state = shard->state;
+	struct dsmcc_action *actions[DSMCC_SECTION_BATCH_SIZE], *data_actions[DSMCC_SECTION_BATCH_SIZE], *action;
+	struct dsmcc_section_buffer *buffer;
+	void *buffers[DSMCC_SECTION_SIZE_CLASS_COUNT][DSMCC_SECTION_BATCH_SIZE];
+	int buffer_count[DSMCC_SECTION_SIZE_CLASS_COUNT];
+	int classes[DSMCC_SECTION_BATCH_SIZE];
+	int i, c, action_count = 0, data_count = 0, pushed = 0;
+	uint32_t data_bytes = 0, dropped_bytes = 0;
+
+	memset(buffer_count, 0, sizeof(buffer_count));
+	for (i = 0; i < count; i++)
 	{
-		next = current->next;
-		if (current->carousel == carousel)
+		if (sections[i].iov_len <= DSMCC_SECTION_MAX_SIZE)
 		{
-			free(current);
-			if (prev)
-				prev->next = next;
-			else
-				carousel->state->timeouts = next;
+			classes[i] = section_size_class(sections[i].iov_len);
+			buffer_count[classes[i]]++;
+		}
+		else
+			classes[i] = -1;
+	}
+	for (c = 0; c < DSMCC_SECTION_SIZE_CLASS_COUNT; c++)
+	{
+		if (buffer_count[c])
+			dsmcc_pool_alloc_many(state->section_pools[c], buffers[c], buffer_count[c]);
+		buffer_count[c] = 0;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		c = classes[i];
+		if (c >= 0)
+		{
+			buffer = buffers[c][buffer_count[c]++];
+			buffer->pool = state->section_pools[c];
+			buffer->size = section_sizes[c];
+			memcpy(buffer->data, sections[i].iov_base, sections[i].iov_len);
+			action = init_section_buffer_action(buffer, pid, sections[i].iov_len, crc_checked);
+		}
+		else
+			action = new_large_section_action(state, pid, sections[i].iov_base, sections[i].iov_len, crc_checked);
+
+		if (is_data_section(state, action->add_section.section))
+		{
+			data_actions[data_count++] = action;
+			data_bytes += sections[i].iov_len;
 		}
 		else
+			actions[action_count++] = action;
+	}
+
+	/* DDB sections: a single reservation if the whole batch fits in the queue, otherwise the policy applies to each */
+	if (data_count && reserve_data_space(shard, data_count, data_bytes))
+	{
+		pushed = dsmcc_ring_push_many(is_background_pid(shard, pid) ? shard->data_queue.background_ring : shard->data_queue.ring,
+				(void **) data_actions, data_count);
+		if (pushed < data_count)
 		{
-			prev = current;
+			for (i = pushed; i < data_count; i++)
+				dropped_bytes += data_actions[i]->add_section.section->length;
+			release_data_space(shard, data_count - pushed, dropped_bytes);
 		}
-		current = next;
 	}
+	for (i = pushed; i < data_count; i++)
+		push_data_action(shard, data_actions[i]);
+
+	pushed = action_count ? dsmcc_ring_push_many(shard->actions, (void **) actions, action_count) : 0;
+	for (i = pushed; i < action_count; i++)
+		push_action(shard, actions[i]);
 }
 
-void dsmcc_add_section(struct dsmcc_state *state, uint16_t pid, uint8_t *data, int data_length)
+void dsmcc_add_sections(struct dsmcc_state *state, uint16_t pid, const struct iovec *sections, int count)
 {
-	struct dsmcc_section *sect;
-	struct dsmcc_action *action;
+	struct dsmcc_shard *shards[DSMCC_MAX_SHARDS];
+	struct iovec batch[DSMCC_SECTION_BATCH_SIZE];
+	uint64_t needed[DSMCC_SECTION_BATCH_SIZE];
+	int i, j, n, batch_count, shard_count;
+	bool crc_checked = producer_checks_crc(state);
+
+	/* every shard gets its own copy of the sections */
+	shard_count = route_pid(state, pid, shards);
+	while (count > 0)
+	{
+		n = count < DSMCC_SECTION_BATCH_SIZE ? count : DSMCC_SECTION_BATCH_SIZE;
 
-	sect = malloc(sizeof(struct dsmcc_section) + data_length);
-	sect->pid = pid;
-	sect->data = ((uint8_t *) sect) + sizeof(struct dsmcc_section);
-	memcpy(sect->data, data, data_length);
-	sect->length = data_length;
+		/* the DDB sections no shard needs are dropped first, and the corrupt sections once for all the shards */
+		for (j = 0; j < n; j++)
+		{
+			needed[j] = shards_needing_section(state, shards, shard_count, sections[j].iov_base, sections[j].iov_len);
+			if (needed[j] && crc_checked && !dsmcc_section_check_crc(sections[j].iov_base, sections[j].iov_len))
+				needed[j] = 0;
+		}
 
-	action = calloc(1, sizeof(struct dsmcc_action));
-	action->type = DSMCC_ACTION_ADD_SECTION;
-	action->add_section.section = sect;
-	buffer_action(state, action);
+		for (i = 0; i < shard_count; i++)
+		{
+			batch_count = 0;
+			for (j = 0; j < n; j++)
+				if ((needed[j] >> i) & 1)
+					batch[batch_count++] = sections[j];
+			if (batch_count)
+				add_section_batch(shards[i], pid, batch, batch_count, crc_checked);
+		}
+		sections += n;
+		count -= n;
+	}
+
+	for (i = 0; i < shard_count; i++)
+		wake_thread_if_waiting(shards[i]);
 }
 
-uint32_t dsmcc_queue_carousel2(struct dsmcc_state *state, struct dsmcc_parameters *parameters, struct dsmcc_carousel_callbacks *callbacks)
+uint32_t dsmcc_queue_carousel3(struct dsmcc_state *state, struct dsmcc_parameters *parameters,
+		struct dsmcc_carousel_callbacks *callbacks, int priority)
 {
 	struct dsmcc_action *action;
 	uint32_t queue_id = 0;
@@ -657,18 +2001,24 @@ uint32_t dsmcc_queue_carousel2(struct dsmcc_state *state, struct dsmcc_parameter
 	queue_id = state->next_queue_id++;
 	pthread_mutex_unlock(&state->mutex);
 
-	action = calloc(1, sizeof(struct dsmcc_action));
+	action = dsmcc_pool_zalloc(state->action_pool);
 	action->type = DSMCC_ACTION_ADD_CAROUSEL;
 	action->add_carousel.queue_id = queue_id;
 	action->add_carousel.parameters = malloc(sizeof(struct dsmcc_parameters));
 	*(action->add_carousel.parameters) = *parameters;
 	action->add_carousel.parameters->downloadpath = strndup(parameters->downloadpath, strlen(parameters->downloadpath));
 	memcpy(&action->add_carousel.callbacks, callbacks, sizeof(struct dsmcc_carousel_callbacks));
-	buffer_action(state, action);
+	action->add_carousel.priority = priority;
+	buffer_action(dsmcc_shard_for_pid(state, parameters->pid), action);
 
 	return queue_id;
 }
 
+uint32_t dsmcc_queue_carousel2(struct dsmcc_state *state, struct dsmcc_parameters *parameters, struct dsmcc_carousel_callbacks *callbacks)
+{
+	return dsmcc_queue_carousel3(state, parameters, callbacks, DSMCC_PRIORITY_FOREGROUND);
+}
+
 uint32_t dsmcc_queue_carousel(struct dsmcc_state *state, uint16_t pid, uint32_t transaction_id, const char *downloadpath, struct dsmcc_carousel_callbacks *callbacks)
 {
 	struct dsmcc_parameters *parameters = malloc(sizeof(struct dsmcc_parameters));
@@ -699,30 +2049,41 @@ uint32_t dsmcc_queue_carousel(struct dsmcc_state *state, uint16_t pid, uint32_t
 void dsmcc_dequeue_carousel(struct dsmcc_state *state, uint32_t queue_id)
 {
 	struct dsmcc_action *action;
-	action = calloc(1, sizeof(struct dsmcc_action));
+	action = dsmcc_pool_zalloc(state->action_pool);
 	action->type = DSMCC_ACTION_REMOVE_CAROUSEL;
 	action->remove_carousel.queue_id = queue_id;
-	buffer_action(state, action);
+	buffer_action_all(state, action);
 }
 
 void dsmcc_cache_clear(struct dsmcc_state *state)
 {
 	struct dsmcc_action *action;
-	action = calloc(1, sizeof(struct dsmcc_action));
+	action = dsmcc_pool_zalloc(state->action_pool);
 	action->type = DSMCC_ACTION_CACHE_CLEAR;
-	buffer_action(state, action);
+	buffer_action_all(state, action);
 }
 
 void dsmcc_cache_clear_carousel(struct dsmcc_state *state, uint32_t carousel_id)
 {
 	struct dsmcc_action *action;
-	action = calloc(1, sizeof(struct dsmcc_action));
+	action = dsmcc_pool_zalloc(state->action_pool);
 	action->type = DSMCC_ACTION_CACHE_CLEAR_CAROUSEL;
 	action->cache_clear_carousel.carousel_id = carousel_id;
-	buffer_action(state, action);
+	buffer_action_all(state, action);
 }
 
 uint32_t dsmcc_transaction_id(struct dsmcc_state *state, uint32_t queue_id)
 {
-	return dsmcc_object_carousel_get_transaction_id(state, queue_id);
+	struct dsmcc_carousel_snapshot *snapshot;
+	uint32_t transaction_id = 0;
+
+	/* read from the published state, the carousels belong to the parsing threads */
+	snapshot = dsmcc_carousel_snapshot_get(state, queue_id);
+	if (snapshot)
+	{
+		transaction_id = snapshot->transaction_id;
+		dsmcc_carousel_snapshot_release(snapshot);
+	}
+
+	return transaction_id;
 }
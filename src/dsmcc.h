@@ -8,6 +8,15 @@
 #include <dsmcc/dsmcc.h>
 #include "dsmcc-debug.h"
 #include "dsmcc-section.h"
+#include "dsmcc-filter.h"
+#include "dsmcc-ring.h"
+#include "dsmcc-pool.h"
+#include "dsmcc-worker.h"
+#include "dsmcc-executor.h"
+#include "dsmcc-timeout.h"
+#include "dsmcc-dispatch.h"
+#include "dsmcc-snapshot.h"
+#include "dsmcc-ddb-index.h"
 
 enum
 {
@@ -33,24 +42,6 @@ struct dsmcc_stream
 	struct dsmcc_stream *next, *prev;
 };
 
-enum
-{
-	DSMCC_TIMEOUT_DSI,
-	DSMCC_TIMEOUT_DII,
-	DSMCC_TIMEOUT_MODULE,
-	DSMCC_TIMEOUT_NEXTBLOCK
-};
-
-struct dsmcc_timeout
-{
-	struct dsmcc_object_carousel *carousel;  /*< carousel this timeout applies to */
-	int                           type;      /*< type of timeout */
-	uint16_t                      module_id; /*< module ID, for type == DSMCC_TIMEOUT_MODULE or DSMCC_TIMEOUT_NEXTBLOCK */
-	struct timeval                abstime;   /*< absolute time */
-
-	struct dsmcc_timeout *next;
-};
-
 enum
 {
 	DSMCC_ACTION_ADD_CAROUSEL,
@@ -58,6 +49,7 @@ enum
 	DSMCC_ACTION_ADD_SECTION,
 	DSMCC_ACTION_CACHE_CLEAR,
 	DSMCC_ACTION_CACHE_CLEAR_CAROUSEL,
+	DSMCC_ACTION_MODULE_PROCESSED,
 };
 
 struct dsmcc_action
@@ -69,6 +61,7 @@ struct dsmcc_action
 			uint32_t queue_id;
 			struct dsmcc_parameters *parameters;
 			struct dsmcc_carousel_callbacks callbacks;
+			int priority;
 		} add_carousel;
 
 		struct {
@@ -76,43 +69,190 @@ struct dsmcc_action
 		} remove_carousel;
 
 		struct {
-			struct dsmcc_section *section;
+			struct dsmcc_section        *section;
+			struct dsmcc_section_buffer *buffer;      /*< pooled buffer containing the section, NULL if the section was malloc'ed */
+			dsmcc_section_release_t     *release;     /*< for a section added by dsmcc_add_section_ref, releases the caller's buffer */
+			void                        *release_arg;
+			struct dsmcc_section         ref;         /*< for a section added by dsmcc_add_section_ref, points to the caller's buffer */
 		} add_section;
 
 		struct {
 			uint32_t carousel_id;
 		} cache_clear_carousel;
+
+		struct {
+			struct dsmcc_module_job *job;
+		} module_processed;
 	};
 
 	struct dsmcc_action *next;
 };
 
+/* section buffer from a section pool, carries its own action so a section can be queued without any allocation (once
+ * the pool has grown to the number of sections in flight) */
+struct dsmcc_section_buffer
+{
+	struct dsmcc_action   action;
+	struct dsmcc_section  section;
+	struct dsmcc_pool    *pool;   /*< pool of the size class of this buffer */
+	int                   size;   /*< size of data */
+	uint8_t               data[];
+};
+
+/* number of actions that can be queued for the thread, producers wait when it is full */
+#define DSMCC_ACTION_QUEUE_SIZE 4096
+
+/* the actions are processed before the DDB sections queued earlier, but at most this number of them in a row while a
+ * DDB section is waiting */
+#define DSMCC_MAX_OVERTAKE 32
+
+/* number of DDB sections that can be queued for the thread, upper bound of the max_sections limit */
+#define DSMCC_DATA_QUEUE_SIZE 4096
+
+/* number of sections queued at once by dsmcc_add_sections */
+#define DSMCC_SECTION_BATCH_SIZE 64
+
+/* DDB sections queued for the thread, bounded by count and size */
+struct dsmcc_data_queue
+{
+	struct dsmcc_ring *ring;
+	struct dsmcc_ring *background_ring; /*< DDB sections on the PIDs of background carousels only, the limits apply to both rings */
+
+	uint32_t max_sections;
+	uint32_t max_bytes;       /*< 0 if unlimited */
+	int      policy;          /*< DSMCC_QUEUE_POLICY_* */
+
+	uint32_t queued_sections;
+	uint32_t queued_bytes;
+	uint64_t dropped_oldest;
+	uint64_t dropped_newest;
+	uint64_t dropped_known;
+	uint64_t blocked;
+
+	pthread_mutex_t mutex;    /*< with cond, used by producers waiting for room in the queue */
+	pthread_cond_t  cond;
+	int             waiters;
+};
+
+/* data sizes of the section pools, the last one must be DSMCC_SECTION_MAX_SIZE */
+#define DSMCC_SECTION_SIZE_CLASSES { 256, 1024, DSMCC_SECTION_MAX_SIZE }
+#define DSMCC_SECTION_SIZE_CLASS_COUNT 3
+
+/* number of objects allocated at once when a pool is empty */
+#define DSMCC_POOL_SLAB_OBJECTS         64
+#define DSMCC_SECTION_POOL_SLAB_OBJECTS 16
+
+/* size of a bitmap of all the PIDs */
+#define DSMCC_PID_MAP_SIZE (8192 / 8)
+
+/* PIDs of the streams with queued requests, published for the TS parser */
+struct dsmcc_stream_pids
+{
+	pthread_mutex_t mutex;
+	uint32_t        generation;              /*< incremented each time the set of PIDs changes */
+	uint8_t         map[DSMCC_PID_MAP_SIZE];
+};
+
+/* maximum number of parsing threads */
+#define DSMCC_MAX_SHARDS 64
+
+/* a parsing thread with the carousels it downloads, a carousel is assigned to a shard by its requested PID */
+struct dsmcc_shard
+{
+	struct dsmcc_task   task;  /*< run by the executor of the state, if it has one */
+	struct dsmcc_state *state;
+	int                 index;
+	char               *cachefile; /*< name of the file where the carousels of this shard are cached */
+
+	struct dsmcc_stream          *streams;   /*< Linked list of streams, used to cache assoc_tag/pid mapping and to queue requests */
+	struct dsmcc_object_carousel *carousels; /*< Linked list of carousels */
+	struct dsmcc_timeouts         timeouts;
+	struct timeval                now;       /*< time at the start of the current processing pass */
+	bool                          dirty;     /*< the carousels changed since the state file was last saved */
+
+	pthread_t               thread;
+	struct dsmcc_ring      *actions;                        /*< actions queued for the thread, except DDB sections */
+	struct dsmcc_data_queue data_queue;                     /*< DDB sections queued for the thread */
+	int                     overtaken;                      /*< actions processed while a DDB section was waiting */
+	struct dsmcc_action    *next_action, *next_data_action; /*< actions taken from the queues by the thread, not processed yet */
+	struct dsmcc_action    *next_background_action;         /*< same for the background DDB queue */
+	int                     background_overtaken;           /*< actions processed while a background DDB section was waiting */
+	int64_t                 background_tokens;              /*< bytes of background DDB sections that can be processed, when the budget is limited */
+	struct timeval          background_refill;              /*< time background_tokens was last refilled */
+	struct dsmcc_action    *first_deferred, *last_deferred; /*< actions queued by the thread itself while the ring was full */
+	int                     event_fd;                       /*< eventfd used to wake up the thread */
+	int                     waiting;                        /*< set by the thread before sleeping on event_fd */
+
+	uint8_t pid_map[DSMCC_PID_MAP_SIZE];            /*< PIDs of the streams of this shard with queued requests, used to route sections */
+	uint8_t background_pid_map[DSMCC_PID_MAP_SIZE]; /*< PIDs of pid_map where all the requests are for background carousels */
+
+	struct dsmcc_snapshot_index *snapshots;         /*< published state of the queued carousels, read by dsmcc_carousel_snapshot_get */
+	struct dsmcc_snapshot_index *retired_snapshots; /*< replaced indexes, freed once no reader can be using them */
+	int                          snapshot_readers;  /*< number of threads reading snapshots */
+	bool                         snapshots_dirty;   /*< the state of the queued carousels changed since snapshots was published */
+
+	struct dsmcc_ddb_index ddb_index; /*< blocks stored by the modules, to drop the DDB sections before queueing them */
+};
+
 struct dsmcc_state
 {
 	char *cachedir;   /*< path of the directory where cached files will be stored */
-	char *cachefile;  /*< name of the file where cached state will be stored */
 	bool  keep_cache; /*< if the cache should be kept at exit */
 	uint32_t next_queue_id;
 
 	struct dsmcc_dvb_callbacks callbacks;    /*< Callbacks called to interract with DVB stack */
 
-	struct dsmcc_stream          *streams;   /*< Linked list of streams, used to cache assoc_tag/pid mapping and to queue requests */
-	struct dsmcc_object_carousel *carousels; /*< Linked list of carousels */
-
-	pthread_t       thread;
-	pthread_mutex_t mutex;
-	pthread_cond_t  cond;
+	pthread_mutex_t mutex;    /*< protects next_queue_id */
 	int             stop;
 
-	struct dsmcc_action *first_action, *last_action;
-	struct dsmcc_timeout *timeouts;
+	struct dsmcc_shard *shards;
+	int                 shard_count;
+
+	bool            threadless;    /*< no thread, the shards are processed by dsmcc_process */
+	pthread_mutex_t process_mutex; /*< threadless mode: held while processing the shards */
+	int             timer_fd;      /*< threadless mode: expires with the earliest timeout of the shards */
+	int             epoll_fd;      /*< threadless mode: gathers timer_fd and the eventfds of the shards */
+	int             next_shard;    /*< threadless mode: shard processed first by the next dsmcc_process call */
+
+	/* queued requests using each table ID for their DDB sections and for their DSI/DII sections, a table ID is only
+	 * routed to the DDB queue if no request uses it for DSI/DII sections */
+	int data_table_refs[256];
+	int control_table_refs[256];
+
+	uint32_t background_budget; /*< bytes of background DDB sections processed per second by each shard, 0 if unlimited */
+
+	int crc_check; /*< DSMCC_CRC_CHECK_*, read by the producers and the parsing threads */
+
+	struct dsmcc_executor *executor; /*< threads running the shards, shared with other states, NULL if the shards have their own threads */
+	struct dsmcc_workers  *workers;  /*< threads processing the downloaded modules, those of the executor if there is one */
+
+	struct dsmcc_dispatcher *dispatcher; /*< thread calling the notification callbacks, NULL if they are called by the parsing threads */
+
+	struct dsmcc_pool *section_pools[DSMCC_SECTION_SIZE_CLASS_COUNT]; /*< pooled section buffers, by size class */
+	struct dsmcc_pool *action_pool;
+	struct dsmcc_pool *timeout_pool;
+	struct dsmcc_pool *queue_entry_pool;
+	struct dsmcc_pool *dentry_pool;
+
+	struct dsmcc_section_filters section_filters; /*< section filters set by the carousels, for use by the TS parser */
+	struct dsmcc_stream_pids     stream_pids;     /*< PIDs needed by the carousels of all the shards, for use by the TS parser */
 };
 
-struct dsmcc_stream *dsmcc_stream_find_by_pid(struct dsmcc_state *state, uint16_t pid);
+struct dsmcc_shard *dsmcc_shard_for_pid(struct dsmcc_state *state, uint16_t pid);
+void dsmcc_shard_queue_module_job(struct dsmcc_shard *shard, struct dsmcc_module_job *job);
+
+struct dsmcc_stream *dsmcc_stream_find_by_pid(struct dsmcc_shard *shard, uint16_t pid);
 
 struct dsmcc_object_carousel *dsmcc_stream_queue_find(struct dsmcc_stream *stream, int type, uint32_t id);
 struct dsmcc_stream *dsmcc_stream_queue_add(struct dsmcc_object_carousel *carousel, int stream_selector_type, uint16_t stream_selector, int type, uint32_t id);
+void dsmcc_stream_pids_update(struct dsmcc_shard *shard);
 void dsmcc_stream_queue_remove(struct dsmcc_object_carousel *carousel, int type);
+uint32_t dsmcc_stream_pids_get(struct dsmcc_state *state, uint8_t *map);
+void dsmcc_table_ids_update(struct dsmcc_state *state, uint8_t control_table_id, uint8_t data_table_id, int delta);
+
+struct dsmcc_section_buffer *dsmcc_section_buffer_get(struct dsmcc_state *state, int length);
+void dsmcc_section_buffer_put(struct dsmcc_section_buffer *buffer);
+void dsmcc_section_buffer_queue(struct dsmcc_state *state, struct dsmcc_section_buffer *buffer, uint16_t pid, int length);
 
 void dsmcc_timeout_set(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id, uint32_t delay_us);
 void dsmcc_timeout_remove(struct dsmcc_object_carousel *carousel, int type, uint16_t module_id);
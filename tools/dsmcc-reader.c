@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <linux/limits.h>
 
 #include <dsmcc/dsmcc.h>
@@ -15,6 +16,8 @@
 
 static int g_running = 1;
 static int g_complete = 0;
+static int g_threadless = 0;
+static int g_async_callbacks = 0;
 static pthread_mutex_t g_mutex;
 static pthread_cond_t g_cond;
 
@@ -145,16 +148,18 @@ static void carousel_status_changed(void *arg, uint32_t queue_id, uint32_t cid,
 	}
 };
 
+#define READ_BUFFER_SIZE (64 * 1024)
+
 static int parse_stream(FILE *ts, struct dsmcc_state *state, struct dsmcc_tsparser_buffer **buffers)
 {
-	char buf[188];
+	static unsigned char buf[READ_BUFFER_SIZE];
 	int ret = 0;
 	int rc;
 
 	while (g_running && !g_complete)
 	{
-		rc = fread(buf, 1, 188, ts);
-		if (rc < 0)
+		rc = fread(buf, 1, READ_BUFFER_SIZE, ts);
+		if (rc < 0 || ferror(ts))
 		{
 			fprintf(stderr, "read error : %s\n", strerror(errno));
 			ret = -1;
@@ -168,13 +173,38 @@ static int parse_stream(FILE *ts, struct dsmcc_state *state, struct dsmcc_tspars
 		}
 		else
 		{
-			dsmcc_tsparser_parse_packet(state, buffers, (unsigned char*) buf, rc); 
+			dsmcc_tsparser_parse_buffer(state, buffers, buf, rc);
+			if (g_threadless)
+				dsmcc_process(state, 0);
 		}
 	}
 
 	return ret;
 }
 
+static void wait_threadless(struct dsmcc_state *state)
+{
+	struct pollfd pfd;
+	struct timeval now, end;
+
+	gettimeofday(&end, NULL);
+	end.tv_sec += 60;
+
+	pfd.fd = dsmcc_get_fd(state);
+	pfd.events = POLLIN;
+	while (g_running && !g_complete)
+	{
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, &end, <))
+		{
+			fprintf(stderr, "Time out!\n");
+			break;
+		}
+		if (poll(&pfd, 1, 100) > 0)
+			dsmcc_process(state, 0);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	struct dsmcc_state *state;
@@ -185,14 +215,24 @@ int main(int argc, char **argv)
 	uint16_t pid;
 	uint32_t qid;
 	int log_level = DSMCC_LOG_DEBUG;
+	bool section_filtering = 0;
+	bool pid_tracking = 0;
+	int threads = 0;
+	int executor_threads = -1;
+	struct dsmcc_executor *executor = NULL;
+	int priority = DSMCC_PRIORITY_FOREGROUND;
+	uint32_t background_budget = 0;
+	int crc_check = DSMCC_CRC_CHECK_PARSER;
 	struct dsmcc_tsparser_buffer *buffers = NULL;
 	struct dsmcc_dvb_callbacks dvb_callbacks;
 	struct dsmcc_carousel_callbacks car_callbacks;
 	struct dsmcc_parameters *parameters;
+	struct dsmcc_state_parameters state_parameters;
+	struct dsmcc_carousel_snapshot *snapshot;
 
 	if(argc < 4)
 	{
-		fprintf(stderr, "usage %s [-d] [-q] <file> <pid> <downloadpath>\n -q    almost quiet\n -d    data carousel\n", argv[0]);
+		fprintf(stderr, "usage %s [-d] [-q] [-f] [-a] [-t <threads>] [-n] [-c] [-b <bytes_per_second>] [-x <threads>] [-k producer|none] <file> <pid> <downloadpath>\n -q    almost quiet\n -d    data carousel\n -f    section filtering in TS parser\n -a    automatic PID tracking in TS parser\n -t    number of parsing threads\n -n    threadless mode, sections are processed by the main thread\n -c    callbacks called from a dedicated thread\n -b    background carousel, processed at most at the given rate (0 for no limit)\n -x    parsing threads run on a shared executor with the given number of threads\n -k    CRC of the sections checked when they are added, or not checked\n", argv[0]);
 		return -1;
 	}
 
@@ -212,6 +252,66 @@ int main(int argc, char **argv)
 			argv++;
 			argc--;
 		}
+		else if(!strcmp(argv[1], "-f"))
+		{
+			fprintf(stderr, "section filtering mode\n");
+			section_filtering = 1;
+			argv++;
+			argc--;
+		}
+		else if(!strcmp(argv[1], "-a"))
+		{
+			fprintf(stderr, "automatic PID tracking mode\n");
+			pid_tracking = 1;
+			argv++;
+			argc--;
+		}
+		else if(!strcmp(argv[1], "-t") && argc > 5)
+		{
+			threads = atoi(argv[2]);
+			fprintf(stderr, "%d parsing threads\n", threads);
+			argv += 2;
+			argc -= 2;
+		}
+		else if(!strcmp(argv[1], "-n"))
+		{
+			fprintf(stderr, "threadless mode\n");
+			g_threadless = 1;
+			argv++;
+			argc--;
+		}
+		else if(!strcmp(argv[1], "-c"))
+		{
+			fprintf(stderr, "asynchronous callbacks mode\n");
+			g_async_callbacks = 1;
+			argv++;
+			argc--;
+		}
+		else if(!strcmp(argv[1], "-b") && argc > 5)
+		{
+			priority = DSMCC_PRIORITY_BACKGROUND;
+			background_budget = atoi(argv[2]);
+			fprintf(stderr, "background carousel, %u bytes/s\n", background_budget);
+			argv += 2;
+			argc -= 2;
+		}
+		else if(!strcmp(argv[1], "-x") && argc > 5)
+		{
+			executor_threads = atoi(argv[2]);
+			fprintf(stderr, "shared executor with %d threads\n", executor_threads);
+			argv += 2;
+			argc -= 2;
+		}
+		else if(!strcmp(argv[1], "-k") && argc > 5)
+		{
+			if (!strcmp(argv[2], "producer"))
+				crc_check = DSMCC_CRC_CHECK_PRODUCER;
+			else if (!strcmp(argv[2], "none"))
+				crc_check = DSMCC_CRC_CHECK_NONE;
+			fprintf(stderr, "CRC check mode %d\n", crc_check);
+			argv += 2;
+			argc -= 2;
+		}
 		else
 			break; // assume options end
 	}
@@ -241,9 +341,24 @@ int main(int argc, char **argv)
 
 		dvb_callbacks.get_pid_for_assoc_tag = &get_pid_for_assoc_tag;
 		dvb_callbacks.add_section_filter = &add_section_filter;
-		state = dsmcc_open("/tmp/dsmcc-cache", 1, &dvb_callbacks);
+		memset(&state_parameters, 0, sizeof(state_parameters));
+		state_parameters.threads = threads;
+		state_parameters.threadless = g_threadless;
+		state_parameters.async_callbacks = g_async_callbacks;
+		if (executor_threads >= 0)
+		{
+			executor = dsmcc_executor_new(executor_threads, 0);
+			state_parameters.executor = executor;
+		}
+		state = dsmcc_open2("/tmp/dsmcc-cache", 1, &dvb_callbacks, &state_parameters);
+		dsmcc_set_background_budget(state, background_budget);
+		dsmcc_set_crc_check(state, crc_check);
 
-		dsmcc_tsparser_add_pid(&buffers, pid);
+		if (pid_tracking)
+			dsmcc_tsparser_set_pid_tracking(&buffers, 1);
+		else
+			dsmcc_tsparser_add_pid(&buffers, pid);
+		dsmcc_tsparser_set_section_filtering(&buffers, section_filtering);
 
 		car_callbacks.dentry_check = &dentry_check;
 		car_callbacks.dentry_saved = &dentry_saved;
@@ -260,15 +375,25 @@ int main(int argc, char **argv)
 		parameters->transaction_id = 0;
 		parameters->downloadpath = strndup(downloadpath, strlen(downloadpath));
 
-		qid = dsmcc_queue_carousel2(state, parameters, &car_callbacks);
+		qid = dsmcc_queue_carousel3(state, parameters, &car_callbacks, priority);
+		/* the request is processed with the sections, before them */
+		if (g_threadless)
+			dsmcc_process(state, 0);
 
 		free(parameters->downloadpath);
 		free(parameters);
 
 		status = parse_stream(ts, state, &buffers);
 
+		if (g_threadless)
+		{
+			if (!g_complete)
+				fprintf(stderr, "Waiting 60s for carousel completion...\n");
+			wait_threadless(state);
+		}
+
 		pthread_mutex_lock(&g_mutex);
-		if (!g_complete)
+		if (!g_threadless && !g_complete)
 		{
 			struct timeval now;
 			struct timespec ts;
@@ -281,9 +406,19 @@ int main(int argc, char **argv)
 		}
 		pthread_mutex_unlock(&g_mutex);
 
+		snapshot = dsmcc_carousel_snapshot_get(state, qid);
+		if (snapshot)
+		{
+			fprintf(stderr, "Carousel 0x%08x: status %d, %u/%u bytes, %d modules, %d directories/files saved\n",
+					snapshot->cid, snapshot->status, snapshot->downloaded, snapshot->total,
+					snapshot->module_count, snapshot->dentry_count);
+			dsmcc_carousel_snapshot_release(snapshot);
+		}
+
 		dsmcc_dequeue_carousel(state, qid);
 
 		dsmcc_close(state);
+		dsmcc_executor_free(executor);
 		dsmcc_tsparser_free_buffers(&buffers);
 	}
 	else